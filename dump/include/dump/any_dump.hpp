@@ -0,0 +1,155 @@
+// Copyright 2010-2022 Google LLC
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// AnyDump is a move-only, type-erased holder for DUMP() records.
+//
+// Every DUMP() call site produces its own Dump<F> type, since F is a unique
+// lambda. AnyDump stores any of them inline, in a fixed-size buffer, so dumps
+// from different call sites can share a container or cross a non-template API
+// without std::function and its heap allocation.
+//
+// Example:
+//   std::vector<dump::AnyDump> records;
+//   records.emplace_back(DUMP(foo, bar));
+//   records.emplace_back(DUMP(baz).as("qux"));
+//   // Prints: foo = 42, bar = 24
+//   //         qux = hello
+//   for (const auto& record : records) LOG(INFO) << record;
+//
+//                    ====[ Limitations ]====
+//
+// AnyDump never allocates. A dump that does not fit in the inline storage is
+// rejected at compile time; use dump::BasicAnyDump<N> for a larger buffer.
+//
+// AnyDump does not change how DUMP() captures its arguments: they are still
+// referenced, and evaluated each time the record is printed, so they must
+// outlive the AnyDump.
+// To keep the values instead, store a snapshot of the dump (see
+// snapshot.hpp).
+
+#ifndef DUMP_ANY_DUMP_HPP_
+#define DUMP_ANY_DUMP_HPP_
+
+#include <cstddef>
+#include <new>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+namespace dump {
+namespace internal_dump {
+
+// Operations on a type-erased dump stored in an AnyDump buffer.
+struct AnyDumpOps {
+  void (*print)(const void* self, ::std::ostream& os);
+  // Move-constructs `*src` into `dst`, then destroys `*src`.
+  void (*relocate)(void* dst, void* src) noexcept;
+  void (*destroy)(void* self) noexcept;
+};
+
+template <class D>
+inline constexpr AnyDumpOps kAnyDumpOps = {
+    /*print=*/[](const void* self, ::std::ostream& os) {
+      os << *static_cast<const D*>(self);
+    },
+    /*relocate=*/[](void* dst, void* src) noexcept {
+      ::new (dst) D(::std::move(*static_cast<D*>(src)));
+      static_cast<D*>(src)->~D();
+    },
+    /*destroy=*/[](void* self) noexcept {
+      static_cast<D*>(self)->~D();
+    },
+};
+
+}  // namespace internal_dump
+
+// Default inline storage, large enough for a Dump of 8 arguments.
+inline constexpr ::std::size_t kAnyDumpCapacity = 192;
+
+template <::std::size_t Capacity>
+class BasicAnyDump {
+ public:
+  BasicAnyDump() = default;
+
+  // Implicit, like std::function, so DUMP() records can be pushed directly.
+  template <class D,
+            class = ::std::enable_if_t<
+                !::std::is_same_v<::std::remove_cvref_t<D>, BasicAnyDump>>>
+  BasicAnyDump(D&& dump) {  // NOLINT(runtime/explicit)
+    using T = ::std::remove_cvref_t<D>;
+    static_assert(sizeof(T) <= Capacity,
+                  "Dump is too large for this AnyDump, use a larger "
+                  "BasicAnyDump<Capacity>");
+    static_assert(alignof(T) <= alignof(::std::max_align_t),
+                  "Dump is over-aligned for AnyDump");
+    static_assert(::std::is_nothrow_move_constructible_v<T>,
+                  "AnyDump requires a nothrow move constructible Dump");
+    ::new (static_cast<void*>(storage_)) T(::std::forward<D>(dump));
+    ops_ = &internal_dump::kAnyDumpOps<T>;
+  }
+
+  BasicAnyDump(BasicAnyDump&& other) noexcept { take(other); }
+
+  BasicAnyDump& operator=(BasicAnyDump&& other) noexcept {
+    if (this != &other) {
+      reset();
+      take(other);
+    }
+    return *this;
+  }
+
+  BasicAnyDump(const BasicAnyDump&) = delete;
+  BasicAnyDump& operator=(const BasicAnyDump&) = delete;
+
+  ~BasicAnyDump() { reset(); }
+
+  bool empty() const { return ops_ == nullptr; }
+
+  void reset() {
+    if (ops_ != nullptr) {
+      ops_->destroy(storage_);
+      ops_ = nullptr;
+    }
+  }
+
+  ::std::string str() const {
+    ::std::ostringstream oss;
+    oss << *this;
+    return oss.str();
+  }
+
+  friend ::std::ostream& operator<<(::std::ostream& os,
+                                    const BasicAnyDump& dump) {
+    if (dump.ops_ != nullptr) dump.ops_->print(dump.storage_, os);
+    return os;
+  }
+
+ private:
+  void take(BasicAnyDump& other) noexcept {
+    if (other.ops_ != nullptr) {
+      other.ops_->relocate(storage_, other.storage_);
+      ops_ = ::std::exchange(other.ops_, nullptr);
+    }
+  }
+
+  const internal_dump::AnyDumpOps* ops_ = nullptr;
+  alignas(::std::max_align_t) unsigned char storage_[Capacity];
+};
+
+using AnyDump = BasicAnyDump<kAnyDumpCapacity>;
+
+}  // namespace dump
+
+#endif // DUMP_ANY_DUMP_HPP_
@@ -0,0 +1,644 @@
+// Copyright 2010-2022 Google LLC
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// ArrowSink writes DUMP() records as Apache Arrow IPC files.
+//
+// The records of a DUMP() call site all have the same fields, so each call
+// site gets its own Arrow table: values are buffered column by column, and
+// written as record batches. Files open directly in Arrow based tools
+// (pyarrow.feather, polars, DuckDB...).
+//
+// Example:
+//   int tables = 0;
+//   dump::ArrowSink arrow([&](const dump::internal_dump::DumpSite& site,
+//                             dump::internal_dump::DumpNames names) {
+//     return std::make_unique<std::ofstream>(
+//         "dump_" + std::to_string(tables++) + ".arrow", std::ios::binary);
+//   });
+//   for (const auto& p : points) {
+//     arrow << DUMP(p.x, p.y);  // Columns "p.x" and "p.y".
+//   }
+//
+// Columns of bool, integer and floating point values get the Arrow type of
+// the same width. Chars and strings are Utf8 columns, as are values of other
+// types, formatted with their operator<< when written.
+//
+// Records are grouped by call site and names: each set of names a call site
+// is renamed to with Dump::as() gets a table of its own, with them as column
+// names. The opener may return nullptr instead of a stream, which drops the
+// records of the table.
+//
+// The sink writes a record batch of a call site once it has `batch_rows`
+// rows, or on flush(). Files are complete once the sink is closed or
+// destroyed. With the `stream` option, the sink writes the IPC streaming
+// format instead, which has no footer and can be read while being written.
+//
+// A sink is not thread-safe.
+//
+// The Arrow metadata is written with a minimal in-tree FlatBuffers writer:
+// there is no dependency on the Arrow or FlatBuffers libraries.
+
+#ifndef DUMP_ARROW_HPP_
+#define DUMP_ARROW_HPP_
+
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "dump/dump.hpp"
+
+namespace dump {
+namespace internal_dump {
+
+inline void put_le(::std::vector<::std::uint8_t>& out, ::std::uint64_t value,
+                   int size) {
+  for (int i = 0; i < size; ++i) {
+    out.push_back(static_cast<::std::uint8_t>(value >> (8 * i)));
+  }
+}
+
+// Minimal FlatBuffers writer, enough for the Arrow IPC metadata.
+//
+// Objects are written front to back: a table or vector is written before the
+// objects it refers to, which are written by callbacks, and its offsets to
+// them are patched once they are.
+class FlatBufferWriter {
+ public:
+  // Writes an object, and returns its position.
+  using Child = ::std::function<::std::size_t(FlatBufferWriter&)>;
+
+  struct Field {
+    int id;
+    // Size of a scalar field, or 0 for an offset to `child`.
+    int size;
+    ::std::uint64_t bits;
+    Child child;
+  };
+
+  template <class T>
+  static Field scalar(int id, T value) {
+    using Wide = ::std::conditional_t<::std::is_signed_v<T>, ::std::int64_t,
+                                      ::std::uint64_t>;
+    return Field{
+        .id=id,
+        .size=sizeof(T),
+        .bits=static_cast<::std::uint64_t>(static_cast<Wide>(value)),
+        .child=nullptr,
+    };
+  }
+
+  static Field offset(int id, Child child) {
+    return Field{.id=id, .size=0, .bits=0, .child=::std::move(child)};
+  }
+
+  // Returns a buffer whose root is the table written by `root`, padded to a
+  // multiple of 8 bytes.
+  static ::std::vector<::std::uint8_t> finish(const Child& root) {
+    FlatBufferWriter w;
+    put_le(w.buf_, 0, 4);
+    w.patch_(0, root(w));
+    w.align_(8);
+    return ::std::move(w.buf_);
+  }
+
+  ::std::size_t table(::std::vector<Field> fields) {
+    // Inline, the vtable offset is followed by the fields, largest first so
+    // that they are aligned without padding.
+    ::std::stable_sort(fields.begin(), fields.end(),
+                       [](const Field& a, const Field& b) {
+                         return inline_size_(a) > inline_size_(b);
+                       });
+    int slots = 0;
+    for (const Field& f : fields) slots = ::std::max(slots, f.id + 1);
+    ::std::vector<::std::uint16_t> offsets(slots, 0);
+    ::std::size_t size = 4;
+    for (const Field& f : fields) {
+      size = align_up_(size, inline_size_(f));
+      offsets[f.id] = static_cast<::std::uint16_t>(size);
+      size += inline_size_(f);
+    }
+    align_(2);
+    const ::std::size_t vtable = buf_.size();
+    put_le(buf_, 4 + 2 * slots, 2);
+    put_le(buf_, size, 2);
+    for (::std::uint16_t offset : offsets) put_le(buf_, offset, 2);
+    // Tables are 8-byte aligned, so are their fields.
+    align_(8);
+    const ::std::size_t table = buf_.size();
+    put_le(buf_, table - vtable, 4);
+    for (const Field& f : fields) {
+      buf_.resize(table + offsets[f.id], 0);
+      put_le(buf_, f.bits, inline_size_(f));
+    }
+    for (const Field& f : fields) {
+      if (f.child) patch_(table + offsets[f.id], f.child(*this));
+    }
+    return table;
+  }
+
+  ::std::size_t string(::std::string_view s) {
+    align_(4);
+    const ::std::size_t pos = buf_.size();
+    put_le(buf_, s.size(), 4);
+    buf_.insert(buf_.end(), s.begin(), s.end());
+    buf_.push_back(0);
+    return pos;
+  }
+
+  // Writes a vector of `count` structs, 8-byte aligned.
+  ::std::size_t structs(const ::std::vector<::std::uint8_t>& bytes,
+                        ::std::size_t count) {
+    while ((buf_.size() + 4) % 8 != 0) buf_.push_back(0);
+    const ::std::size_t pos = buf_.size();
+    put_le(buf_, count, 4);
+    buf_.insert(buf_.end(), bytes.begin(), bytes.end());
+    return pos;
+  }
+
+  ::std::size_t tables(const ::std::vector<Child>& children) {
+    align_(4);
+    const ::std::size_t pos = buf_.size();
+    put_le(buf_, children.size(), 4);
+    buf_.resize(buf_.size() + 4 * children.size(), 0);
+    for (::std::size_t i = 0; i < children.size(); ++i) {
+      patch_(pos + 4 + 4 * i, children[i](*this));
+    }
+    return pos;
+  }
+
+ private:
+  static int inline_size_(const Field& f) { return f.child ? 4 : f.size; }
+
+  static ::std::size_t align_up_(::std::size_t n, ::std::size_t alignment) {
+    return (n + alignment - 1) / alignment * alignment;
+  }
+
+  void align_(::std::size_t alignment) {
+    buf_.resize(align_up_(buf_.size(), alignment), 0);
+  }
+
+  // Makes the offset at `at` refer to `target`, which follows it.
+  void patch_(::std::size_t at, ::std::size_t target) {
+    const auto offset = static_cast<::std::uint32_t>(target - at);
+    for (int i = 0; i < 4; ++i) {
+      buf_[at + i] = static_cast<::std::uint8_t>(offset >> (8 * i));
+    }
+  }
+
+  ::std::vector<::std::uint8_t> buf_;
+};
+
+//                    ====[ Arrow ]====
+
+inline constexpr char kArrowMagic[] = "ARROW1";
+inline constexpr ::std::uint32_t kArrowContinuation = 0xFFFFFFFF;
+inline constexpr ::std::int16_t kArrowMetadataV5 = 4;
+
+// MessageHeader union.
+enum ArrowMessage : ::std::uint8_t {
+  kArrowSchema = 1,
+  kArrowRecordBatch = 3,
+};
+
+// Type union.
+enum ArrowTypeId : ::std::uint8_t {
+  kArrowInt = 2,
+  kArrowFloatingPoint = 3,
+  kArrowUtf8 = 5,
+  kArrowBool = 6,
+};
+
+// Column types.
+enum ArrowType : ::std::uint8_t {
+  kArrowColumnBool,
+  kArrowColumnInt8,
+  kArrowColumnUInt8,
+  kArrowColumnInt16,
+  kArrowColumnUInt16,
+  kArrowColumnInt32,
+  kArrowColumnUInt32,
+  kArrowColumnInt64,
+  kArrowColumnUInt64,
+  kArrowColumnFloat,
+  kArrowColumnDouble,
+  kArrowColumnUtf8,
+};
+
+template <class T>
+constexpr ArrowType arrow_type() {
+  if constexpr (::std::is_same_v<T, bool>) {
+    return kArrowColumnBool;
+  } else if constexpr (::std::is_integral_v<T> && !::std::is_same_v<T, char>) {
+    constexpr bool is_signed = ::std::is_signed_v<T>;
+    if constexpr (sizeof(T) == 1) {
+      return is_signed ? kArrowColumnInt8 : kArrowColumnUInt8;
+    }
+    if constexpr (sizeof(T) == 2) {
+      return is_signed ? kArrowColumnInt16 : kArrowColumnUInt16;
+    }
+    if constexpr (sizeof(T) == 4) {
+      return is_signed ? kArrowColumnInt32 : kArrowColumnUInt32;
+    }
+    if constexpr (sizeof(T) == 8) {
+      return is_signed ? kArrowColumnInt64 : kArrowColumnUInt64;
+    }
+  } else if constexpr (::std::is_same_v<T, float>) {
+    return kArrowColumnFloat;
+  } else if constexpr (::std::is_floating_point_v<T>) {
+    return kArrowColumnDouble;
+  } else {
+    return kArrowColumnUtf8;
+  }
+}
+
+// Values of a column, in Arrow layout.
+struct ArrowColumn {
+  ArrowType type;
+  // Fixed-width values, bits of bools, or UTF-8 chars of strings.
+  ::std::vector<::std::uint8_t> values = {};
+  // Offsets of strings in `values`.
+  ::std::vector<::std::int32_t> offsets = {0};
+};
+
+template <class T>
+void append_arrow_value(ArrowColumn& column, ::std::size_t row,
+                        const T& value) {
+  constexpr ArrowType type = arrow_type<T>();
+  if constexpr (type == kArrowColumnBool) {
+    if (row % 8 == 0) column.values.push_back(0);
+    if (value) column.values.back() |= static_cast<::std::uint8_t>(1 << row % 8);
+  } else if constexpr (type == kArrowColumnUtf8) {
+    if constexpr (::std::is_same_v<T, char>) {
+      column.values.push_back(static_cast<::std::uint8_t>(value));
+    } else if constexpr (::std::is_convertible_v<const T&,
+                                                 ::std::string_view>) {
+      ::std::string_view s;
+      if constexpr (::std::is_pointer_v<T>) {
+        if (value != nullptr) s = value;
+      } else {
+        s = value;
+      }
+      column.values.insert(column.values.end(), s.begin(), s.end());
+    } else {
+      ::std::ostringstream oss;
+      oss << value;
+      const ::std::string s = oss.str();
+      column.values.insert(column.values.end(), s.begin(), s.end());
+    }
+    column.offsets.push_back(static_cast<::std::int32_t>(column.values.size()));
+  } else {
+    using Stored = ::std::conditional_t<type == kArrowColumnDouble, double, T>;
+    const Stored stored = static_cast<Stored>(value);
+    const auto* bytes = reinterpret_cast<const ::std::uint8_t*>(&stored);
+    column.values.insert(column.values.end(), bytes, bytes + sizeof(Stored));
+  }
+}
+
+// Records of a call site.
+struct ArrowTable {
+  ::std::unique_ptr<::std::ostream> os;
+  ::std::vector<::std::string> names;
+  ::std::vector<ArrowColumn> columns;
+  ::std::size_t rows = 0;
+  // Set once the types of the columns are known.
+  bool typed = false;
+  bool schema_written = false;
+  // Bytes written to `os`.
+  ::std::size_t size = 0;
+  // Offset, metadata length and body length of each record batch.
+  ::std::vector<::std::uint8_t> blocks;
+  ::std::size_t block_count = 0;
+};
+
+struct arrow_fields {
+  template <class... Ts>
+  void operator()(const Ts&... ts) {
+    if (!table.typed) {
+      table.columns = {ArrowColumn{.type=arrow_type<Ts>()}...};
+      table.typed = true;
+    }
+    ::std::size_t n = 0;
+    (append_arrow_value(table.columns[n++], table.rows, ts), ...);
+    ++table.rows;
+  }
+
+  ArrowTable& table;
+};
+
+inline FlatBufferWriter::Child arrow_type_table(ArrowType type) {
+  using W = FlatBufferWriter;
+  return [type](W& w) -> ::std::size_t {
+    switch (type) {
+      case kArrowColumnBool:
+      case kArrowColumnUtf8:
+        return w.table({});
+      case kArrowColumnFloat:
+        return w.table({W::scalar<::std::int16_t>(0, 1)});
+      case kArrowColumnDouble:
+        return w.table({W::scalar<::std::int16_t>(0, 2)});
+      default: {
+        const int index = type - kArrowColumnInt8;
+        return w.table({
+            W::scalar<::std::int32_t>(0, 8 << (index / 2)),
+            W::scalar<bool>(1, index % 2 == 0),
+        });
+      }
+    }
+  };
+}
+
+inline ArrowTypeId arrow_type_id(ArrowType type) {
+  switch (type) {
+    case kArrowColumnBool: return kArrowBool;
+    case kArrowColumnUtf8: return kArrowUtf8;
+    case kArrowColumnFloat:
+    case kArrowColumnDouble: return kArrowFloatingPoint;
+    default: return kArrowInt;
+  }
+}
+
+inline FlatBufferWriter::Child arrow_schema(const ArrowTable& table) {
+  using W = FlatBufferWriter;
+  return [&table](W& w) {
+    ::std::vector<W::Child> fields;
+    for (::std::size_t i = 0; i < table.columns.size(); ++i) {
+      const ArrowType type = table.columns[i].type;
+      fields.push_back([&table, i, type](W& w) {
+        return w.table({
+            W::offset(0, [&table, i](W& w) {
+              return w.string(table.names[i]);
+            }),
+            W::scalar<bool>(1, false),
+            W::scalar<::std::uint8_t>(2, arrow_type_id(type)),
+            W::offset(3, arrow_type_table(type)),
+            W::offset(5, [](W& w) { return w.tables({}); }),
+        });
+      });
+    }
+    return w.table({
+        W::scalar<::std::int16_t>(
+            0, ::std::endian::native == ::std::endian::little ? 0 : 1),
+        W::offset(1, [&fields](W& w) { return w.tables(fields); }),
+    });
+  };
+}
+
+inline ::std::vector<::std::uint8_t> arrow_message(
+    ArrowMessage type, const FlatBufferWriter::Child& header,
+    ::std::size_t body_size) {
+  using W = FlatBufferWriter;
+  return W::finish([&](W& w) {
+    return w.table({
+        W::scalar<::std::int16_t>(0, kArrowMetadataV5),
+        W::scalar<::std::uint8_t>(1, type),
+        W::offset(2, header),
+        W::scalar<::std::int64_t>(3, body_size),
+    });
+  });
+}
+
+inline void write_arrow(ArrowTable& table, const void* data,
+                        ::std::size_t size) {
+  table.os->write(static_cast<const char*>(data), size);
+  table.size += size;
+}
+
+// Writes an encapsulated message, and returns the size of its metadata.
+inline ::std::size_t write_arrow_message(
+    ArrowTable& table, const ::std::vector<::std::uint8_t>& metadata,
+    const ::std::vector<::std::uint8_t>& body) {
+  ::std::vector<::std::uint8_t> prefix;
+  put_le(prefix, kArrowContinuation, 4);
+  put_le(prefix, metadata.size(), 4);
+  write_arrow(table, prefix.data(), prefix.size());
+  write_arrow(table, metadata.data(), metadata.size());
+  write_arrow(table, body.data(), body.size());
+  return prefix.size() + metadata.size();
+}
+
+}  // namespace internal_dump
+
+struct ArrowOptions {
+  // Rows of a call site written at once as a record batch.
+  ::std::size_t batch_rows = 64 * 1024;
+  // Writes the IPC streaming format rather than the file format.
+  bool stream = false;
+};
+
+class ArrowSink {
+ public:
+  // Returns the stream to write the table of a call site named `names` to,
+  // or nullptr to drop its records.
+  using Open = ::std::function<::std::unique_ptr<::std::ostream>(
+      const internal_dump::DumpSite& site, internal_dump::DumpNames names)>;
+
+  explicit ArrowSink(Open open, ArrowOptions options = {}):
+      open_(::std::move(open)),
+      options_(options) {}
+
+  ArrowSink(const ArrowSink&) = delete;
+  ArrowSink& operator=(const ArrowSink&) = delete;
+
+  ~ArrowSink() { close(); }
+
+  template <class D>
+  ArrowSink& write(const D& dump) {
+    internal_dump::ArrowTable& table = table_(dump.site(), dump.names());
+    if (table.os == nullptr) return *this;
+    dump.visit(internal_dump::arrow_fields{.table=table});
+    if (table.rows >= options_.batch_rows) write_batch_(table);
+    return *this;
+  }
+
+  template <class D>
+  friend ArrowSink& operator<<(ArrowSink& arrow, const D& dump) {
+    return arrow.write(dump);
+  }
+
+  // Writes the buffered records as record batches.
+  void flush() {
+    for_each_table_([&](internal_dump::ArrowTable& table) {
+      if (table.rows != 0) write_batch_(table);
+      table.os->flush();
+    });
+  }
+
+  // Writes the buffered records, then ends the files.
+  void close() {
+    flush();
+    for_each_table_([&](internal_dump::ArrowTable& table) { end_(table); });
+    sites_.clear();
+  }
+
+ private:
+  struct Site {
+    // Table of the call site with its own names, once opened.
+    ::std::unique_ptr<internal_dump::ArrowTable> table;
+    // Tables of the call site with names given by Dump::as().
+    ::std::vector<::std::unique_ptr<internal_dump::ArrowTable>> renamed;
+  };
+
+  // Returns the table of `site` named `names`, opening it if new.
+  internal_dump::ArrowTable& table_(const internal_dump::DumpSite& site,
+                                    internal_dump::DumpNames names) {
+    Site& s = sites_[&site];
+    if (names.data() == site.names.data()) {
+      if (s.table == nullptr) s.table = open_table_(site, names);
+      return *s.table;
+    }
+    for (const auto& table : s.renamed) {
+      if (::std::equal(table->names.begin(), table->names.end(),
+                       names.begin(), names.end())) {
+        return *table;
+      }
+    }
+    s.renamed.push_back(open_table_(site, names));
+    return *s.renamed.back();
+  }
+
+  ::std::unique_ptr<internal_dump::ArrowTable> open_table_(
+      const internal_dump::DumpSite& site, internal_dump::DumpNames names) {
+    auto table = ::std::make_unique<internal_dump::ArrowTable>();
+    table->os = open_(site, names);
+    table->names.assign(names.begin(), names.end());
+    return table;
+  }
+
+  // Calls `f` with each table with a stream.
+  template <class F>
+  void for_each_table_(F&& f) {
+    for (auto& [site, s] : sites_) {
+      if (s.table != nullptr && s.table->os != nullptr) f(*s.table);
+      for (const auto& table : s.renamed) {
+        if (table->os != nullptr) f(*table);
+      }
+    }
+  }
+
+  void write_schema_(internal_dump::ArrowTable& table) {
+    using internal_dump::write_arrow;
+    if (!options_.stream) {
+      write_arrow(table, internal_dump::kArrowMagic, 6);
+      write_arrow(table, "\0\0", 2);
+    }
+    write_arrow_message(
+        table,
+        internal_dump::arrow_message(internal_dump::kArrowSchema,
+                                     internal_dump::arrow_schema(table), 0),
+        {});
+    table.schema_written = true;
+  }
+
+  void write_batch_(internal_dump::ArrowTable& table) {
+    using internal_dump::put_le;
+    using W = internal_dump::FlatBufferWriter;
+    if (!table.schema_written) write_schema_(table);
+    ::std::vector<::std::uint8_t> body;
+    ::std::vector<::std::uint8_t> nodes;
+    ::std::vector<::std::uint8_t> buffers;
+    ::std::size_t buffer_count = 0;
+    const auto add_buffer = [&](const void* data, ::std::size_t size) {
+      put_le(buffers, body.size(), 8);
+      put_le(buffers, size, 8);
+      ++buffer_count;
+      const auto* bytes = static_cast<const ::std::uint8_t*>(data);
+      body.insert(body.end(), bytes, bytes + size);
+      body.resize((body.size() + 7) / 8 * 8, 0);
+    };
+    for (internal_dump::ArrowColumn& column : table.columns) {
+      put_le(nodes, table.rows, 8);
+      put_le(nodes, 0, 8);
+      // No validity bitmap: there are no nulls.
+      add_buffer(nullptr, 0);
+      if (column.type == internal_dump::kArrowColumnUtf8) {
+        add_buffer(column.offsets.data(),
+                   column.offsets.size() * sizeof(::std::int32_t));
+        column.offsets.resize(1);
+      }
+      add_buffer(column.values.data(), column.values.size());
+      column.values.clear();
+    }
+    const ::std::vector<::std::uint8_t> metadata = internal_dump::arrow_message(
+        internal_dump::kArrowRecordBatch,
+        [&](W& w) {
+          return w.table({
+              W::scalar<::std::int64_t>(0, table.rows),
+              W::offset(1, [&](W& w) {
+                return w.structs(nodes, table.columns.size());
+              }),
+              W::offset(2, [&](W& w) {
+                return w.structs(buffers, buffer_count);
+              }),
+          });
+        },
+        body.size());
+    const ::std::size_t offset = table.size;
+    const ::std::size_t metadata_size =
+        write_arrow_message(table, metadata, body);
+    // Block struct: offset, metadata length, padding and body length.
+    put_le(table.blocks, offset, 8);
+    put_le(table.blocks, metadata_size, 4);
+    put_le(table.blocks, 0, 4);
+    put_le(table.blocks, body.size(), 8);
+    ++table.block_count;
+    table.rows = 0;
+  }
+
+  void end_(internal_dump::ArrowTable& table) {
+    using internal_dump::put_le;
+    using W = internal_dump::FlatBufferWriter;
+    if (!table.schema_written) write_schema_(table);
+    ::std::vector<::std::uint8_t> end;
+    put_le(end, internal_dump::kArrowContinuation, 4);
+    put_le(end, 0, 4);
+    if (!options_.stream) {
+      const ::std::vector<::std::uint8_t> footer = W::finish([&](W& w) {
+        return w.table({
+            W::scalar<::std::int16_t>(0, internal_dump::kArrowMetadataV5),
+            W::offset(1, internal_dump::arrow_schema(table)),
+            W::offset(2, [](W& w) { return w.structs({}, 0); }),
+            W::offset(3, [&](W& w) {
+              return w.structs(table.blocks, table.block_count);
+            }),
+        });
+      });
+      end.insert(end.end(), footer.begin(), footer.end());
+      put_le(end, footer.size(), 4);
+      end.insert(end.end(), internal_dump::kArrowMagic,
+                 internal_dump::kArrowMagic + 6);
+    }
+    internal_dump::write_arrow(table, end.data(), end.size());
+    table.os->flush();
+  }
+
+  Open open_;
+  const ArrowOptions options_;
+  // Tables of each call site.
+  ::std::unordered_map<const internal_dump::DumpSite*, Site> sites_;
+};
+
+}  // namespace dump
+
+#endif // DUMP_ARROW_HPP_
@@ -0,0 +1,1566 @@
+// Copyright 2010-2022 Google LLC
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// AsyncSink writes DUMP() records to a Sink on a background thread, so that
+// logging threads neither render records nor wait for I/O.
+//
+// Example:
+//   std::ofstream file("log.txt");
+//   dump::OstreamSink file_sink(file);
+//   dump::AsyncSink sink(file_sink);
+//   sink << DUMP(foo, bar);  // Returns once the record is queued.
+//   ...
+//   sink.flush();  // Returns once the queued records are written.
+//
+// Records are snapshots (see snapshot.hpp): their values are copied when they
+// are queued, so the arguments of DUMP() need not outlive the call. The
+// background thread renders them as lines of text, like
+// operator<<(Sink&, ...), and writes all the records it finds queued at once.
+//
+// Coroutines can wait for room and flushes without blocking their thread,
+// with the awaitables of coro.hpp.
+//
+// Async sinks are thread-safe. The sink they write to is only used by their
+// background thread, until they are destroyed.
+//
+//                    ====[ Queues ]====
+//
+// AsyncSink queues records in a bounded ring of preallocated slots, shared by
+// all producer threads: a lock-free multi-producer single-consumer queue. A
+// producer claims a slot with a compare-and-swap on the tail of the ring,
+// moves the snapshot into it, and publishes it by bumping the sequence number
+// of the slot. It takes no lock, and does not allocate, but for the values it
+// copies (e.g. strings). Records are written in the order of their slots.
+//
+// Claiming is lock-free, not wait-free: a producer retries its
+// compare-and-swap when another one claims the slot first. Claiming with a
+// fetch-and-add would never retry, but could not fail on a full ring, which
+// the overflow policies need. A record whose snapshot throws, e.g.
+// std::bad_alloc copying a string, leaves its slot to be skipped, and the
+// exception propagates to the producer.
+//
+// PerThreadAsyncSink gives each producer thread a ring of its own, a
+// single-producer single-consumer queue, so that producers on different cores
+// never write to the same cache line. Each record is stamped with TscClock,
+// and the background thread merges the rings by stamp. Records are written in
+// order, but for a record published after a later-stamped one of another
+// thread was written, which is written late. A thread gets its ring on its
+// first write to a sink, under a lock.
+//
+// The background thread sleeps when the rings are empty, by default. See
+// AsyncWait for the other policies: spinning, and spinning for about the
+// recent idle times before sleeping, which keeps the latency of bursts low
+// without taking a core when traffic is sparse. AsyncOptions::cpus pins the
+// background thread, e.g. to a core of its own for kSpin.
+//
+//                    ====[ NUMA ]====
+//
+// The ring of a producer thread is allocated on its NUMA node (see
+// numa.hpp), so the producer writes records to local memory. NumaAsyncSink
+// goes further, with a PerThreadAsyncSink and a sink per node: the background
+// thread of each node runs on its CPUs, and only reads the rings of threads
+// of its node.
+//
+//   std::vector<std::ofstream> files(dump::NumaTopology::system().nodes());
+//   std::vector<std::unique_ptr<dump::OstreamSink>> sinks;
+//   dump::NumaAsyncSink sink([&](std::size_t node) -> dump::Sink& {
+//     files[node].open("log." + std::to_string(node) + ".txt");
+//     return *sinks.emplace_back(
+//         std::make_unique<dump::OstreamSink>(files[node]));
+//   });
+//
+// A thread moved to another node writes its next records to the sink of that
+// node, through a new ring.
+//
+//                    ====[ Formatting ]====
+//
+// Rendering records may take longer than writing them. With
+// AsyncOptions::format_threads, the background thread only moves records out
+// of the rings, in batches, and a pool of threads renders the batches in
+// parallel. Each worker has a deque of batches, and steals from the others
+// once its own is empty. The background thread writes the rendered batches in
+// the order of their records, and renders urgent records itself.
+//
+// With AsyncOptions::timestamps, lines start with the UTC time their record
+// was queued at, e.g. `2024-05-01T12:34:56.123456789Z foo = 42`. Queuing
+// only reads TscClock, and rendering converts its ticks to wall time.
+//
+//                    ====[ Lanes ]====
+//
+// Records are written with a severity, kInfo by default:
+//
+//   sink.write(DUMP(request, status), dump::Severity::kError);
+//
+// Records of AsyncOptions::urgent_severity or above (kError and kFatal, by
+// default) take a separate, smaller queue, the urgent lane. The background
+// thread drains it before each record of the other lane, and flushes the sink
+// right after writing urgent records: they are not stuck behind a backlog of
+// debug records, nor in a buffer of the sink if the process crashes. The two
+// lanes are not ordered with respect to each other.
+//
+//                    ====[ Batching ]====
+//
+// By default, the background thread writes rendered records once they exceed
+// AsyncOptions::batch_size, or when the queue is empty. With
+// AsyncOptions::adaptive_batching, the size of writes follows the load: the
+// background thread measures how fast records arrive and how long writes
+// take, and writes about what arrives during 8 writes at once (records
+// rendered by format_threads are written a batch at a time, though). When the
+// queue empties before a batch is full, it waits for more records if they should
+// fill it soon, for AsyncOptions::max_delay at most, else writes at once.
+// Writes are large at peak, and records are not delayed when traffic is
+// light.
+//
+//                    ====[ Overflow ]====
+//
+// What a producer does when its ring is full depends on AsyncOptions::overflow:
+// it yields until the background thread makes room (kBlock, the default),
+// drops its record (kDropNewest), drops the oldest record of the ring
+// (kDropOldest), or drops its record but for every sample_rate-th of each
+// call site (kSample). Flushes and urgent records (see Lanes) are never
+// dropped.
+//
+// Drops are counted by call site, see dropped_by_site(), and reported in the
+// output, by a line written before the next records:
+//
+//   dropped 1234 records from server.cpp:42
+//
+// Snapshots are stored inline, in slots of kAsyncRecordCapacity bytes: a
+// DUMP() too large for a slot is rejected at compile time.
+
+#ifndef DUMP_ASYNC_HPP_
+#define DUMP_ASYNC_HPP_
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || \
+    defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "dump/any_dump.hpp"
+#include "dump/clock.hpp"
+#include "dump/numa.hpp"
+#include "dump/sink.hpp"
+#include "dump/snapshot.hpp"
+
+namespace dump {
+
+// Bytes of a queued snapshot, enough for 8 strings and their names.
+inline constexpr ::std::size_t kAsyncRecordCapacity = 448;
+
+// Number of call sites whose drops are counted separately.
+inline constexpr ::std::size_t kAsyncDropSites = 256;
+
+// What the background thread does when its queues are empty.
+enum class AsyncWait {
+  // Sleep at once: no CPU used while idle, but the next record wakes it up,
+  // which takes microseconds.
+  kSleep,
+  // Poll, then spin with pauses (and yields), never sleeping: the lowest
+  // latency, for a core of its own.
+  kSpin,
+  // Poll and spin for about the recent idle times, up to
+  // AsyncOptions::max_spin, then sleep.
+  kAdaptive,
+};
+
+namespace internal_dump {
+
+// Keeps atomics written by different threads on different cache lines.
+inline constexpr ::std::size_t kCacheLineSize = 64;
+
+enum class AsyncRecordKind : ::std::uint8_t {
+  kRecord,
+  // Asks the background thread to flush the sink, and set `done`.
+  kFlush,
+  // Asks the background thread to exit, once the queue is empty.
+  kStop,
+  // Left by a producer whose snapshot threw, e.g. std::bad_alloc copying a
+  // string. Skipped by the background thread.
+  kSkipped,
+};
+
+}  // namespace internal_dump
+
+// Something waiting for room in the queue of an async sink, or for a flush:
+// the awaitables of coro.hpp.
+class AsyncWaiter {
+ public:
+  // Queues the record or marker of the waiter. Returns false if the queue is
+  // still full.
+  virtual bool try_push() = 0;
+
+  // Called once queued, or flushed for a flush marker.
+  virtual void resume() = 0;
+
+ protected:
+  ~AsyncWaiter() = default;
+
+ private:
+  template <class Queue>
+  friend class BasicAsyncSink;
+
+  AsyncWaiter* next_ = nullptr;
+  // Set by try_flush(): resume() then waits for the flush marker.
+  bool flushing_ = false;
+};
+
+namespace internal_dump {
+
+// What a slot of a queue holds.
+struct AsyncRecord {
+  // Atomic, since producers evicting the oldest record read it before
+  // claiming the slot.
+  ::std::atomic<AsyncRecordKind> kind = AsyncRecordKind::kRecord;
+  const DumpSite* site = nullptr;
+  // Of a flush marker: set, or resumed, once flushed.
+  ::std::atomic<bool>* done = nullptr;
+  AsyncWaiter* waiter = nullptr;
+  // TscClock::now() when queued, with AsyncOptions::timestamps.
+  ::std::uint64_t stamp = 0;
+  BasicAnyDump<kAsyncRecordCapacity> record;
+};
+
+// Slots of both queues hold the position of the slot in the ring while it is
+// free, and the position + 1 once published. Publishing does not change the
+// head of the ring, which the consumer (or a producer evicting the oldest
+// record) advances with a compare-and-swap to claim the slot. Releasing it
+// sets its sequence to its position in the next lap.
+
+// Claims the oldest published slot of a ring, or returns nullptr.
+template <class Slot>
+Slot* claim_slot(Slot* slots, ::std::size_t mask,
+                 ::std::atomic<::std::uint64_t>& head,
+                 ::std::uint64_t& position) {
+  ::std::uint64_t h = head.load(::std::memory_order_relaxed);
+  for (;;) {
+    Slot& slot = slots[h & mask];
+    if (slot.sequence.load(::std::memory_order_acquire) != h + 1) {
+      return nullptr;
+    }
+    if (head.compare_exchange_weak(h, h + 1, ::std::memory_order_relaxed)) {
+      position = h;
+      return &slot;
+    }
+  }
+}
+
+template <class Slot>
+void release_slot(Slot& slot, ::std::uint64_t position, ::std::size_t mask) {
+  slot.sequence.store(position + mask + 1, ::std::memory_order_release);
+}
+
+// Calls `fill(record)` on a claimed slot, then `publish()`. If `fill` throws,
+// the slot is still published, as a kSkipped record: the background thread
+// would wait for it forever otherwise.
+template <class F, class P>
+void fill_and_publish(AsyncRecord& record, F& fill, P&& publish) {
+  struct Guard {
+    ~Guard() {
+      if (!filled) {
+        record.kind.store(AsyncRecordKind::kSkipped,
+                          ::std::memory_order_relaxed);
+      }
+      publish();
+    }
+    AsyncRecord& record;
+    P& publish;
+    bool filled = false;
+  } guard{record, publish};
+  fill(record);
+  guard.filled = true;
+}
+
+// Drops the record in the way of a producer waiting for the slot at `tail`,
+// and returns its call site. Returns nullptr if the slot does not hold a
+// published record, or the consumer claimed it.
+template <class Slot>
+const DumpSite* evict_slot(Slot* slots, ::std::size_t mask,
+                           ::std::atomic<::std::uint64_t>& head,
+                           ::std::uint64_t tail) {
+  ::std::uint64_t position = tail - mask - 1;
+  Slot& slot = slots[position & mask];
+  if (slot.sequence.load(::std::memory_order_acquire) != position + 1 ||
+      slot.record.kind.load(::std::memory_order_relaxed) !=
+          AsyncRecordKind::kRecord ||
+      !head.compare_exchange_strong(position, position + 1,
+                                    ::std::memory_order_relaxed)) {
+    return nullptr;
+  }
+  const DumpSite* site = slot.record.site;
+  slot.record.record.reset();
+  release_slot(slot, position, mask);
+  return site;
+}
+
+// Checks of an idle consumer's queues before it spins with pauses, and
+// pauses between yields.
+inline constexpr int kAsyncBusyPolls = 64;
+
+// Hints the CPU that this is a spin loop.
+inline void cpu_relax() {
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || \
+    defined(__i386__)
+  _mm_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield");
+#endif
+}
+
+// Waits for records while the consumer's queues are empty: polls, spins, and
+// sleeps, depending on the AsyncWait policy.
+class AsyncWaker {
+ public:
+  AsyncWaker(AsyncWait policy, ::std::chrono::nanoseconds max_spin):
+      policy_(policy),
+      max_spin_(policy == AsyncWait::kSleep
+                    ? 0
+                    : static_cast<::std::uint64_t>(
+                          static_cast<double>(max_spin.count()) /
+                          TscClock::calibration().ns_per_tick)) {}
+
+  // Wakes the consumer if it sleeps, after a record is published.
+  void notify() {
+    // Pairs with the fence of wait(): either the consumer sees the record, or
+    // this sees it sleeping.
+    ::std::atomic_thread_fence(::std::memory_order_seq_cst);
+    if (sleeping_.load(::std::memory_order_relaxed)) {
+      wakeups_.fetch_add(1, ::std::memory_order_release);
+      wakeups_.notify_one();
+    }
+  }
+
+  // Returns once `ready()` or notified. Only called by the consumer.
+  template <class F>
+  void wait(F&& ready) {
+    const ::std::uint64_t begin = TscClock::now();
+    if (!spin_(ready, begin)) sleep_(ready);
+    if (policy_ == AsyncWait::kAdaptive) {
+      // Moving average of the idle times, over about 8 of them.
+      const ::std::uint64_t idle = TscClock::now() - begin;
+      idle_ = idle_ - idle_ / 8 + idle / 8;
+    }
+  }
+
+  // Returns once `ready()`, or at `deadline`, in ticks. Polls, sleeping in
+  // between.
+  template <class F>
+  void wait_until(F&& ready, ::std::uint64_t deadline) {
+    for (::std::uint64_t now = TscClock::now(); !ready() && now < deadline;
+         now = TscClock::now()) {
+      // Short sleeps, so that a record is noticed soon: ready() is cheap.
+      ::std::this_thread::sleep_for(
+          ::std::min<::std::chrono::nanoseconds>(
+              TscClock::duration(static_cast<::std::int64_t>(deadline - now)),
+              ::std::chrono::microseconds(50)));
+    }
+  }
+
+  // Ticks an idle consumer spins for before sleeping, for kAdaptive: twice
+  // the recent idle times, so that it catches most records of a burst
+  // awake, up to AsyncOptions::max_spin.
+  ::std::uint64_t spin_ticks() const {
+    return ::std::min(2 * idle_, max_spin_);
+  }
+
+ private:
+  // Polls, then spins with pauses, until `ready()`, or the policy gives up.
+  // Returns whether ready.
+  template <class F>
+  bool spin_(F& ready, ::std::uint64_t begin) {
+    if (policy_ == AsyncWait::kSleep) return false;
+    const ::std::uint64_t ticks = policy_ == AsyncWait::kSpin
+                                      ? ::std::numeric_limits<
+                                            ::std::uint64_t>::max()
+                                      : spin_ticks();
+    if (ticks == 0) return false;
+    for (int polls = 0;; ++polls) {
+      if (ready()) return true;
+      if (polls < kAsyncBusyPolls) continue;
+      if (TscClock::now() - begin >= ticks) return false;
+      // Lets the producers run, if they share the core.
+      if (polls % kAsyncBusyPolls == 0) {
+        ::std::this_thread::yield();
+      } else {
+        cpu_relax();
+      }
+    }
+  }
+
+  // Sleeps until notified, unless `ready()`, called once the consumer is seen
+  // sleeping by producers.
+  template <class F>
+  void sleep_(F& ready) {
+    const ::std::uint32_t wakeups =
+        wakeups_.load(::std::memory_order_acquire);
+    sleeping_.store(true, ::std::memory_order_relaxed);
+    ::std::atomic_thread_fence(::std::memory_order_seq_cst);
+    if (!ready()) wakeups_.wait(wakeups, ::std::memory_order_acquire);
+    sleeping_.store(false, ::std::memory_order_relaxed);
+  }
+
+  const AsyncWait policy_;
+  // In ticks.
+  const ::std::uint64_t max_spin_;
+  // Only used by the consumer.
+  ::std::uint64_t idle_ = 0;
+
+  alignas(kCacheLineSize) ::std::atomic<bool> sleeping_ = false;
+  ::std::atomic<::std::uint32_t> wakeups_ = 0;
+};
+
+//                    ====[ Shared ring ]====
+
+struct alignas(kCacheLineSize) SharedSlot {
+  ::std::atomic<::std::uint64_t> sequence;
+  AsyncRecord record;
+};
+
+// Bounded multi-producer single-consumer queue.
+class SharedRing {
+ public:
+  SharedRing(::std::size_t capacity, AsyncWaker& waker):
+      waker_(waker),
+      mask_(::std::bit_ceil(::std::max<::std::size_t>(capacity, 2)) - 1),
+      slots_(new SharedSlot[mask_ + 1]) {
+    for (::std::size_t i = 0; i <= mask_; ++i) {
+      slots_[i].sequence.store(i, ::std::memory_order_relaxed);
+    }
+  }
+
+  // Claims a slot, calls `fill(record)` and publishes it. Returns false if
+  // the ring is full.
+  template <class F>
+  bool try_push(F&& fill) {
+    ::std::uint64_t position = tail_.load(::std::memory_order_relaxed);
+    for (;;) {
+      const ::std::uint64_t sequence =
+          slots_[position & mask_].sequence.load(::std::memory_order_acquire);
+      if (sequence == position) {
+        if (tail_.compare_exchange_weak(position, position + 1,
+                                        ::std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (sequence < position) {
+        // The slot still holds the record of the previous lap.
+        return false;
+      } else {
+        position = tail_.load(::std::memory_order_relaxed);
+      }
+    }
+    SharedSlot& slot = slots_[position & mask_];
+    fill_and_publish(slot.record, fill, [&] {
+      slot.sequence.store(position + 1, ::std::memory_order_release);
+      waker_.notify();
+    });
+    return true;
+  }
+
+  // Drops the oldest record, see evict_slot().
+  const DumpSite* evict() {
+    return evict_slot(slots_.get(), mask_, head_,
+                      tail_.load(::std::memory_order_relaxed));
+  }
+
+  // Claims the next record for the consumer, or returns nullptr.
+  AsyncRecord* pop() {
+    claimed_ = claim_slot(slots_.get(), mask_, head_, claimed_position_);
+    return claimed_ == nullptr ? nullptr : &claimed_->record;
+  }
+
+  // Frees the slot of the last pop().
+  void release() { release_slot(*claimed_, claimed_position_, mask_); }
+
+  // Returns whether there is no record to pop.
+  bool empty() const {
+    const ::std::uint64_t head = head_.load(::std::memory_order_relaxed);
+    return slots_[head & mask_].sequence.load(::std::memory_order_relaxed) !=
+           head + 1;
+  }
+
+  // Does the housekeeping of the consumer, before it sleeps.
+  void idle() {}
+
+ private:
+  AsyncWaker& waker_;
+  const ::std::size_t mask_;
+  const ::std::unique_ptr<SharedSlot[]> slots_;
+  // Position of the next slot to claim by producers.
+  alignas(kCacheLineSize) ::std::atomic<::std::uint64_t> tail_ = 0;
+  // Position of the next slot to claim by the consumer.
+  alignas(kCacheLineSize) ::std::atomic<::std::uint64_t> head_ = 0;
+  // Only used by the consumer.
+  SharedSlot* claimed_ = nullptr;
+  ::std::uint64_t claimed_position_ = 0;
+};
+
+//                    ====[ Per-thread rings ]====
+
+struct alignas(kCacheLineSize) ThreadSlot {
+  ::std::atomic<::std::uint64_t> sequence;
+  // TscClock::now() when the record was queued. Atomic, since the consumer
+  // reads it before claiming the slot.
+  ::std::atomic<::std::uint64_t> stamp;
+  AsyncRecord record;
+};
+
+// Bounded single-producer single-consumer queue, but for the producer
+// evicting the oldest record.
+struct ThreadRing {
+  // Allocates the slots on the NUMA node of the calling thread, the producer.
+  explicit ThreadRing(::std::size_t capacity):
+      mask(::std::bit_ceil(::std::max<::std::size_t>(capacity, 2)) - 1),
+      slots(allocate_slots(mask + 1)) {
+    for (::std::size_t i = 0; i <= mask; ++i) {
+      slots[i].sequence.store(i, ::std::memory_order_relaxed);
+    }
+  }
+
+  ThreadRing(const ThreadRing&) = delete;
+  ThreadRing& operator=(const ThreadRing&) = delete;
+
+  ~ThreadRing() {
+    ::std::destroy_n(slots, mask + 1);
+    numa_deallocate(slots, (mask + 1) * sizeof(ThreadSlot));
+  }
+
+  static ThreadSlot* allocate_slots(::std::size_t size) {
+    const NumaTopology& topology = NumaTopology::system();
+    void* p = numa_allocate(size * sizeof(ThreadSlot),
+                            topology.id(topology.current_node()));
+    if (p == nullptr) throw ::std::bad_alloc();
+    ThreadSlot* const slots = static_cast<ThreadSlot*>(p);
+    ::std::uninitialized_default_construct_n(slots, size);
+    return slots;
+  }
+
+  const ::std::size_t mask;
+  ThreadSlot* const slots;
+  // Set once the producer thread exits, or the consumer is destroyed.
+  ::std::atomic<bool> closed = false;
+
+  // Position of the next slot to publish, only used by the producer (and
+  // the consumer, once closed).
+  alignas(kCacheLineSize) ::std::uint64_t tail = 0;
+
+  // Position of the next slot to claim.
+  alignas(kCacheLineSize) ::std::atomic<::std::uint64_t> head = 0;
+};
+
+// Rings of the current thread, by ID of their ThreadRings.
+class ThreadRingCache {
+ public:
+  ~ThreadRingCache() {
+    for (auto& [id, ring] : rings_) {
+      ring->closed.store(true, ::std::memory_order_release);
+    }
+  }
+
+  // Returns the ring of the current thread for `id`, or nullptr.
+  ThreadRing* find(::std::uint64_t id) const {
+    for (const auto& [ring_id, ring] : rings_) {
+      if (ring_id == id) return ring.get();
+    }
+    return nullptr;
+  }
+
+  void add(::std::uint64_t id, ::std::shared_ptr<ThreadRing> ring) {
+    // Forgets the rings of destroyed queues.
+    ::std::erase_if(rings_, [](const auto& entry) {
+      return entry.second->closed.load(::std::memory_order_relaxed);
+    });
+    rings_.emplace_back(id, ::std::move(ring));
+  }
+
+ private:
+  ::std::vector<::std::pair<::std::uint64_t, ::std::shared_ptr<ThreadRing>>>
+      rings_;
+};
+
+inline ThreadRingCache& thread_ring_cache() {
+  static thread_local ThreadRingCache cache;
+  return cache;
+}
+
+// A ThreadRing per producer thread, merged by stamp.
+class ThreadRings {
+ public:
+  ThreadRings(::std::size_t capacity, AsyncWaker& waker):
+      waker_(waker),
+      capacity_(capacity) {}
+
+  ThreadRings(const ThreadRings&) = delete;
+  ThreadRings& operator=(const ThreadRings&) = delete;
+
+  ~ThreadRings() {
+    for (const auto& ring : rings_) {
+      ring->closed.store(true, ::std::memory_order_relaxed);
+    }
+  }
+
+  // Calls `fill(record)` on the next slot of the ring of the current thread,
+  // and publishes it. Returns false if the ring is full.
+  template <class F>
+  bool try_push(F&& fill) {
+    ThreadRing& ring = local_ring_();
+    ThreadSlot& slot = ring.slots[ring.tail & ring.mask];
+    if (slot.sequence.load(::std::memory_order_acquire) != ring.tail) {
+      return false;
+    }
+    slot.stamp.store(TscClock::now(), ::std::memory_order_relaxed);
+    fill_and_publish(slot.record, fill, [&] {
+      slot.sequence.store(ring.tail + 1, ::std::memory_order_release);
+      ++ring.tail;
+      waker_.notify();
+    });
+    return true;
+  }
+
+  // Drops the oldest record of the ring of the current thread, see
+  // evict_slot().
+  const DumpSite* evict() {
+    ThreadRing& ring = local_ring_();
+    return evict_slot(ring.slots, ring.mask, ring.head, ring.tail);
+  }
+
+  // Claims the published record with the lowest stamp, or returns nullptr.
+  AsyncRecord* pop() {
+    update_rings_();
+    for (;;) {
+      ThreadRing* oldest = nullptr;
+      ::std::uint64_t oldest_head = 0;
+      ::std::uint64_t oldest_stamp = 0;
+      for (ThreadRing* ring : local_rings_) {
+        const ::std::uint64_t head =
+            ring->head.load(::std::memory_order_relaxed);
+        const ThreadSlot& slot = ring->slots[head & ring->mask];
+        if (slot.sequence.load(::std::memory_order_acquire) != head + 1) {
+          continue;
+        }
+        const ::std::uint64_t stamp =
+            slot.stamp.load(::std::memory_order_relaxed);
+        if (oldest == nullptr || stamp < oldest_stamp) {
+          oldest = ring;
+          oldest_head = head;
+          oldest_stamp = stamp;
+        }
+      }
+      if (oldest == nullptr) return nullptr;
+      // Fails if the producer evicted the record meanwhile.
+      if (oldest->head.compare_exchange_strong(oldest_head, oldest_head + 1,
+                                               ::std::memory_order_relaxed)) {
+        claimed_ = oldest;
+        claimed_position_ = oldest_head;
+        return &oldest->slots[oldest_head & oldest->mask].record;
+      }
+    }
+  }
+
+  // Frees the slot of the last pop().
+  void release() {
+    release_slot(claimed_->slots[claimed_position_ & claimed_->mask],
+                 claimed_position_, claimed_->mask);
+  }
+
+  // Returns whether there is no record to pop.
+  bool empty() {
+    update_rings_();
+    for (const ThreadRing* ring : local_rings_) {
+      const ::std::uint64_t head = ring->head.load(::std::memory_order_relaxed);
+      if (ring->slots[head & ring->mask].sequence.load(
+              ::std::memory_order_relaxed) == head + 1) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Releases the rings of exited threads, before the consumer sleeps.
+  void idle() {
+    ::std::lock_guard<::std::mutex> lock(mutex_);
+    const auto released = ::std::erase_if(rings_, [](const auto& ring) {
+      return ring->closed.load(::std::memory_order_acquire) &&
+             ring->head.load(::std::memory_order_relaxed) == ring->tail;
+    });
+    if (released != 0) generation_.fetch_add(1, ::std::memory_order_release);
+  }
+
+ private:
+  ThreadRing& local_ring_() {
+    ThreadRingCache& cache = thread_ring_cache();
+    if (ThreadRing* ring = cache.find(id_)) return *ring;
+    auto ring = ::std::make_shared<ThreadRing>(capacity_);
+    {
+      ::std::lock_guard<::std::mutex> lock(mutex_);
+      rings_.push_back(ring);
+      generation_.fetch_add(1, ::std::memory_order_release);
+    }
+    ThreadRing& local = *ring;
+    cache.add(id_, ::std::move(ring));
+    return local;
+  }
+
+  // Updates the consumer's copy of the rings, if they changed.
+  void update_rings_() {
+    if (generation_.load(::std::memory_order_acquire) == local_generation_) {
+      return;
+    }
+    ::std::lock_guard<::std::mutex> lock(mutex_);
+    local_generation_ = generation_.load(::std::memory_order_relaxed);
+    local_rings_.clear();
+    for (const auto& ring : rings_) local_rings_.push_back(ring.get());
+  }
+
+  AsyncWaker& waker_;
+  const ::std::uint64_t id_ = [] {
+    static ::std::atomic<::std::uint64_t> next_id = 0;
+    return next_id.fetch_add(1, ::std::memory_order_relaxed);
+  }();
+  const ::std::size_t capacity_;
+
+  // Guards rings_.
+  ::std::mutex mutex_;
+  ::std::vector<::std::shared_ptr<ThreadRing>> rings_;
+  // Incremented when rings_ changes.
+  ::std::atomic<::std::uint64_t> generation_ = 0;
+
+  // Only used by the consumer.
+  ::std::uint64_t local_generation_ = 0;
+  ::std::vector<ThreadRing*> local_rings_;
+  ThreadRing* claimed_ = nullptr;
+  ::std::uint64_t claimed_position_ = 0;
+};
+
+//                    ====[ Drops ]====
+
+// Counts the records of each call site which found the queue full, and those
+// dropped: a lock-free hash table of kAsyncDropSites sites, and an entry for
+// the others.
+class AsyncDropCounters {
+ public:
+  struct Entry {
+    // nullptr while the entry is free, and for the entry of other sites.
+    ::std::atomic<const DumpSite*> site = nullptr;
+    ::std::atomic<::std::uint64_t> overflows = 0;
+    ::std::atomic<::std::uint64_t> drops = 0;
+    // Drops already reported, only used by the consumer.
+    mutable ::std::uint64_t reported = 0;
+  };
+
+  // Counts a record of `site` finding the queue full, and returns the number
+  // of those before it.
+  ::std::uint64_t overflow(const DumpSite* site) {
+    return entry_(site).overflows.fetch_add(1, ::std::memory_order_relaxed);
+  }
+
+  void drop(const DumpSite* site) {
+    entry_(site).drops.fetch_add(1, ::std::memory_order_relaxed);
+    total_.fetch_add(1, ::std::memory_order_release);
+  }
+
+  ::std::uint64_t total() const {
+    return total_.load(::std::memory_order_acquire);
+  }
+
+  // Calls `f(entry)` for each entry with drops, the entry of other sites
+  // last.
+  template <class F>
+  void for_each(F&& f) const {
+    for (const Entry& entry : entries_) {
+      if (entry.drops.load(::std::memory_order_relaxed) != 0) f(entry);
+    }
+    if (other_.drops.load(::std::memory_order_relaxed) != 0) f(other_);
+  }
+
+ private:
+  Entry& entry_(const DumpSite* site) {
+    ::std::size_t i = static_cast<::std::size_t>(
+        (reinterpret_cast<::std::uintptr_t>(site) >> 4) * 0x9E3779B97F4A7C15u);
+    for (::std::size_t probes = 0; probes < kAsyncDropSites; ++probes, ++i) {
+      Entry& entry = entries_[i % kAsyncDropSites];
+      const DumpSite* entry_site = entry.site.load(::std::memory_order_acquire);
+      if (entry_site == nullptr &&
+          entry.site.compare_exchange_strong(entry_site, site,
+                                             ::std::memory_order_acq_rel)) {
+        return entry;
+      }
+      if (entry_site == site) return entry;
+    }
+    return other_;
+  }
+
+  Entry entries_[kAsyncDropSites];
+  Entry other_;
+  ::std::atomic<::std::uint64_t> total_ = 0;
+};
+
+//                    ====[ Batching ]====
+
+// Sizes the writes of the consumer from the load, for adaptive batching:
+// moving averages of the time between records, their size and the time
+// writes take.
+class AsyncBatcher {
+ public:
+  AsyncBatcher(::std::size_t max_size, ::std::chrono::nanoseconds max_delay):
+      max_size_(max_size),
+      max_delay_(static_cast<::std::uint64_t>(
+          static_cast<double>(max_delay.count()) /
+          TscClock::calibration().ns_per_tick)) {}
+
+  // Counts a record of `bytes` rendered at `now`, in ticks.
+  void add(::std::size_t bytes, ::std::uint64_t now) {
+    if (last_ != 0) average_(interval_, static_cast<double>(now - last_));
+    last_ = now;
+    average_(record_size_, static_cast<double>(bytes));
+  }
+
+  // Counts a write which took `ticks`.
+  void written(::std::uint64_t ticks) {
+    average_(write_ticks_, static_cast<double>(ticks));
+  }
+
+  // The size to write at: what arrives during kAsyncWriteCover writes, so
+  // that writing takes a small part of the time, at most the max size.
+  ::std::size_t target() const {
+    if (interval_ <= 0) return max_size_;
+    const double size =
+        kAsyncWriteCover * write_ticks_ * record_size_ / interval_;
+    return size >= static_cast<double>(max_size_)
+               ? max_size_
+               : static_cast<::std::size_t>(size);
+  }
+
+  // Returns until when to wait for more records, with `size` bytes pending
+  // since `oldest`, or 0 to write them now: when the target will not be
+  // reached within the max delay.
+  ::std::uint64_t hold_until(::std::size_t size, ::std::uint64_t oldest,
+                             ::std::uint64_t now) const {
+    const ::std::size_t target = this->target();
+    if (size >= target || interval_ <= 0) return 0;
+    const double fill = static_cast<double>(target - size) / record_size_ *
+                        interval_;
+    if (fill >= static_cast<double>(max_delay_)) return 0;
+    const ::std::uint64_t deadline =
+        ::std::min(oldest + max_delay_,
+                   now + 2 * static_cast<::std::uint64_t>(fill) + 1);
+    return deadline > now ? deadline : 0;
+  }
+
+ private:
+  // Writes cover the records arriving during this many writes.
+  static constexpr double kAsyncWriteCover = 8;
+
+  static void average_(double& average, double value) {
+    average += (value - average) / 8;
+  }
+
+  const ::std::size_t max_size_;
+  // In ticks.
+  const ::std::uint64_t max_delay_;
+  ::std::uint64_t last_ = 0;
+  double interval_ = 0;
+  double record_size_ = 0;
+  double write_ticks_ = 0;
+};
+
+//                    ====[ Formatting pool ]====
+
+// Renders `record` as a line, after the UTC time of `stamp` unless 0.
+inline void render_async_line(
+    ::std::ostream& os, const BasicAnyDump<kAsyncRecordCapacity>& record,
+    ::std::uint64_t stamp) {
+  if (stamp != 0) {
+    write_utc_time(os, TscClock::to_system(stamp));
+    os << ' ';
+  }
+  os << record << '\n';
+}
+
+// Records rendered together by a FormatPool worker.
+struct AsyncBatch {
+  // Renders the records into `out`, and destroys them.
+  void render() {
+    for (::std::size_t i = 0; i < records.size(); ++i) {
+      render_async_line(out, records[i], stamps[i]);
+    }
+    records.clear();
+    stamps.clear();
+    done.store(true, ::std::memory_order_release);
+    done.notify_one();
+  }
+
+  ::std::vector<BasicAnyDump<kAsyncRecordCapacity>> records;
+  // Of each record, see AsyncRecord::stamp.
+  ::std::vector<::std::uint64_t> stamps;
+  ::std::ostringstream out;
+  ::std::atomic<bool> done = false;
+};
+
+// Worker threads rendering batches, each with a deque of batches. A worker
+// takes the oldest batch of its own deque, else steals the newest batch of
+// another deque.
+class FormatPool {
+ public:
+  explicit FormatPool(::std::size_t threads):
+      size_(::std::max<::std::size_t>(threads, 1)),
+      workers_(new Worker[size_]) {
+    for (::std::size_t i = 0; i < size_; ++i) {
+      threads_.emplace_back([this, i] { run_(i); });
+    }
+  }
+
+  FormatPool(const FormatPool&) = delete;
+  FormatPool& operator=(const FormatPool&) = delete;
+
+  // Renders the submitted batches, and stops the workers.
+  ~FormatPool() {
+    stopping_.store(true, ::std::memory_order_relaxed);
+    epoch_.fetch_add(1, ::std::memory_order_seq_cst);
+    epoch_.notify_all();
+    for (::std::thread& thread : threads_) thread.join();
+  }
+
+  ::std::size_t size() const { return size_; }
+
+  // Queues `batch`, to the workers in turn. Only called by one thread.
+  void submit(AsyncBatch* batch) {
+    Worker& worker = workers_[next_++ % size_];
+    {
+      ::std::lock_guard<::std::mutex> lock(worker.mutex);
+      worker.batches.push_back(batch);
+    }
+    epoch_.fetch_add(1, ::std::memory_order_seq_cst);
+    epoch_.notify_one();
+  }
+
+ private:
+  struct alignas(kCacheLineSize) Worker {
+    ::std::mutex mutex;
+    ::std::deque<AsyncBatch*> batches;
+  };
+
+  AsyncBatch* take_(::std::size_t self) {
+    for (::std::size_t i = 0; i < size_; ++i) {
+      Worker& worker = workers_[(self + i) % size_];
+      ::std::lock_guard<::std::mutex> lock(worker.mutex);
+      if (worker.batches.empty()) continue;
+      AsyncBatch* batch;
+      if (i == 0) {
+        batch = worker.batches.front();
+        worker.batches.pop_front();
+      } else {
+        batch = worker.batches.back();
+        worker.batches.pop_back();
+      }
+      return batch;
+    }
+    return nullptr;
+  }
+
+  void run_(::std::size_t self) {
+    for (;;) {
+      // Read before looking for a batch: a batch submitted after the look
+      // changes it.
+      const ::std::uint32_t epoch = epoch_.load(::std::memory_order_seq_cst);
+      if (AsyncBatch* batch = take_(self)) {
+        batch->render();
+        continue;
+      }
+      if (stopping_.load(::std::memory_order_relaxed)) return;
+      epoch_.wait(epoch, ::std::memory_order_seq_cst);
+    }
+  }
+
+  const ::std::size_t size_;
+  const ::std::unique_ptr<Worker[]> workers_;
+  // Only used by the submitting thread.
+  ::std::size_t next_ = 0;
+  alignas(kCacheLineSize) ::std::atomic<::std::uint32_t> epoch_ = 0;
+  ::std::atomic<bool> stopping_ = false;
+  ::std::vector<::std::thread> threads_;
+};
+
+}  // namespace internal_dump
+
+// Severity of a record, which selects its lane (see AsyncOptions).
+enum class Severity {
+  kDebug,
+  kInfo,
+  kWarning,
+  kError,
+  kFatal,
+};
+
+// What producers do when the queue is full.
+enum class AsyncOverflow {
+  // Wait for room.
+  kBlock,
+  // Drop the record being written.
+  kDropNewest,
+  // Drop the oldest queued record, to make room.
+  kDropOldest,
+  // Drop the record being written, but for every sample_rate-th of each call
+  // site, which waits for room.
+  kSample,
+};
+
+struct AsyncOptions {
+  // Number of slots of the ring (of each ring, for PerThreadAsyncSink),
+  // rounded up to a power of 2.
+  ::std::size_t capacity = 1024;
+  // Rendered records are written to the sink once they exceed this size, or
+  // when the queue is empty.
+  ::std::size_t batch_size = 64 * 1024;
+  // Sizes writes from the load instead, up to batch_size: larger ones when
+  // records arrive faster than the sink takes writes, and waiting up to
+  // max_delay for a batch to fill when records arrive fast enough.
+  bool adaptive_batching = false;
+  ::std::chrono::nanoseconds max_delay = ::std::chrono::milliseconds(1);
+  AsyncOverflow overflow = AsyncOverflow::kBlock;
+  ::std::uint64_t sample_rate = 100;
+  // Records of this severity or above take the urgent lane: a queue of
+  // urgent_capacity slots, which is drained first and flushed at once. Its
+  // records wait for room rather than being dropped.
+  Severity urgent_severity = Severity::kError;
+  ::std::size_t urgent_capacity = 64;
+  // Number of threads rendering records, in batches of format_batch records,
+  // or 0 to render them on the background thread.
+  ::std::size_t format_threads = 0;
+  ::std::size_t format_batch = 256;
+  AsyncWait wait = AsyncWait::kSleep;
+  ::std::chrono::nanoseconds max_spin = ::std::chrono::microseconds(50);
+  // CPUs the background thread runs on, or empty for any.
+  ::std::vector<int> cpus = {};
+  // Prefixes each line with the UTC time the record was queued at.
+  bool timestamps = false;
+};
+
+template <class Queue>
+class BasicAsyncSink {
+ public:
+  // Starts a background thread writing to `sink`, which must outlive this.
+  explicit BasicAsyncSink(Sink& sink, AsyncOptions options = {}):
+      sink_(sink),
+      batch_size_(options.batch_size),
+      overflow_(options.overflow),
+      sample_rate_(::std::max<::std::uint64_t>(options.sample_rate, 1)),
+      urgent_severity_(options.urgent_severity),
+      timestamps_(options.timestamps),
+      waker_(options.wait, options.max_spin),
+      queue_(options.capacity, waker_),
+      urgent_(options.urgent_capacity, waker_),
+      batcher_(options.adaptive_batching
+                   ? ::std::make_unique<internal_dump::AsyncBatcher>(
+                         options.batch_size, options.max_delay)
+                   : nullptr),
+      format_batch_(::std::max<::std::size_t>(options.format_batch, 1)),
+      pool_(options.format_threads == 0
+                ? nullptr
+                : ::std::make_unique<internal_dump::FormatPool>(
+                      options.format_threads)),
+      thread_([this, cpus = ::std::move(options.cpus)] {
+        if (!cpus.empty()) pin_thread(cpus);
+        run_();
+      }) {}
+
+  BasicAsyncSink(const BasicAsyncSink&) = delete;
+  BasicAsyncSink& operator=(const BasicAsyncSink&) = delete;
+
+  // Writes the queued records, flushes the sink, and stops the background
+  // thread. No record may be written concurrently.
+  ~BasicAsyncSink() {
+    push_(queue_, nullptr, [](internal_dump::AsyncRecord& record) {
+      record.kind.store(internal_dump::AsyncRecordKind::kStop,
+                        ::std::memory_order_relaxed);
+    });
+    thread_.join();
+  }
+
+  // Queues a snapshot of `dump` in the lane of `severity`. Drops it if the
+  // queue is full, depending on AsyncOptions::overflow, unless it is urgent.
+  template <class D>
+  void write(const D& dump, Severity severity = Severity::kInfo) {
+    Queue& queue = lane_(severity);
+    if (!offer_(queue, &dump.site(), fill_record_(dump))) {
+      while (!queue.try_push(fill_record_(dump))) ::std::this_thread::yield();
+    }
+  }
+
+  template <class D>
+  friend BasicAsyncSink& operator<<(BasicAsyncSink& sink, const D& dump) {
+    sink.write(dump);
+    return sink;
+  }
+
+  // Waits until the records queued before the call are written, and the sink
+  // is flushed.
+  void flush() {
+    ::std::atomic<bool> done = false;
+    push_(queue_, nullptr, fill_flush_(&done, nullptr));
+    // Waits on flushes_ rather than `done`, which the background thread must
+    // not touch once set.
+    for (::std::uint32_t flushes = flushes_.load(::std::memory_order_acquire);
+         !done.load(::std::memory_order_acquire);
+         flushes = flushes_.load(::std::memory_order_acquire)) {
+      flushes_.wait(flushes, ::std::memory_order_acquire);
+    }
+  }
+
+  // Same as write(), but returns false rather than waiting for room, in which
+  // case the record is not queued.
+  template <class D>
+  bool write_or_defer(const D& dump, Severity severity = Severity::kInfo) {
+    return offer_(lane_(severity), &dump.site(), fill_record_(dump));
+  }
+
+  // Queues a snapshot of `dump`, if there is room. Does not count drops.
+  template <class D>
+  bool try_write(const D& dump, Severity severity = Severity::kInfo) {
+    return lane_(severity).try_push(fill_record_(dump));
+  }
+
+  // Queues a flush marker resuming `waiter` once the records queued before it
+  // are written and the sink is flushed, if there is room.
+  bool try_flush(AsyncWaiter& waiter) {
+    // Before queuing the marker, after which the waiter may be destroyed.
+    waiter.flushing_ = true;
+    return queue_.try_push(fill_flush_(nullptr, &waiter));
+  }
+
+  // Calls waiter.try_push() on the background thread as queues make room,
+  // until it returns true, then waiter.resume(). Waiters are served in order.
+  void wait_for_room(AsyncWaiter& waiter) {
+    {
+      ::std::lock_guard<::std::mutex> lock(waiters_mutex_);
+      waiter.next_ = nullptr;
+      *waiters_tail_ = &waiter;
+      waiters_tail_ = &waiter.next_;
+      waiting_.store(true, ::std::memory_order_relaxed);
+    }
+    waker_.notify();
+  }
+
+  // Returns the number of records dropped so far.
+  ::std::uint64_t dropped() const { return drops_.total(); }
+
+  // Returns the number of records dropped so far by call site, for those
+  // with drops. Sites beyond the first kAsyncDropSites with overflows are
+  // counted together, as nullptr.
+  ::std::vector<::std::pair<const internal_dump::DumpSite*, ::std::uint64_t>>
+  dropped_by_site() const {
+    ::std::vector<::std::pair<const internal_dump::DumpSite*, ::std::uint64_t>>
+        dropped;
+    drops_.for_each([&](const internal_dump::AsyncDropCounters::Entry& entry) {
+      dropped.emplace_back(entry.site.load(::std::memory_order_relaxed),
+                           entry.drops.load(::std::memory_order_relaxed));
+    });
+    return dropped;
+  }
+
+ private:
+  Queue& lane_(Severity severity) {
+    return severity >= urgent_severity_ ? urgent_ : queue_;
+  }
+
+  template <class D>
+  auto fill_record_(const D& dump) {
+    return [this, &dump](internal_dump::AsyncRecord& record) {
+      // Queuing takes the time, rendering converts it.
+      record.stamp = timestamps_ ? TscClock::now() : 0;
+      visit_snapshot(dump, [&](auto&& snapshot) {
+        static_assert(sizeof(snapshot) <= kAsyncRecordCapacity,
+                      "DUMP() is too large for an async sink slot");
+        record.record = ::std::move(snapshot);
+      });
+      record.kind.store(internal_dump::AsyncRecordKind::kRecord,
+                        ::std::memory_order_relaxed);
+      record.site = &dump.site();
+    };
+  }
+
+  static auto fill_flush_(::std::atomic<bool>* done, AsyncWaiter* waiter) {
+    return [done, waiter](internal_dump::AsyncRecord& record) {
+      record.kind.store(internal_dump::AsyncRecordKind::kFlush,
+                        ::std::memory_order_relaxed);
+      record.done = done;
+      record.waiter = waiter;
+    };
+  }
+
+  // Queues in `queue` a record of `site` filled by `fill`, or drops a record
+  // if the queue is full, depending on AsyncOptions::overflow. Returns false
+  // if the record must wait for room instead. Urgent records and markers
+  // (`site` is nullptr) neither are dropped nor drop records.
+  template <class F>
+  bool offer_(Queue& queue, const internal_dump::DumpSite* site, F&& fill) {
+    if (queue.try_push(fill)) return true;
+    if (&queue == &urgent_ || site == nullptr) return false;
+    switch (overflow_) {
+      case AsyncOverflow::kBlock:
+        return false;
+      case AsyncOverflow::kSample:
+        if ((drops_.overflow(site) + 1) % sample_rate_ == 0) return false;
+        [[fallthrough]];
+      case AsyncOverflow::kDropNewest:
+        drops_.drop(site);
+        return true;
+      case AsyncOverflow::kDropOldest:
+        do {
+          if (const internal_dump::DumpSite* evicted = queue.evict()) {
+            drops_.drop(evicted);
+          } else {
+            ::std::this_thread::yield();
+          }
+        } while (!queue.try_push(fill));
+        return true;
+    }
+    return false;
+  }
+
+  // Queues a marker, waiting for room.
+  template <class F>
+  void push_(Queue& queue, const internal_dump::DumpSite* site, F&& fill) {
+    while (!offer_(queue, site, fill)) ::std::this_thread::yield();
+  }
+
+  // Queues the records of the waiters while there is room, and resumes them.
+  void serve_waiters_() {
+    AsyncWaiter* queued = nullptr;
+    AsyncWaiter** queued_tail = &queued;
+    {
+      ::std::lock_guard<::std::mutex> lock(waiters_mutex_);
+      while (waiters_ != nullptr && waiters_->try_push()) {
+        AsyncWaiter* const waiter = ::std::exchange(waiters_, waiters_->next_);
+        // Resumed by its flush marker, which this thread has yet to see.
+        if (waiter->flushing_) continue;
+        *queued_tail = waiter;
+        queued_tail = &waiter->next_;
+      }
+      if (waiters_ == nullptr) waiters_tail_ = &waiters_;
+      *queued_tail = nullptr;
+      waiting_.store(waiters_ != nullptr, ::std::memory_order_relaxed);
+    }
+    // A resumed waiter may be destroyed at once.
+    while (queued != nullptr) ::std::exchange(queued, queued->next_)->resume();
+  }
+
+  void run_() {
+    ::std::ostringstream batch;
+    bool stopping = false;
+    for (;;) {
+      if (waiting_.load(::std::memory_order_relaxed)) serve_waiters_();
+      drain_urgent_(batch);
+      internal_dump::AsyncRecord* record = queue_.pop();
+      if (record == nullptr) {
+        write_formatted_();
+        if (!stopping && hold_(batch)) continue;
+        write_batch_(batch);
+        // Waiters left once stopping are served before exiting: nothing
+        // would resume them otherwise.
+        if (stopping) {
+          if (!waiting_.load(::std::memory_order_relaxed)) break;
+          continue;
+        }
+        queue_.idle();
+        urgent_.idle();
+        waker_.wait([&] {
+          return !queue_.empty() || !urgent_.empty() ||
+                 waiting_.load(::std::memory_order_relaxed);
+        });
+        continue;
+      }
+      switch (record->kind.load(::std::memory_order_relaxed)) {
+        case internal_dump::AsyncRecordKind::kRecord:
+          if (pool_ != nullptr) {
+            format_(::std::move(record->record), record->stamp);
+            queue_.release();
+            continue;
+          }
+          render_(batch, *record);
+          record->record.reset();
+          // Before writing, so that producers need not wait for the sink.
+          queue_.release();
+          if (static_cast<::std::size_t>(batch.tellp()) >=
+              (batcher_ != nullptr ? batcher_->target() : batch_size_)) {
+            write_batch_(batch);
+          }
+          continue;
+        case internal_dump::AsyncRecordKind::kFlush: {
+          // Urgent records queued before the flush may not have been seen
+          // yet.
+          drain_urgent_(batch);
+          write_formatted_();
+          write_batch_(batch);
+          sink_.flush();
+          ::std::atomic<bool>* const done = record->done;
+          AsyncWaiter* const waiter = record->waiter;
+          // Before resuming the waiter, which may write at once.
+          queue_.release();
+          if (waiter != nullptr) {
+            waiter->resume();
+          } else {
+            done->store(true, ::std::memory_order_release);
+            flushes_.fetch_add(1, ::std::memory_order_release);
+            flushes_.notify_all();
+          }
+          continue;
+        }
+        case internal_dump::AsyncRecordKind::kStop:
+          stopping = true;
+          break;
+        case internal_dump::AsyncRecordKind::kSkipped:
+          record->record.reset();
+          break;
+      }
+      queue_.release();
+    }
+    sink_.flush();
+  }
+
+  void render_(::std::ostringstream& batch,
+               const internal_dump::AsyncRecord& record) {
+    if (batcher_ == nullptr) {
+      internal_dump::render_async_line(batch, record.record, record.stamp);
+      return;
+    }
+    const ::std::uint64_t now = TscClock::now();
+    const auto size = batch.tellp();
+    if (size == 0) oldest_ = now;
+    internal_dump::render_async_line(batch, record.record, record.stamp);
+    batcher_->add(static_cast<::std::size_t>(batch.tellp() - size), now);
+  }
+
+  // Waits for more records before writing `batch`, with adaptive batching,
+  // if they should come soon. Returns whether it waited.
+  bool hold_(::std::ostringstream& batch) {
+    if (batcher_ == nullptr || batch.tellp() == 0) return false;
+    const ::std::uint64_t deadline = batcher_->hold_until(
+        static_cast<::std::size_t>(batch.tellp()), oldest_, TscClock::now());
+    if (deadline == 0) return false;
+    waker_.wait_until(
+        [&] {
+          return !queue_.empty() || !urgent_.empty() ||
+                 waiting_.load(::std::memory_order_relaxed);
+        },
+        deadline);
+    return true;
+  }
+
+  // Renders the urgent records, if any, and writes and flushes them at once
+  // with the rendered records before them.
+  void drain_urgent_(::std::ostringstream& batch) {
+    internal_dump::AsyncRecord* record = urgent_.pop();
+    if (record == nullptr) return;
+    do {
+      if (record->kind.load(::std::memory_order_relaxed) ==
+          internal_dump::AsyncRecordKind::kRecord) {
+        internal_dump::render_async_line(batch, record->record, record->stamp);
+      }
+      record->record.reset();
+      urgent_.release();
+    } while ((record = urgent_.pop()) != nullptr);
+    write_batch_(batch);
+    sink_.flush();
+  }
+
+  // Adds `record` to the batch being filled, and submits it to the pool once
+  // full. Writes the batches rendered by then.
+  void format_(BasicAnyDump<kAsyncRecordCapacity>&& record,
+               ::std::uint64_t stamp) {
+    if (formatting_ == nullptr) {
+      if (free_batches_.empty()) {
+        formatting_ = ::std::make_unique<internal_dump::AsyncBatch>();
+        formatting_->records.reserve(format_batch_);
+        formatting_->stamps.reserve(format_batch_);
+      } else {
+        formatting_ = ::std::move(free_batches_.back());
+        free_batches_.pop_back();
+      }
+    }
+    formatting_->records.push_back(::std::move(record));
+    formatting_->stamps.push_back(stamp);
+    if (formatting_->records.size() < format_batch_) return;
+    pool_->submit(formatting_.get());
+    rendering_.push_back(::std::move(formatting_));
+    // Bounds the records held, if the pool falls behind.
+    if (rendering_.size() > 2 * pool_->size()) write_rendered_();
+    while (!rendering_.empty() &&
+           rendering_.front()->done.load(::std::memory_order_acquire)) {
+      write_rendered_();
+    }
+  }
+
+  // Writes the batches rendered by the pool, in order, once rendered.
+  void write_formatted_() {
+    if (pool_ == nullptr) return;
+    if (formatting_ != nullptr) {
+      pool_->submit(formatting_.get());
+      rendering_.push_back(::std::move(formatting_));
+    }
+    while (!rendering_.empty()) write_rendered_();
+  }
+
+  // Waits for the oldest batch to be rendered, and writes it.
+  void write_rendered_() {
+    ::std::unique_ptr<internal_dump::AsyncBatch> rendered =
+        ::std::move(rendering_.front());
+    rendering_.pop_front();
+    rendered->done.wait(false, ::std::memory_order_acquire);
+    write_batch_(rendered->out);
+    rendered->done.store(false, ::std::memory_order_relaxed);
+    free_batches_.push_back(::std::move(rendered));
+  }
+
+  // Writes the rendered records, after a line for each call site with drops
+  // since the last one, e.g. "dropped 42 records from main.cpp:12".
+  void write_batch_(::std::ostringstream& batch) {
+    if (drops_.total() != reported_drops_) report_drops_();
+    if (batch.tellp() == 0) return;
+    if (batcher_ == nullptr) {
+      sink_.write(batch.view());
+    } else {
+      const ::std::uint64_t begin = TscClock::now();
+      sink_.write(batch.view());
+      batcher_->written(TscClock::now() - begin);
+    }
+    batch.str("");
+  }
+
+  void report_drops_() {
+    reported_drops_ = drops_.total();
+    ::std::ostringstream report;
+    drops_.for_each([&](const internal_dump::AsyncDropCounters::Entry& entry) {
+      const ::std::uint64_t drops =
+          entry.drops.load(::std::memory_order_relaxed);
+      if (drops == entry.reported) return;
+      report << "dropped " << drops - entry.reported << " records from ";
+      entry.reported = drops;
+      if (const internal_dump::DumpSite* site =
+              entry.site.load(::std::memory_order_relaxed)) {
+        ::std::string_view file = site->file;
+        file.remove_prefix(file.find_last_of("/\\") + 1);
+        report << file << ':' << site->line << '\n';
+      } else {
+        report << "other sites\n";
+      }
+    });
+    sink_.write(report.view());
+  }
+
+  Sink& sink_;
+  const ::std::size_t batch_size_;
+  const AsyncOverflow overflow_;
+  const ::std::uint64_t sample_rate_;
+  const Severity urgent_severity_;
+  const bool timestamps_;
+  internal_dump::AsyncWaker waker_;
+  Queue queue_;
+  Queue urgent_;
+  internal_dump::AsyncDropCounters drops_;
+  // Only used by the background thread.
+  ::std::uint64_t reported_drops_ = 0;
+  const ::std::unique_ptr<internal_dump::AsyncBatcher> batcher_;
+  // TscClock::now() when the first record of the batch was rendered.
+  ::std::uint64_t oldest_ = 0;
+  const ::std::size_t format_batch_;
+  // Batches to fill, being filled, and being rendered, in order. Only used by
+  // the background thread.
+  ::std::vector<::std::unique_ptr<internal_dump::AsyncBatch>> free_batches_;
+  ::std::unique_ptr<internal_dump::AsyncBatch> formatting_;
+  ::std::deque<::std::unique_ptr<internal_dump::AsyncBatch>> rendering_;
+  // After the batches, which its workers use until they are stopped.
+  ::std::unique_ptr<internal_dump::FormatPool> pool_;
+  alignas(internal_dump::kCacheLineSize)
+      ::std::atomic<::std::uint32_t> flushes_ = 0;
+  // Set while waiters_ is not empty.
+  alignas(internal_dump::kCacheLineSize) ::std::atomic<bool> waiting_ = false;
+  // Guards waiters_ and waiters_tail_.
+  ::std::mutex waiters_mutex_;
+  AsyncWaiter* waiters_ = nullptr;
+  AsyncWaiter** waiters_tail_ = &waiters_;
+  ::std::thread thread_;
+};
+
+using AsyncSink = BasicAsyncSink<internal_dump::SharedRing>;
+using PerThreadAsyncSink = BasicAsyncSink<internal_dump::ThreadRings>;
+
+// A PerThreadAsyncSink per NUMA node, each with a background thread on the
+// CPUs of its node. Records go to the sink of the node their thread runs on.
+class NumaAsyncSink {
+ public:
+  // Starts a sink per node of `topology`, writing to `make_sink(node)`, a
+  // Sink& which must outlive this. The background threads run on the CPUs of
+  // their node, unless options.cpus is set.
+  template <class F>
+  explicit NumaAsyncSink(
+      F&& make_sink, const AsyncOptions& options = {},
+      const NumaTopology& topology = NumaTopology::system()):
+      topology_(topology) {
+    for (::std::size_t node = 0; node < topology_.nodes(); ++node) {
+      AsyncOptions node_options = options;
+      if (node_options.cpus.empty()) node_options.cpus = topology_.cpus(node);
+      sinks_.push_back(::std::make_unique<PerThreadAsyncSink>(
+          make_sink(node), ::std::move(node_options)));
+    }
+  }
+
+  ::std::size_t nodes() const { return sinks_.size(); }
+
+  template <class D>
+  void write(const D& dump, Severity severity = Severity::kInfo) {
+    sinks_[topology_.current_node()]->write(dump, severity);
+  }
+
+  template <class D>
+  friend NumaAsyncSink& operator<<(NumaAsyncSink& sink, const D& dump) {
+    sink.write(dump);
+    return sink;
+  }
+
+  // Waits until the records queued before the call are written to all sinks,
+  // and they are flushed.
+  void flush() {
+    for (const auto& sink : sinks_) sink->flush();
+  }
+
+  ::std::uint64_t dropped() const {
+    ::std::uint64_t dropped = 0;
+    for (const auto& sink : sinks_) dropped += sink->dropped();
+    return dropped;
+  }
+
+ private:
+  const NumaTopology topology_;
+  ::std::vector<::std::unique_ptr<PerThreadAsyncSink>> sinks_;
+};
+
+}  // namespace dump
+
+#endif // DUMP_ASYNC_HPP_
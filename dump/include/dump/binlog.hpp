@@ -0,0 +1,864 @@
+// Copyright 2010-2022 Google LLC
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Deferred-formatting binary log of DUMP() records.
+//
+// BinlogWriter does not format anything: a record is the ID of its call site
+// followed by the raw bytes of its values. The names and value types of a call
+// site are written once, in a schema entry, the first time the call site is
+// logged. BinlogReader turns the log back into `name = value` text later, on
+// another thread or offline.
+//
+// Example:
+//   std::vector<std::uint8_t> log;
+//   dump::BinlogWriter writer(log);
+//   writer << DUMP(foo, bar);  // Copies a call site ID, foo and bar.
+//   ...
+//   dump::BinlogReader reader;
+//   // Prints: foo = 42, bar = hello
+//   reader.decode(log, std::cout);
+//
+// Arithmetic values and strings are copied, and formatted by the reader exactly
+// as DUMP() would have. Values of any other type are formatted with their
+// operator<< when logged, and stored as strings.
+//
+// Integers are stored as varints, so small values take few bytes. Counters
+// and timestamps change little from one record to the next: with the delta
+// option, integers are stored as the difference with the same field of the
+// previous record of the same call site:
+//
+//   dump::BinlogWriter writer(log, {.delta = true});
+//
+// String values often come from a small set (endpoints, status...). With a
+// dictionary, each distinct string is written once, then only its ID:
+//
+//   dump::BinlogWriter writer(log, {.dictionary_size = 1024});
+//
+// The dictionary is bounded: once full, new strings are written as is.
+//
+// With the timestamps option, each record is stamped with TscClock::now(),
+// a few cycles where reading the system clock may cost a system call. The log
+// carries the calibrations of the clock, and the reader prints records with
+// their wall time, e.g.
+//
+//   dump::BinlogWriter writer(log, {.timestamps = true});
+//   ...
+//   // Prints: 2024-05-01T12:34:56.123456789Z foo = 42, bar = hello
+//   reader.decode(log, std::cout);
+//
+// The writer calibrates the clock when constructed, and each segment starts
+// with a calibration. Writing a record never calibrates: about once per
+// second, it only writes the latest calibration if another thread made a new
+// one. calibrate() makes one, e.g. when the log is flushed to a file:
+//
+//   writer.calibrate();
+//   file.write(log.data(), log.size());
+//
+// A log is a sequence of segments, each of which can be decoded on its own:
+// new_segment() starts a new one, forgetting schemas, deltas and dictionary,
+// e.g. when the log goes to a new file.
+//
+// A writer is not thread-safe: use one writer per thread.
+//
+//                    ====[ Format ]====
+//
+// A segment starts with a header: the "DLOG" magic, a version byte, an
+// endianness byte and a flags byte. Then come entries, each starting with a
+// kind byte:
+// - schema: varint site ID, u8 flags, varint line, string file, u8 field
+//   count, then for each field a u8 type and a string name.
+// - record: varint site ID, then in a segment with the timestamps flag the
+//   zig-zag varint of the difference of its TscClock ticks with those of the
+//   previous record of the segment (or with 0), then each value as per the
+//   schema.
+// - calibration, in a segment with the timestamps flag, before the records
+//   it applies to: u64 ticks, i64 system_clock time of the ticks in
+//   nanoseconds since the epoch, and double nanoseconds per tick.
+// The next segment starts with a header too, i.e. with 'D' instead of a kind.
+// Varints are LEB128. Strings are a varint size followed by their bytes.
+// Values are stored as:
+// - bool, char and 8-bit integers: one byte.
+// - Other signed integers: zig-zag varint.
+// - Other unsigned integers: varint.
+// - Integers of a call site with the delta flag: zig-zag varint of the
+//   difference with the previous value of the field, modulo 2^64. The first
+//   record of the call site is a difference with 0.
+// - float and double: in the byte order of the writer.
+// - Strings: a string, or in a segment with the dictionary flag, a varint
+//   which is either 0 followed by a string, 1 followed by a string added to
+//   the dictionary with the next ID (from 0), or 2 + the ID of a string of
+//   the dictionary.
+
+#ifndef DUMP_BINLOG_HPP_
+#define DUMP_BINLOG_HPP_
+
+#include <algorithm>
+#include <bit>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <ostream>
+#include <span>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "dump/clock.hpp"
+#include "dump/dump.hpp"
+
+namespace dump {
+namespace internal_dump {
+
+inline constexpr char kBinlogMagic[4] = {'D', 'L', 'O', 'G'};
+inline constexpr ::std::uint8_t kBinlogVersion = 4;
+// Logs of older versions down to this one are still read.
+inline constexpr ::std::uint8_t kBinlogMinVersion = 3;
+inline constexpr ::std::uint8_t kBinlogLittleEndian = 0;
+inline constexpr ::std::uint8_t kBinlogBigEndian = 1;
+inline constexpr ::std::uint8_t kBinlogEndian =
+    ::std::endian::native == ::std::endian::little ? kBinlogLittleEndian
+                                                   : kBinlogBigEndian;
+
+enum BinlogEntry : ::std::uint8_t {
+  kBinlogSchema = 1,
+  kBinlogRecord = 2,
+  kBinlogCalibration = 3,
+};
+
+// Flags of a schema.
+enum BinlogFlags : ::std::uint8_t {
+  kBinlogDelta = 1 << 0,
+};
+
+// Flags of a segment.
+enum BinlogSegmentFlags : ::std::uint8_t {
+  kBinlogDictionary = 1 << 0,
+  kBinlogTimestamps = 1 << 1,
+};
+
+enum BinlogString : ::std::uint8_t {
+  kBinlogLiteral = 0,
+  kBinlogNewEntry = 1,
+  kBinlogFirstEntry = 2,
+};
+
+enum BinlogType : ::std::uint8_t {
+  kBinlogBool = 1,
+  kBinlogChar,
+  kBinlogInt8,
+  kBinlogUInt8,
+  kBinlogInt16,
+  kBinlogUInt16,
+  kBinlogInt32,
+  kBinlogUInt32,
+  kBinlogInt64,
+  kBinlogUInt64,
+  kBinlogFloat,
+  kBinlogDouble,
+  kBinlogString,
+  // Formatted with operator<< when logged.
+  kBinlogText,
+};
+
+template <class T>
+constexpr BinlogType binlog_type() {
+  if constexpr (::std::is_same_v<T, bool>) {
+    return kBinlogBool;
+  } else if constexpr (::std::is_same_v<T, char>) {
+    return kBinlogChar;
+  } else if constexpr (::std::is_integral_v<T>) {
+    constexpr bool is_signed = ::std::is_signed_v<T>;
+    if constexpr (sizeof(T) == 1) return is_signed ? kBinlogInt8 : kBinlogUInt8;
+    if constexpr (sizeof(T) == 2) {
+      return is_signed ? kBinlogInt16 : kBinlogUInt16;
+    }
+    if constexpr (sizeof(T) == 4) {
+      return is_signed ? kBinlogInt32 : kBinlogUInt32;
+    }
+    if constexpr (sizeof(T) == 8) {
+      return is_signed ? kBinlogInt64 : kBinlogUInt64;
+    }
+  } else if constexpr (::std::is_same_v<T, float>) {
+    return kBinlogFloat;
+  } else if constexpr (::std::is_floating_point_v<T>) {
+    return kBinlogDouble;
+  } else if constexpr (::std::is_convertible_v<const T&, ::std::string_view>) {
+    return kBinlogString;
+  } else {
+    return kBinlogText;
+  }
+}
+
+// Types of the values Ts, as in a schema, with room for none.
+template <class... Ts>
+inline constexpr BinlogType kBinlogTypes[] = {binlog_type<Ts>()...,
+                                              kBinlogText};
+
+constexpr bool is_binlog_varint(BinlogType type) {
+  return type >= kBinlogInt16 && type <= kBinlogUInt64;
+}
+
+constexpr bool is_binlog_signed(BinlogType type) {
+  return type == kBinlogInt16 || type == kBinlogInt32 || type == kBinlogInt64;
+}
+
+constexpr ::std::uint64_t zigzag_encode(::std::int64_t value) {
+  return (static_cast<::std::uint64_t>(value) << 1) ^
+         static_cast<::std::uint64_t>(value >> 63);
+}
+
+constexpr ::std::int64_t zigzag_decode(::std::uint64_t value) {
+  return static_cast<::std::int64_t>(value >> 1) ^
+         -static_cast<::std::int64_t>(value & 1);
+}
+
+inline void put_binlog_bytes(::std::vector<::std::uint8_t>& out,
+                             const void* data, ::std::size_t size) {
+  const auto* bytes = static_cast<const ::std::uint8_t*>(data);
+  out.insert(out.end(), bytes, bytes + size);
+}
+
+template <class T>
+void put_binlog_raw(::std::vector<::std::uint8_t>& out, const T& value) {
+  put_binlog_bytes(out, &value, sizeof(T));
+}
+
+inline void put_binlog_varint(::std::vector<::std::uint8_t>& out,
+                              ::std::uint64_t value) {
+  while (value >= 0x80) {
+    out.push_back(static_cast<::std::uint8_t>(value) | 0x80);
+    value >>= 7;
+  }
+  out.push_back(static_cast<::std::uint8_t>(value));
+}
+
+inline void put_binlog_string(::std::vector<::std::uint8_t>& out,
+                              ::std::string_view s) {
+  put_binlog_varint(out, s.size());
+  put_binlog_bytes(out, s.data(), s.size());
+}
+
+// Writes an integer of the given type, as the difference with `*previous`
+// if not null.
+inline void put_binlog_integer(::std::vector<::std::uint8_t>& out,
+                               BinlogType type, ::std::uint64_t value,
+                               ::std::uint64_t* previous) {
+  if (previous != nullptr) {
+    put_binlog_varint(
+        out, zigzag_encode(static_cast<::std::int64_t>(value - *previous)));
+    *previous = value;
+  } else if (is_binlog_signed(type)) {
+    put_binlog_varint(out, zigzag_encode(static_cast<::std::int64_t>(value)));
+  } else {
+    put_binlog_varint(out, value);
+  }
+}
+
+// Strings already written in the segment, up to a given number.
+class BinlogDictionary {
+ public:
+  explicit BinlogDictionary(::std::size_t capacity): capacity_(capacity) {}
+
+  // Writes `s` as an ID if already written, else adds it if there is room.
+  void put(::std::vector<::std::uint8_t>& out, ::std::string_view s) {
+    if (const auto it = ids_.find(s); it != ids_.end()) {
+      put_binlog_varint(out, kBinlogFirstEntry + it->second);
+      return;
+    }
+    if (ids_.size() < capacity_) {
+      ids_.emplace(s, ids_.size());
+      put_binlog_varint(out, kBinlogNewEntry);
+    } else {
+      put_binlog_varint(out, kBinlogLiteral);
+    }
+    put_binlog_string(out, s);
+  }
+
+  void clear() { ids_.clear(); }
+
+ private:
+  struct Hash {
+    using is_transparent = void;
+    ::std::size_t operator()(::std::string_view s) const {
+      return ::std::hash<::std::string_view>()(s);
+    }
+  };
+
+  const ::std::size_t capacity_;
+  ::std::unordered_map<::std::string, ::std::uint64_t, Hash, ::std::equal_to<>>
+      ids_;
+};
+
+inline void put_binlog_string(::std::vector<::std::uint8_t>& out,
+                              ::std::string_view s,
+                              BinlogDictionary* dictionary) {
+  if (dictionary != nullptr) {
+    dictionary->put(out, s);
+  } else {
+    put_binlog_string(out, s);
+  }
+}
+
+template <class T>
+void put_binlog_value(::std::vector<::std::uint8_t>& out, const T& value,
+                      ::std::uint64_t* previous,
+                      BinlogDictionary* dictionary) {
+  constexpr BinlogType type = binlog_type<T>();
+  if constexpr (is_binlog_varint(type)) {
+    // Sign-extends signed values, so that their difference is small too.
+    using Wide = ::std::conditional_t<::std::is_signed_v<T>, ::std::int64_t,
+                                      ::std::uint64_t>;
+    put_binlog_integer(
+        out, type, static_cast<::std::uint64_t>(static_cast<Wide>(value)),
+        previous);
+  } else if constexpr (type == kBinlogDouble) {
+    put_binlog_raw(out, static_cast<double>(value));
+  } else if constexpr (type == kBinlogString) {
+    if constexpr (::std::is_pointer_v<T>) {
+      put_binlog_string(out, value == nullptr ? "" : value, dictionary);
+    } else {
+      put_binlog_string(out, value, dictionary);
+    }
+  } else if constexpr (type == kBinlogText) {
+    ::std::ostringstream oss;
+    oss << value;
+    put_binlog_string(out, oss.str(), dictionary);
+  } else {
+    put_binlog_raw(out, value);
+  }
+}
+
+struct binlog_fields {
+  template <class... Ts>
+  void operator()(const Ts&... ts) {
+    if (new_site) {
+      constexpr const BinlogType* types = kBinlogTypes<Ts...>;
+      out.push_back(kBinlogSchema);
+      put_binlog_varint(out, id);
+      out.push_back(previous != nullptr ? kBinlogDelta : 0);
+      put_binlog_varint(out, static_cast<::std::uint32_t>(site.line));
+      put_binlog_string(out, site.file);
+      out.push_back(static_cast<::std::uint8_t>(sizeof...(Ts)));
+      for (::std::size_t i = 0; i < sizeof...(Ts); ++i) {
+        out.push_back(types[i]);
+        put_binlog_string(out, names[i]);
+      }
+    }
+    out.push_back(kBinlogRecord);
+    put_binlog_varint(out, id);
+    if (stamp != nullptr) put_binlog_varint(out, *stamp);
+    ::std::size_t n = 0;
+    (put_binlog_value(out, ts, previous != nullptr ? &previous[n++] : nullptr,
+                      dictionary),
+     ...);
+  }
+
+  ::std::vector<::std::uint8_t>& out;
+  const DumpSite& site;
+  DumpNames names;
+  ::std::uint32_t id;
+  bool new_site;
+  // Previous value of each field, if delta encoded.
+  ::std::uint64_t* previous;
+  // Null if strings are not interned.
+  BinlogDictionary* dictionary;
+  // Zig-zag difference of the ticks of the record with those of the previous
+  // one, or null if not timestamped.
+  const ::std::uint64_t* stamp;
+};
+
+// Reads the entries of a binary log.
+class BinlogInput {
+ public:
+  explicit BinlogInput(::std::span<const ::std::uint8_t> bytes):
+      bytes_(bytes) {}
+
+  bool empty() const { return pos_ == bytes_.size(); }
+
+  // Bools are only 0 or 1.
+  template <class T>
+  bool raw(T& value) {
+    if constexpr (::std::is_same_v<T, bool>) {
+      ::std::uint8_t byte;
+      if (!raw(byte) || byte > 1) return false;
+      value = byte != 0;
+      return true;
+    }
+    if (bytes_.size() - pos_ < sizeof(T)) return false;
+    ::std::memcpy(&value, bytes_.data() + pos_, sizeof(T));
+    pos_ += sizeof(T);
+    return true;
+  }
+
+  bool bytes(::std::string& s, ::std::uint64_t size) {
+    if (bytes_.size() - pos_ < size) return false;
+    s.assign(reinterpret_cast<const char*>(bytes_.data()) + pos_, size);
+    pos_ += size;
+    return true;
+  }
+
+  bool varint(::std::uint64_t& value) {
+    value = 0;
+    for (int shift = 0; shift < 64 && pos_ < bytes_.size(); shift += 7) {
+      const ::std::uint8_t byte = bytes_[pos_++];
+      value |= static_cast<::std::uint64_t>(byte & 0x7f) << shift;
+      if ((byte & 0x80) == 0) return true;
+    }
+    return false;
+  }
+
+  template <class T>
+  bool varint(T& value) {
+    ::std::uint64_t v;
+    if (!varint(v)) return false;
+    value = static_cast<T>(v);
+    return true;
+  }
+
+  bool string(::std::string& s) {
+    ::std::uint64_t size;
+    return varint(size) && bytes(s, size);
+  }
+
+  // Same as above, but `s` views the input.
+  bool string(::std::string_view& s) {
+    ::std::uint64_t size;
+    if (!varint(size) || bytes_.size() - pos_ < size) return false;
+    s = ::std::string_view(reinterpret_cast<const char*>(bytes_.data()) + pos_,
+                           size);
+    pos_ += size;
+    return true;
+  }
+
+ private:
+  ::std::span<const ::std::uint8_t> bytes_;
+  ::std::size_t pos_ = 0;
+};
+
+template <class T, class F>
+bool visit_binlog_raw(BinlogInput& in, F& f) {
+  T value;
+  if (!in.raw(value)) return false;
+  f(value);
+  return true;
+}
+
+// Reads an integer written by put_binlog_integer().
+template <class T, class F>
+bool visit_binlog_integer(BinlogInput& in, ::std::uint64_t* previous, F& f) {
+  ::std::uint64_t value;
+  if (!in.varint(value)) return false;
+  if (previous != nullptr) {
+    value = *previous += static_cast<::std::uint64_t>(zigzag_decode(value));
+  } else if (::std::is_signed_v<T>) {
+    value = static_cast<::std::uint64_t>(zigzag_decode(value));
+  }
+  f(static_cast<T>(value));
+  return true;
+}
+
+// Reads a value of type `type`, but a string of a dictionary, and calls
+// `f(value)` with it as the type it was written as, or as a string_view for
+// strings and formatted values. Returns false if malformed.
+template <class F>
+bool visit_binlog_value(BinlogInput& in, ::std::uint8_t type,
+                        ::std::uint64_t* previous, F&& f) {
+  switch (type) {
+    case kBinlogBool: return visit_binlog_raw<bool>(in, f);
+    case kBinlogChar: return visit_binlog_raw<char>(in, f);
+    case kBinlogInt8: return visit_binlog_raw<signed char>(in, f);
+    case kBinlogUInt8: return visit_binlog_raw<unsigned char>(in, f);
+    case kBinlogInt16:
+      return visit_binlog_integer<::std::int16_t>(in, previous, f);
+    case kBinlogUInt16:
+      return visit_binlog_integer<::std::uint16_t>(in, previous, f);
+    case kBinlogInt32:
+      return visit_binlog_integer<::std::int32_t>(in, previous, f);
+    case kBinlogUInt32:
+      return visit_binlog_integer<::std::uint32_t>(in, previous, f);
+    case kBinlogInt64:
+      return visit_binlog_integer<::std::int64_t>(in, previous, f);
+    case kBinlogUInt64:
+      return visit_binlog_integer<::std::uint64_t>(in, previous, f);
+    case kBinlogFloat: return visit_binlog_raw<float>(in, f);
+    case kBinlogDouble: return visit_binlog_raw<double>(in, f);
+    case kBinlogString:
+    case kBinlogText: {
+      ::std::string_view s;
+      if (!in.string(s)) return false;
+      f(s);
+      return true;
+    }
+    default:
+      return false;
+  }
+}
+
+}  // namespace internal_dump
+
+struct BinlogOptions {
+  // Stores integers as the difference with the previous record of the same
+  // call site.
+  bool delta = false;
+  // Maximum number of distinct strings written once per segment, then as an
+  // ID. 0 disables the dictionary.
+  ::std::size_t dictionary_size = 0;
+  // Stamps records with TscClock::now().
+  bool timestamps = false;
+};
+
+class BinlogWriter {
+ public:
+  // Appends the log to `out`, starting with its header.
+  explicit BinlogWriter(::std::vector<::std::uint8_t>& out,
+                        BinlogOptions options = {}):
+      out_(out),
+      options_(options),
+      dictionary_(options.dictionary_size) {
+    start_segment_();
+  }
+
+  BinlogWriter(const BinlogWriter&) = delete;
+  BinlogWriter& operator=(const BinlogWriter&) = delete;
+
+  template <class D>
+  BinlogWriter& write(const D& dump) {
+    ::std::uint64_t stamp = 0;
+    if (options_.timestamps) {
+      const ::std::uint64_t ticks = TscClock::now();
+      // Signed: the counter of this CPU may be slightly behind the one the
+      // calibration was read on.
+      if (static_cast<::std::int64_t>(ticks - next_calibration_) >= 0) {
+        write_calibration_(TscClock::latest(), ticks);
+      }
+      stamp = internal_dump::zigzag_encode(
+          static_cast<::std::int64_t>(ticks - last_ticks_));
+      last_ticks_ = ticks;
+    }
+    const auto [id, new_site] = site_id_(dump.site(), dump.names());
+    dump.visit(internal_dump::binlog_fields{
+        .out=out_,
+        .site=dump.site(),
+        .names=dump.names(),
+        .id=id,
+        .new_site=new_site,
+        .previous=options_.delta ? previous_[id - 1].data() : nullptr,
+        .dictionary=options_.dictionary_size != 0 ? &dictionary_ : nullptr,
+        .stamp=options_.timestamps ? &stamp : nullptr,
+        });
+    return *this;
+  }
+
+  // Starts a new segment, which can be decoded without the previous ones.
+  void new_segment() {
+    sites_.clear();
+    last_id_ = 0;
+    previous_.clear();
+    dictionary_.clear();
+    last_ticks_ = 0;
+    start_segment_();
+  }
+
+  // Writes a new calibration of the clock if the latest one is older than a
+  // second, to follow adjustments of the system clock. Does nothing without
+  // the timestamps option.
+  void calibrate() {
+    if (options_.timestamps) {
+      write_calibration_(TscClock::calibration(), TscClock::now());
+    }
+  }
+
+  template <class D>
+  friend BinlogWriter& operator<<(BinlogWriter& log, const D& dump) {
+    return log.write(dump);
+  }
+
+ private:
+  void write_header_() {
+    internal_dump::put_binlog_bytes(out_, internal_dump::kBinlogMagic, 4);
+    out_.push_back(internal_dump::kBinlogVersion);
+    out_.push_back(internal_dump::kBinlogEndian);
+    out_.push_back(
+        (options_.dictionary_size != 0 ? internal_dump::kBinlogDictionary
+                                       : 0) |
+        (options_.timestamps ? internal_dump::kBinlogTimestamps : 0));
+  }
+
+  void start_segment_() {
+    write_header_();
+    written_calibration_ = 0;
+    if (options_.timestamps) {
+      write_calibration_(TscClock::calibration(), TscClock::now());
+    }
+  }
+
+  // Writes `c` unless already written, and sets when to look for a new
+  // calibration, from `ticks`.
+  void write_calibration_(const TscClock::Calibration& c,
+                          ::std::uint64_t ticks) {
+    next_calibration_ =
+        ticks +
+        static_cast<::std::uint64_t>(
+            static_cast<double>(::std::chrono::nanoseconds(
+                                    internal_dump::kTscRecalibrationPeriod)
+                                    .count()) /
+            c.ns_per_tick);
+    if (c.ticks == written_calibration_) return;
+    written_calibration_ = c.ticks;
+    out_.push_back(internal_dump::kBinlogCalibration);
+    internal_dump::put_binlog_raw(out_, c.ticks);
+    internal_dump::put_binlog_raw(
+        out_, static_cast<::std::int64_t>(
+                  ::std::chrono::duration_cast<::std::chrono::nanoseconds>(
+                      c.system.time_since_epoch())
+                      .count()));
+    internal_dump::put_binlog_raw(out_, c.ns_per_tick);
+  }
+
+  struct Site {
+    // ID of the call site with its own names, 0 if not logged yet.
+    ::std::uint32_t id = 0;
+    // IDs of the call site with names given by Dump::as().
+    ::std::vector<::std::pair<::std::vector<::std::string>, ::std::uint32_t>>
+        renamed;
+  };
+
+  // Returns the ID of the call site with these names, and whether it is new.
+  ::std::pair<::std::uint32_t, bool> site_id_(
+      const internal_dump::DumpSite& site, internal_dump::DumpNames names) {
+    Site& s = sites_[&site];
+    if (names.data() == site.names.data()) {
+      if (s.id != 0) return {s.id, false};
+      s.id = new_id_(names.size());
+      return {s.id, true};
+    }
+    for (const auto& [renamed, id] : s.renamed) {
+      if (::std::equal(renamed.begin(), renamed.end(), names.begin(),
+                       names.end())) {
+        return {id, false};
+      }
+    }
+    const ::std::uint32_t id = new_id_(names.size());
+    s.renamed.emplace_back(
+        ::std::vector<::std::string>(names.begin(), names.end()), id);
+    return {id, true};
+  }
+
+  ::std::uint32_t new_id_(::std::size_t fields) {
+    if (options_.delta) previous_.emplace_back(fields);
+    return ++last_id_;
+  }
+
+  ::std::vector<::std::uint8_t>& out_;
+  const BinlogOptions options_;
+  ::std::unordered_map<const internal_dump::DumpSite*, Site> sites_;
+  ::std::uint32_t last_id_ = 0;
+  // Previous value of each field, by call site ID minus one, if delta encoded.
+  ::std::vector<::std::vector<::std::uint64_t>> previous_;
+  internal_dump::BinlogDictionary dictionary_;
+  // Ticks of the previous record of the segment, if timestamped.
+  ::std::uint64_t last_ticks_ = 0;
+  // Ticks from which to look for a new calibration.
+  ::std::uint64_t next_calibration_ = 0;
+  // Ticks of the latest calibration written to the segment.
+  ::std::uint64_t written_calibration_ = 0;
+};
+
+class BinlogReader {
+ public:
+  // Separators used to print records, as in Dump::sep().
+  explicit BinlogReader(::std::string field_sep = ", ",
+                        ::std::string kv_sep = " = "):
+      field_sep_(::std::move(field_sep)),
+      kv_sep_(::std::move(kv_sep)) {}
+
+  // Prints the records of `log`, one per line. The log may be split across
+  // several calls, as long as entries are not. Returns false if the log is
+  // malformed.
+  bool decode(::std::span<const ::std::uint8_t> log, ::std::ostream& os) {
+    internal_dump::BinlogInput in(log);
+    ::std::uint8_t entry;
+    if (!header_read_) {
+      if (!in.raw(entry) || entry != internal_dump::kBinlogMagic[0] ||
+          !read_header_(in)) {
+        return false;
+      }
+      header_read_ = true;
+    }
+    while (!in.empty()) {
+      if (!in.raw(entry)) return false;
+      switch (entry) {
+        case internal_dump::kBinlogSchema:
+          if (!read_schema_(in)) return false;
+          break;
+        case internal_dump::kBinlogRecord:
+          if (!print_record_(in, os)) return false;
+          break;
+        case internal_dump::kBinlogCalibration:
+          if (!read_calibration_(in)) return false;
+          break;
+        case internal_dump::kBinlogMagic[0]:
+          if (!read_header_(in)) return false;
+          break;
+        default:
+          return false;
+      }
+    }
+    return true;
+  }
+
+ private:
+  struct Schema {
+    ::std::uint8_t flags;
+    ::std::string file;
+    ::std::uint32_t line;
+    ::std::vector<::std::uint8_t> types;
+    ::std::vector<::std::string> names;
+    // Previous value of each field, if delta encoded.
+    ::std::vector<::std::uint64_t> previous;
+  };
+
+  // Reads the header of a segment, but its first byte, and forgets the
+  // previous segment.
+  bool read_header_(internal_dump::BinlogInput& in) {
+    ::std::string magic;
+    ::std::uint8_t version;
+    ::std::uint8_t endian;
+    if (!in.bytes(magic, 3) ||
+        magic != ::std::string_view(internal_dump::kBinlogMagic + 1, 3) ||
+        !in.raw(version) || version < internal_dump::kBinlogMinVersion ||
+        version > internal_dump::kBinlogVersion ||
+        !in.raw(endian) || endian != internal_dump::kBinlogEndian ||
+        !in.raw(segment_flags_)) {
+      return false;
+    }
+    schemas_.clear();
+    dictionary_.clear();
+    calibrated_ = false;
+    ticks_ = 0;
+    return true;
+  }
+
+  bool read_calibration_(internal_dump::BinlogInput& in) {
+    ::std::int64_t system;
+    if ((segment_flags_ & internal_dump::kBinlogTimestamps) == 0 ||
+        !in.raw(calibration_.ticks) || !in.raw(system) ||
+        !in.raw(calibration_.ns_per_tick)) {
+      return false;
+    }
+    calibration_.system = ::std::chrono::system_clock::time_point(
+        ::std::chrono::duration_cast<::std::chrono::system_clock::duration>(
+            ::std::chrono::nanoseconds(system)));
+    calibrated_ = true;
+    return true;
+  }
+
+  bool read_schema_(internal_dump::BinlogInput& in) {
+    ::std::uint32_t id;
+    Schema schema;
+    ::std::uint8_t size;
+    if (!in.varint(id) || !in.raw(schema.flags) || !in.varint(schema.line) ||
+        !in.string(schema.file) || !in.raw(size)) {
+      return false;
+    }
+    schema.types.resize(size);
+    schema.names.resize(size);
+    for (::std::size_t i = 0; i < size; ++i) {
+      if (!in.raw(schema.types[i]) || !in.string(schema.names[i])) {
+        return false;
+      }
+    }
+    if (schema.flags & internal_dump::kBinlogDelta) {
+      schema.previous.resize(size);
+    }
+    schemas_[id] = ::std::move(schema);
+    return true;
+  }
+
+  bool print_record_(internal_dump::BinlogInput& in, ::std::ostream& os) {
+    ::std::uint32_t id;
+    if (!in.varint(id)) return false;
+    const auto it = schemas_.find(id);
+    if (it == schemas_.end()) return false;
+    Schema& schema = it->second;
+    if (segment_flags_ & internal_dump::kBinlogTimestamps) {
+      ::std::uint64_t stamp;
+      if (!in.varint(stamp) || !calibrated_) return false;
+      ticks_ +=
+          static_cast<::std::uint64_t>(internal_dump::zigzag_decode(stamp));
+      internal_dump::write_utc_time(
+          os, TscClock::to_system(ticks_, calibration_));
+      os << ' ';
+    }
+    for (::std::size_t i = 0; i < schema.types.size(); ++i) {
+      if (i != 0) os << field_sep_;
+      os << schema.names[i] << kv_sep_;
+      ::std::uint64_t* previous =
+          schema.previous.empty() ? nullptr : &schema.previous[i];
+      if (!print_value_(in, schema.types[i], previous, os)) return false;
+    }
+    os << '\n';
+    return true;
+  }
+
+  bool print_value_(internal_dump::BinlogInput& in, ::std::uint8_t type,
+                    ::std::uint64_t* previous, ::std::ostream& os) {
+    if ((type == internal_dump::kBinlogString ||
+         type == internal_dump::kBinlogText) &&
+        (segment_flags_ & internal_dump::kBinlogDictionary)) {
+      return print_string_(in, os);
+    }
+    return internal_dump::visit_binlog_value(
+        in, type, previous, [&](const auto& value) { os << value; });
+  }
+
+  // Prints a string of a segment with a dictionary.
+  bool print_string_(internal_dump::BinlogInput& in, ::std::ostream& os) {
+    ::std::uint64_t tag;
+    if (!in.varint(tag)) return false;
+    if (tag >= internal_dump::kBinlogFirstEntry) {
+      tag -= internal_dump::kBinlogFirstEntry;
+      if (tag >= dictionary_.size()) return false;
+      os << dictionary_[tag];
+      return true;
+    }
+    if (!in.string(value_)) return false;
+    os << value_;
+    if (tag == internal_dump::kBinlogNewEntry) dictionary_.push_back(value_);
+    return true;
+  }
+
+  const ::std::string field_sep_;
+  const ::std::string kv_sep_;
+  bool header_read_ = false;
+  ::std::uint8_t segment_flags_ = 0;
+  ::std::unordered_map<::std::uint32_t, Schema> schemas_;
+  ::std::vector<::std::string> dictionary_;
+  // Latest calibration of the segment, if timestamped.
+  bool calibrated_ = false;
+  TscClock::Calibration calibration_ = {};
+  // Ticks of the previous record of the segment.
+  ::std::uint64_t ticks_ = 0;
+  // Reused across string values.
+  ::std::string value_;
+};
+
+}  // namespace dump
+
+#endif // DUMP_BINLOG_HPP_
@@ -0,0 +1,290 @@
+// Copyright 2010-2022 Google LLC
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// BroadcastRing passes DUMP() records from one producer to any number of
+// consumers, each reading every record at its own pace.
+//
+// Example:
+//   dump::BroadcastRing ring;
+//   // Producer thread:
+//   ring << DUMP(request.id, latency);
+//   // Each consumer thread, e.g. a file writer and a live tail:
+//   dump::BroadcastReader reader(ring);
+//   dump::BroadcastRecord record;
+//   while (running) {
+//     while (reader.read(record)) file << record << '\n';
+//     ...
+//   }
+//
+// Writing a record encodes its values once, as in a binary log (see
+// binlog.hpp), into the next slot of the ring. Only values of types without a
+// binary encoding are formatted, and the producer neither copies the record
+// per consumer nor waits for any of them. Consumers copy records out of the
+// ring, then print them, render them as JSON, or visit their values, however
+// they like.
+//
+// Only one thread at a time may write to a ring. Readers are not shared
+// between threads, and must not outlive their ring.
+//
+//                    ====[ Overruns ]====
+//
+// The ring keeps the last `capacity` records, overwriting the oldest one:
+//
+//   dump::BroadcastRing ring({.capacity = 4096, .record_size = 512});
+//
+// A reader which falls more than `capacity` records behind skips to the
+// oldest record still in the ring, and counts the records it missed in
+// skipped(). A new reader starts at the oldest record still in the ring.
+//
+// A record whose values take more than `record_size` bytes reads as
+// `truncated = file:line` of its call site, and names given by Dump::as() are
+// not kept (see slot_ring.hpp).
+//
+//                    ====[ Values ]====
+//
+// A record prints, and renders as JSON, like the dump it was written from,
+// but with the default separators, and with values of types without a binary
+// encoding as JSON strings of their text. BroadcastRecord::visit_fields()
+// passes each value as the type it was written as, or as a string view for
+// strings and formatted values.
+
+#ifndef DUMP_BROADCAST_HPP_
+#define DUMP_BROADCAST_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <span>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "dump/binlog.hpp"
+#include "dump/dump.hpp"
+#include "dump/slot_ring.hpp"
+
+namespace dump {
+
+struct BroadcastOptions {
+  // Records kept for readers, rounded up to a power of two.
+  ::std::size_t capacity = 1024;
+  // Bytes of values a record holds at most.
+  ::std::size_t record_size = 256;
+};
+
+namespace internal_dump {
+
+// View returned by BroadcastRecord::json(): prints the record as a JSON
+// object.
+template <class R>
+class BroadcastJson {
+ public:
+  explicit BroadcastJson(const R& record): record_(record) {}
+
+  ::std::string str() const {
+    ::std::ostringstream oss;
+    oss << *this;
+    return oss.str();
+  }
+
+  friend ::std::ostream& operator<<(::std::ostream& os,
+                                    const BroadcastJson& json) {
+    json.print_(os);
+    return os;
+  }
+
+ private:
+  void print_(::std::ostream& os) const { record_.print_json_(os); }
+
+  const R& record_;
+};
+
+}  // namespace internal_dump
+
+// A record copied out of a BroadcastRing by BroadcastReader::read().
+class BroadcastRecord {
+ public:
+  ::std::string str() const {
+    ::std::ostringstream oss;
+    oss << *this;
+    return oss.str();
+  }
+
+  // Only valid once a record was read.
+  const internal_dump::DumpSite& site() const { return *site_; }
+  internal_dump::DumpNames names() const { return site_->names; }
+  internal_dump::DumpNames json_keys() const { return site_->json_keys; }
+
+  // Whether the values did not fit in a slot, and are lost.
+  bool truncated() const { return size_ == internal_dump::kSlotTruncated; }
+
+  // Calls `f(name, value)` for each field, but of a truncated record.
+  template <class F>
+  void visit_fields(F&& f) const {
+    if (truncated()) return;
+    internal_dump::BinlogInput in{::std::span<const ::std::uint8_t>(values_)};
+    const internal_dump::DumpNames names = site_->names;
+    for (::std::size_t i = 0; i < names.size(); ++i) {
+      internal_dump::visit_binlog_value(
+          in, types_[i], nullptr,
+          [&](const auto& value) { f(names[i], value); });
+    }
+  }
+
+  internal_dump::BroadcastJson<BroadcastRecord> json() const {
+    return internal_dump::BroadcastJson<BroadcastRecord>(*this);
+  }
+
+  friend ::std::ostream& operator<<(::std::ostream& os,
+                                    const BroadcastRecord& record) {
+    if (record.truncated()) {
+      return os << "truncated = " << record.site_->file << ':'
+                << record.site_->line;
+    }
+    bool first = true;
+    record.visit_fields([&](::std::string_view name, const auto& value) {
+      if (!first) os << ", ";
+      first = false;
+      os << name << " = " << value;
+    });
+    return os;
+  }
+
+ private:
+  friend class BroadcastReader;
+  friend class internal_dump::BroadcastJson<BroadcastRecord>;
+
+  void print_json_(::std::ostream& os) const {
+    os.put('{');
+    if (truncated()) {
+      internal_dump::write_json_string(os, "truncated");
+      os.put(':');
+      internal_dump::write_json_string(
+          os, ::std::string(site_->file) + ':' +
+                  ::std::to_string(site_->line));
+    } else {
+      const internal_dump::DumpNames keys = site_->json_keys;
+      ::std::size_t n = 0;
+      visit_fields([&](::std::string_view, const auto& value) {
+        if (n != 0) os.put(',');
+        os.write(keys[n].data(), keys[n].size());
+        ++n;
+        internal_dump::write_json(os, value);
+      });
+    }
+    os.put('}');
+  }
+
+  const internal_dump::DumpSite* site_ = nullptr;
+  const internal_dump::BinlogType* types_ = nullptr;
+  // Bytes of values, or kSlotTruncated.
+  ::std::uint32_t size_ = 0;
+  ::std::vector<::std::uint8_t> values_;
+};
+
+class BroadcastRing {
+ public:
+  explicit BroadcastRing(BroadcastOptions options = {}):
+      slots_(options.capacity, options.record_size) {}
+
+  BroadcastRing(const BroadcastRing&) = delete;
+  BroadcastRing& operator=(const BroadcastRing&) = delete;
+
+  // Encodes the values of `dump` into the next slot, overwriting the oldest
+  // record once the ring is full.
+  template <class D>
+  BroadcastRing& write(const D& dump) {
+    dump.visit([&](const auto&... values) {
+      slots_.push(dump.site(), values...);
+    });
+    return *this;
+  }
+
+  template <class D>
+  friend BroadcastRing& operator<<(BroadcastRing& ring, const D& dump) {
+    return ring.write(dump);
+  }
+
+  // Records written so far.
+  ::std::uint64_t written() const { return slots_.tail(); }
+
+  ::std::size_t capacity() const { return slots_.capacity(); }
+
+ private:
+  friend class BroadcastReader;
+
+  internal_dump::SlotRing slots_;
+};
+
+// Reads the records of a BroadcastRing in order, independently of its other
+// readers. Readers only read the ring, as sequence locks: the producer never
+// waits for them.
+class BroadcastReader {
+ public:
+  explicit BroadcastReader(const BroadcastRing& ring):
+      ring_(ring),
+      next_(ring.slots_.oldest(ring.slots_.tail())) {}
+
+  // Copies the next record into `record`, skipping the records overwritten
+  // since the last read. Returns false if there is no new record.
+  bool read(BroadcastRecord& record) {
+    for (;;) {
+      const ::std::uint64_t tail = ring_.slots_.tail();
+      if (next_ == tail) return false;
+      const ::std::uint64_t oldest = ring_.slots_.oldest(tail);
+      if (next_ < oldest) {
+        skipped_ += oldest - next_;
+        next_ = oldest;
+      }
+      if (copy_(record)) {
+        ++next_;
+        return true;
+      }
+      // Overwritten while copied.
+      ++skipped_;
+      ++next_;
+    }
+  }
+
+  // Records overwritten before this reader read them.
+  ::std::uint64_t skipped() const { return skipped_; }
+
+ private:
+  // Copies the record at next_. Returns false if it was overwritten.
+  bool copy_(BroadcastRecord& record) {
+    const internal_dump::SlotRing& slots = ring_.slots_;
+    internal_dump::SlotRead read;
+    if (!slots.begin_read(next_, read)) return false;
+    record.site_ = read.site;
+    record.types_ = read.types;
+    record.size_ = read.size;
+    record.values_.clear();
+    if (!read.truncated()) {
+      slots.read_values(read, [&](const void* data, ::std::size_t size) {
+        const auto* bytes = static_cast<const ::std::uint8_t*>(data);
+        record.values_.insert(record.values_.end(), bytes, bytes + size);
+      });
+    }
+    return slots.validate(read);
+  }
+
+  const BroadcastRing& ring_;
+  // Position of the next record to read.
+  ::std::uint64_t next_;
+  ::std::uint64_t skipped_ = 0;
+};
+
+}  // namespace dump
+
+#endif // DUMP_BROADCAST_HPP_
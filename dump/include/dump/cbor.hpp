@@ -0,0 +1,319 @@
+// Copyright 2010-2022 Google LLC
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// CBOR (RFC 8949) encoding of DUMP() records.
+//
+// A record is encoded as a CBOR map from field names to values. Integers,
+// floats and bools are encoded in binary, strings as text strings, maps as
+// maps and other ranges as arrays. Anything else is encoded as the text
+// string of its operator<<.
+//
+// Example:
+//   int foo = 42;
+//   std::string bar = "hi";
+//   // {"foo": 42, "bar": "hi"}
+//   // a2 63 66 6f 6f 18 2a 63 62 61 72 62 68 69
+//   std::vector<std::uint8_t> bytes = dump::to_cbor(DUMP(foo, bar));
+//
+// CborWriter appends records to a buffer. Once the schema of a call site is
+// registered, the records of that DUMP() call site use the index of each field
+// as key rather than its name, since the reader already knows the names. Each
+// schema gets an ID, which its records carry, for the reader to tell which
+// names apply when it receives the records of several call sites. Records
+// renamed with Dump::as() keep their names as keys, unless their names are
+// those of the schema:
+//
+//   std::vector<std::uint8_t> buffer;
+//   dump::CborWriter cbor(buffer);
+//   for (...) {
+//     const auto record = DUMP(foo, bar);
+//     if (first) {
+//       // [0, ["foo", "bar"]], to be sent to the reader once.
+//       dump::CborSchema schema = cbor.register_schema(record);
+//     }
+//     // [0, {0: 42, 1: "hi"}]
+//     cbor << record;
+//   }
+//
+// Integers use the shortest CBOR encoding of their value, floats keep their
+// width: float is encoded on 32 bits, double on 64 bits.
+
+#ifndef DUMP_CBOR_HPP_
+#define DUMP_CBOR_HPP_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+#include "dump/dump.hpp"
+
+namespace dump {
+namespace internal_dump {
+
+enum CborMajorType : ::std::uint8_t {
+  kCborUnsigned = 0,
+  kCborNegative = 1,
+  kCborBytes = 2,
+  kCborText = 3,
+  kCborArray = 4,
+  kCborMap = 5,
+  kCborSimple = 7,
+};
+
+inline constexpr ::std::uint8_t kCborFalse = 0xf4;
+inline constexpr ::std::uint8_t kCborTrue = 0xf5;
+inline constexpr ::std::uint8_t kCborNull = 0xf6;
+inline constexpr ::std::uint8_t kCborFloat32 = 0xfa;
+inline constexpr ::std::uint8_t kCborFloat64 = 0xfb;
+
+inline void put_cbor_be(::std::vector<::std::uint8_t>& out,
+                        ::std::uint64_t value, int size) {
+  for (int shift = 8 * (size - 1); shift >= 0; shift -= 8) {
+    out.push_back(static_cast<::std::uint8_t>(value >> shift));
+  }
+}
+
+// Writes the head of a data item: its major type and argument.
+inline void put_cbor_head(::std::vector<::std::uint8_t>& out,
+                          CborMajorType major, ::std::uint64_t value) {
+  const auto type = static_cast<::std::uint8_t>(major << 5);
+  if (value < 24) {
+    out.push_back(type | static_cast<::std::uint8_t>(value));
+  } else if (value <= 0xff) {
+    out.push_back(type | 24);
+    put_cbor_be(out, value, 1);
+  } else if (value <= 0xffff) {
+    out.push_back(type | 25);
+    put_cbor_be(out, value, 2);
+  } else if (value <= 0xffffffff) {
+    out.push_back(type | 26);
+    put_cbor_be(out, value, 4);
+  } else {
+    out.push_back(type | 27);
+    put_cbor_be(out, value, 8);
+  }
+}
+
+inline void put_cbor_text(::std::vector<::std::uint8_t>& out,
+                          ::std::string_view s) {
+  put_cbor_head(out, kCborText, s.size());
+  out.insert(out.end(), s.begin(), s.end());
+}
+
+template <class T>
+void put_cbor(::std::vector<::std::uint8_t>& out, const T& value) {
+  if constexpr (::std::is_same_v<T, bool>) {
+    out.push_back(value ? kCborTrue : kCborFalse);
+  } else if constexpr (::std::is_same_v<T, ::std::nullptr_t>) {
+    out.push_back(kCborNull);
+  } else if constexpr (::std::is_same_v<T, char>) {
+    put_cbor_text(out, ::std::string_view(&value, 1));
+  } else if constexpr (::std::is_integral_v<T>) {
+    if constexpr (::std::is_signed_v<T>) {
+      if (value < 0) {
+        // -1 - value, without overflowing on the lowest value.
+        put_cbor_head(out, kCborNegative,
+                      ~static_cast<::std::uint64_t>(
+                          static_cast<::std::int64_t>(value)));
+        return;
+      }
+    }
+    put_cbor_head(out, kCborUnsigned, static_cast<::std::uint64_t>(value));
+  } else if constexpr (::std::is_same_v<T, float>) {
+    ::std::uint32_t bits;
+    ::std::memcpy(&bits, &value, sizeof(bits));
+    out.push_back(kCborFloat32);
+    put_cbor_be(out, bits, 4);
+  } else if constexpr (::std::is_floating_point_v<T>) {
+    const double d = static_cast<double>(value);
+    ::std::uint64_t bits;
+    ::std::memcpy(&bits, &d, sizeof(bits));
+    out.push_back(kCborFloat64);
+    put_cbor_be(out, bits, 8);
+  } else if constexpr (::std::is_same_v<T, const char*> ||
+                       ::std::is_same_v<T, char*>) {
+    if (value == nullptr) {
+      out.push_back(kCborNull);
+    } else {
+      put_cbor_text(out, value);
+    }
+  } else if constexpr (::std::is_convertible_v<const T&, ::std::string_view>) {
+    put_cbor_text(out, value);
+  } else if constexpr (requires { value.first; value.second; }) {
+    put_cbor_head(out, kCborArray, 2);
+    put_cbor(out, value.first);
+    put_cbor(out, value.second);
+  } else if constexpr (requires {
+                         typename T::key_type;
+                         typename T::mapped_type;
+                         ::std::size(value);
+                       }) {
+    put_cbor_head(out, kCborMap, ::std::size(value));
+    for (const auto& [k, v] : value) {
+      put_cbor(out, k);
+      put_cbor(out, v);
+    }
+  } else if constexpr (requires { ::std::size(value); ::std::begin(value); }) {
+    put_cbor_head(out, kCborArray, ::std::size(value));
+    for (const auto& element : value) put_cbor(out, element);
+  } else {
+    ::std::ostringstream oss;
+    oss << value;
+    put_cbor_text(out, oss.str());
+  }
+}
+
+struct cbor_fields {
+  template <class... Ts>
+  void operator()(const Ts&... ts) {
+    if (integer_keys) {
+      put_cbor_head(out, kCborArray, 2);
+      put_cbor_head(out, kCborUnsigned, schema_id);
+    }
+    put_cbor_head(out, kCborMap, sizeof...(Ts));
+    (field(ts), ...);
+  }
+
+  template <class T>
+  void field(const T& t) {
+    if (integer_keys) {
+      put_cbor_head(out, kCborUnsigned, n);
+    } else {
+      put_cbor_text(out, names[n]);
+    }
+    ++n;
+    put_cbor(out, t);
+  }
+
+  ::std::vector<::std::uint8_t>& out;
+  DumpNames names;
+  bool integer_keys;
+  // Of the schema of the integer keys.
+  ::std::uint64_t schema_id = 0;
+  ::std::size_t n = 0;
+};
+
+}  // namespace internal_dump
+
+// A schema registered with CborWriter.
+struct CborSchema {
+  // Carried by the records of the schema, as [id, map].
+  ::std::uint64_t id;
+  // The CBOR array [id, [names...]].
+  ::std::vector<::std::uint8_t> bytes;
+};
+
+class CborWriter {
+ public:
+  explicit CborWriter(::std::vector<::std::uint8_t>& out): out_(out) {}
+
+  CborWriter(const CborWriter&) = delete;
+  CborWriter& operator=(const CborWriter&) = delete;
+
+  // Appends `dump` as a CBOR map, or as [id, map] if its schema is
+  // registered.
+  template <class D>
+  CborWriter& write(const D& dump) {
+    const Schema* const schema = schema_(dump.site(), dump.names());
+    dump.visit(internal_dump::cbor_fields{
+        .out=out_,
+        .names=dump.names(),
+        .integer_keys=schema != nullptr,
+        .schema_id=schema != nullptr ? schema->id : 0,
+        });
+    return *this;
+  }
+
+  template <class D>
+  friend CborWriter& operator<<(CborWriter& cbor, const D& dump) {
+    return cbor.write(dump);
+  }
+
+  // Makes later records of the call site of `dump`, with the names of
+  // `dump`, use field indexes as keys, and returns their schema. Each call
+  // registers a new schema, with a new ID, which replaces the one of the call
+  // site, if any.
+  template <class D>
+  CborSchema register_schema(const D& dump) {
+    const internal_dump::DumpNames names = dump.names();
+    Schema& registered = schemas_[&dump.site()];
+    registered.id = next_id_++;
+    registered.site_names = names.data() == dump.site().names.data();
+    registered.names.clear();
+    if (!registered.site_names) {
+      registered.names.assign(names.begin(), names.end());
+    }
+    CborSchema schema{.id=registered.id, .bytes={}};
+    internal_dump::put_cbor_head(schema.bytes, internal_dump::kCborArray, 2);
+    internal_dump::put_cbor_head(schema.bytes, internal_dump::kCborUnsigned,
+                                 schema.id);
+    internal_dump::put_cbor_head(schema.bytes, internal_dump::kCborArray,
+                                 names.size());
+    for (::std::string_view name : names) {
+      internal_dump::put_cbor_text(schema.bytes, name);
+    }
+    return schema;
+  }
+
+ private:
+  struct Schema {
+    ::std::uint64_t id = 0;
+    // Whether the schema is made of the names of the call site...
+    bool site_names = false;
+    // ...or of these ones.
+    ::std::vector<::std::string> names;
+  };
+
+  // Returns the registered schema of the record of `site` named `names`, or
+  // nullptr.
+  const Schema* schema_(const internal_dump::DumpSite& site,
+                        internal_dump::DumpNames names) const {
+    const auto it = schemas_.find(&site);
+    if (it == schemas_.end()) return nullptr;
+    const Schema& schema = it->second;
+    // The names of the call site itself never change, only those of as().
+    if (names.data() == site.names.data()) {
+      return schema.site_names ? &schema : nullptr;
+    }
+    return !schema.site_names &&
+                   ::std::equal(schema.names.begin(), schema.names.end(),
+                                names.begin(), names.end())
+               ? &schema
+               : nullptr;
+  }
+
+  ::std::vector<::std::uint8_t>& out_;
+  ::std::uint64_t next_id_ = 0;
+  // Registered schema of each call site.
+  ::std::unordered_map<const internal_dump::DumpSite*, Schema> schemas_;
+};
+
+// Returns `dump` encoded as a CBOR map.
+template <class D>
+::std::vector<::std::uint8_t> to_cbor(const D& dump) {
+  ::std::vector<::std::uint8_t> out;
+  CborWriter(out).write(dump);
+  return out;
+}
+
+}  // namespace dump
+
+#endif // DUMP_CBOR_HPP_
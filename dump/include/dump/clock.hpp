@@ -0,0 +1,334 @@
+// Copyright 2010-2022 Google LLC
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// TscClock reads the CPU timestamp counter: a few cycles per read, where
+// std::chrono clocks may cost a system call on some virtual machines.
+//
+// Example:
+//   const std::uint64_t begin = dump::TscClock::now();
+//   Work();
+//   const std::chrono::nanoseconds elapsed =
+//       dump::TscClock::duration(dump::TscClock::now() - begin);
+//
+// Ticks are converted to time with a rate calibrated against
+// std::chrono::steady_clock, on first use of calibration() (which converting
+// functions call). Calibration busy-waits for a few milliseconds, so call it
+// at startup rather than on a latency-sensitive path.
+//
+// The counter is read with rdtsc on x86 and from CNTVCT_EL0 on ARM64. Other
+// platforms fall back to std::chrono::steady_clock, in nanoseconds.
+//
+// Timestamps of different threads are comparable on CPUs with an invariant,
+// synchronized timestamp counter: all x86 CPUs of the last decade, and ARM64.
+//
+//                    ====[ Wall time ]====
+//
+// Timestamps taken with now() convert to wall time, i.e. system_clock, with
+// to_system(). Taking a timestamp is then as cheap as reading the counter,
+// and converting it is left to whatever reads it later:
+//
+//   record.ticks = dump::TscClock::now();
+//   ...
+//   const auto time = dump::TscClock::to_system(record.ticks);
+//
+// A calibration pairs a tick count with the steady_clock and system_clock
+// times it was read at. Conversions recalibrate once the latest calibration
+// is older than a second (a tenth of a second for the first one, whose rate
+// was only measured over a few milliseconds): without waiting, since the
+// rate is measured again from the first calibration, ever more precisely,
+// and the wall time is read again, following adjustments of the system
+// clock. Call recalibrate() to take an adjustment into account at once.
+//
+// Converting a timestamp long after it was taken uses the latest
+// calibration, so it is as precise as the rate. Logs rather carry the
+// calibrations of their timestamps, see to_system(ticks, calibration).
+
+#ifndef DUMP_CLOCK_HPP_
+#define DUMP_CLOCK_HPP_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <ostream>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace dump {
+
+// Pairs a tick count of TscClock with the times it was read at, and the
+// length of a tick.
+struct TscCalibration {
+  ::std::uint64_t ticks;
+  ::std::chrono::steady_clock::time_point time;
+  ::std::chrono::system_clock::time_point system;
+  double ns_per_tick;
+};
+
+namespace internal_dump {
+
+inline ::std::uint64_t read_tsc() {
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || \
+    defined(__i386__)
+  return __rdtsc();
+#elif defined(__aarch64__)
+  ::std::uint64_t ticks;
+  asm volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+  return ticks;
+#else
+  return ::std::chrono::duration_cast<::std::chrono::nanoseconds>(
+             ::std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+#endif
+}
+
+// Age of a calibration from which conversions recalibrate.
+inline constexpr ::std::chrono::seconds kTscRecalibrationPeriod(1);
+// Age of the initial calibration from which conversions refine its rate.
+inline constexpr ::std::chrono::milliseconds kTscRefinementPeriod(100);
+// Samples sample_tsc() keeps the narrowest of.
+inline constexpr int kTscSampleTries = 16;
+
+// Reads the clocks between two counter reads, and pairs them with their
+// midpoint. The rate is left to the caller.
+//
+// A thread preempted between the reads would pair the clocks with a tick
+// count off by the time it was descheduled, which skews the rates measured
+// from it: the sample read in the fewest ticks is kept.
+inline TscCalibration sample_tsc() {
+  TscCalibration narrowest{};
+  ::std::uint64_t width = ~::std::uint64_t{0};
+  for (int i = 0; i < kTscSampleTries; ++i) {
+    const ::std::uint64_t before = read_tsc();
+    const ::std::chrono::steady_clock::time_point time =
+        ::std::chrono::steady_clock::now();
+    const ::std::chrono::system_clock::time_point system =
+        ::std::chrono::system_clock::now();
+    const ::std::uint64_t after = read_tsc();
+    if (after - before >= width) continue;
+    width = after - before;
+    narrowest = TscCalibration{
+        .ticks=before + (after - before) / 2,
+        .time=time,
+        .system=system,
+        .ns_per_tick=0,
+    };
+  }
+  return narrowest;
+}
+
+// The latest calibration, published as a sequence lock: conversions on any
+// thread read it while another thread recalibrates.
+class TscCalibrations {
+ public:
+  // Measures the counter against steady_clock over a few milliseconds, long
+  // enough for the resolution of steady_clock not to matter. The rate is
+  // refined by the first recalibration, kTscRefinementPeriod later.
+  TscCalibrations(): first_(sample_tsc()) {
+    TscCalibration latest = first_;
+    while (latest.time - first_.time < ::std::chrono::milliseconds(5)) {
+      latest = sample_tsc();
+    }
+    latest.ns_per_tick = rate_(latest);
+    period_.store(period_ticks_(kTscRefinementPeriod, latest.ns_per_tick),
+                  ::std::memory_order_relaxed);
+    store_(latest);
+  }
+
+  TscCalibrations(const TscCalibrations&) = delete;
+  TscCalibrations& operator=(const TscCalibrations&) = delete;
+
+  TscCalibration load() const {
+    for (;;) {
+      const ::std::uint64_t sequence =
+          sequence_.load(::std::memory_order_acquire);
+      const TscCalibration calibration{
+          .ticks=ticks_.load(::std::memory_order_relaxed),
+          .time=::std::chrono::steady_clock::time_point(
+              ::std::chrono::steady_clock::duration(
+                  time_.load(::std::memory_order_relaxed))),
+          .system=::std::chrono::system_clock::time_point(
+              ::std::chrono::system_clock::duration(
+                  system_.load(::std::memory_order_relaxed))),
+          .ns_per_tick=ns_per_tick_.load(::std::memory_order_relaxed),
+      };
+      ::std::atomic_thread_fence(::std::memory_order_acquire);
+      if (sequence % 2 == 0 &&
+          sequence_.load(::std::memory_order_relaxed) == sequence) {
+        return calibration;
+      }
+    }
+  }
+
+  // Returns a new calibration, or the one another thread is publishing.
+  TscCalibration recalibrate() {
+    if (recalibrating_.exchange(true, ::std::memory_order_acquire)) {
+      return load();
+    }
+    TscCalibration latest = sample_tsc();
+    latest.ns_per_tick = rate_(latest);
+    store_(latest);
+    period_.store(
+        period_ticks_(kTscRecalibrationPeriod, latest.ns_per_tick),
+        ::std::memory_order_relaxed);
+    recalibrating_.store(false, ::std::memory_order_release);
+    return latest;
+  }
+
+  // Ticks from a calibration to the next.
+  ::std::uint64_t period() const {
+    return period_.load(::std::memory_order_relaxed);
+  }
+
+ private:
+  // Ticks in `duration`.
+  static ::std::uint64_t period_ticks_(::std::chrono::nanoseconds duration,
+                                       double ns_per_tick) {
+    return static_cast<::std::uint64_t>(
+        static_cast<double>(duration.count()) / ns_per_tick);
+  }
+
+  // Measures the rate from the first calibration.
+  double rate_(const TscCalibration& latest) const {
+    const ::std::chrono::nanoseconds elapsed = latest.time - first_.time;
+    return static_cast<double>(elapsed.count()) /
+           static_cast<double>(latest.ticks - first_.ticks);
+  }
+
+  // Only called by one thread at a time.
+  void store_(const TscCalibration& calibration) {
+    const ::std::uint64_t sequence =
+        sequence_.load(::std::memory_order_relaxed);
+    sequence_.store(sequence + 1, ::std::memory_order_relaxed);
+    ::std::atomic_thread_fence(::std::memory_order_release);
+    ticks_.store(calibration.ticks, ::std::memory_order_relaxed);
+    time_.store(calibration.time.time_since_epoch().count(),
+                ::std::memory_order_relaxed);
+    system_.store(calibration.system.time_since_epoch().count(),
+                  ::std::memory_order_relaxed);
+    ns_per_tick_.store(calibration.ns_per_tick, ::std::memory_order_relaxed);
+    sequence_.store(sequence + 2, ::std::memory_order_release);
+  }
+
+  const TscCalibration first_;
+  // kTscRefinementPeriod until the first recalibration, then
+  // kTscRecalibrationPeriod, in ticks.
+  ::std::atomic<::std::uint64_t> period_ = 0;
+  // Odd while a calibration is stored.
+  ::std::atomic<::std::uint64_t> sequence_ = 0;
+  ::std::atomic<::std::uint64_t> ticks_ = 0;
+  ::std::atomic<::std::chrono::steady_clock::rep> time_ = 0;
+  ::std::atomic<::std::chrono::system_clock::rep> system_ = 0;
+  ::std::atomic<double> ns_per_tick_ = 0;
+  ::std::atomic<bool> recalibrating_ = false;
+};
+
+inline TscCalibrations& tsc_calibrations() {
+  static TscCalibrations calibrations;
+  return calibrations;
+}
+
+// Writes `time` as an ISO 8601 UTC time, with nanoseconds, e.g.
+// 2024-05-01T12:34:56.123456789Z.
+inline void write_utc_time(::std::ostream& os,
+                           ::std::chrono::system_clock::time_point time) {
+  const auto days = ::std::chrono::floor<::std::chrono::days>(time);
+  const ::std::chrono::year_month_day date(days);
+  const ::std::chrono::hh_mm_ss<::std::chrono::nanoseconds> clock(
+      ::std::chrono::duration_cast<::std::chrono::nanoseconds>(time - days));
+  char buf[40];
+  const int size = ::std::snprintf(
+      buf, sizeof(buf), "%04d-%02u-%02uT%02d:%02d:%02d.%09lldZ",
+      static_cast<int>(date.year()), static_cast<unsigned>(date.month()),
+      static_cast<unsigned>(date.day()),
+      static_cast<int>(clock.hours().count()),
+      static_cast<int>(clock.minutes().count()),
+      static_cast<int>(clock.seconds().count()),
+      static_cast<long long>(clock.subseconds().count()));
+  os.write(buf, size);
+}
+
+}  // namespace internal_dump
+
+class TscClock {
+ public:
+  using Calibration = TscCalibration;
+
+  static ::std::uint64_t now() { return internal_dump::read_tsc(); }
+
+  // Returns the latest calibration, after recalibrating if it is older than
+  // a second.
+  static Calibration calibration() {
+    internal_dump::TscCalibrations& calibrations =
+        internal_dump::tsc_calibrations();
+    const Calibration latest = calibrations.load();
+    // Signed: the counter of this CPU may be slightly behind the one the
+    // calibration was read on.
+    if (static_cast<::std::int64_t>(now() - latest.ticks) <
+        static_cast<::std::int64_t>(calibrations.period())) {
+      return latest;
+    }
+    return calibrations.recalibrate();
+  }
+
+  // Returns the latest calibration, however old: unlike calibration(), never
+  // recalibrates, for latency-sensitive paths.
+  static Calibration latest() {
+    return internal_dump::tsc_calibrations().load();
+  }
+
+  // Recalibrates now, e.g. after the system clock was set.
+  static Calibration recalibrate() {
+    return internal_dump::tsc_calibrations().recalibrate();
+  }
+
+  static ::std::chrono::nanoseconds duration(::std::int64_t ticks) {
+    return duration(ticks, calibration());
+  }
+
+  static ::std::chrono::nanoseconds duration(::std::int64_t ticks,
+                                             const Calibration& c) {
+    return ::std::chrono::nanoseconds(static_cast<::std::int64_t>(
+        static_cast<double>(ticks) * c.ns_per_tick));
+  }
+
+  static ::std::chrono::steady_clock::time_point to_steady(
+      ::std::uint64_t ticks) {
+    const Calibration c = calibration();
+    return c.time + ::std::chrono::duration_cast<
+                        ::std::chrono::steady_clock::duration>(duration(
+                        static_cast<::std::int64_t>(ticks - c.ticks), c));
+  }
+
+  static ::std::chrono::system_clock::time_point to_system(
+      ::std::uint64_t ticks) {
+    return to_system(ticks, calibration());
+  }
+
+  // Converts `ticks` with a calibration `c` of the same machine, e.g. read
+  // from a log.
+  static ::std::chrono::system_clock::time_point to_system(
+      ::std::uint64_t ticks, const Calibration& c) {
+    return c.system + ::std::chrono::duration_cast<
+                          ::std::chrono::system_clock::duration>(duration(
+                          static_cast<::std::int64_t>(ticks - c.ticks), c));
+  }
+};
+
+}  // namespace dump
+
+#endif // DUMP_CLOCK_HPP_
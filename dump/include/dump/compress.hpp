@@ -0,0 +1,337 @@
+// Copyright 2010-2022 Google LLC
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Block compression of logs, with a fast LZ77 compressor.
+//
+// CompressedSink gathers what is written to it into blocks of about 64 KiB,
+// and writes each block compressed, with a small header. Blocks are
+// compressed independently, so a reader can skip to any block and decompress
+// it on its own.
+//
+// Example:
+//   std::ofstream file("log.dlz", std::ios::binary);
+//   dump::CompressedSink sink(file);
+//   sink << DUMP(foo, bar);
+//   ...
+//   std::ifstream in("log.dlz", std::ios::binary);
+//   dump::CompressedReader reader(in);
+//   for (std::string block; reader.read(block);) {
+//     std::cout << block;
+//   }
+//
+// A write is never split across blocks, unless it is larger than a block: a
+// block of records starts with a whole record. Incompressible blocks are
+// stored as is.
+//
+// Blocks are compressed in the LZ4 block format (lz_compress()), which
+// favours speed over ratio: text logs typically compress 3 to 5 times.
+//
+//                    ====[ Format ]====
+//
+// A file starts with the "DLZ1" magic, followed by blocks. A block is its
+// uncompressed size and its stored size, both u32 little-endian, followed by
+// its stored bytes: the block as is if both sizes are equal, else its LZ4
+// block compression.
+
+#ifndef DUMP_COMPRESS_HPP_
+#define DUMP_COMPRESS_HPP_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "dump/sink.hpp"
+
+namespace dump {
+namespace internal_dump {
+
+// Constraints of the LZ4 block format, in bytes.
+inline constexpr ::std::size_t kLzMinMatch = 4;
+// The last bytes of a block are always literals...
+inline constexpr ::std::size_t kLzLastLiterals = 5;
+// ...and the last match starts at least this far from the end.
+inline constexpr ::std::size_t kLzMatchFromEnd = 12;
+inline constexpr ::std::size_t kLzMaxOffset = 65535;
+inline constexpr int kLzHashBits = 14;
+
+inline ::std::uint32_t read_lz32(const char* p) {
+  ::std::uint32_t value;
+  ::std::memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+inline ::std::uint32_t lz_hash(const char* p) {
+  return (read_lz32(p) * 2654435761u) >> (32 - kLzHashBits);
+}
+
+// Writes a length of the LZ4 format: a nibble of the token, then if it is 15,
+// bytes of 255 and a last byte below 255 summing to the rest.
+inline void put_lz_length(::std::string& out, ::std::size_t length) {
+  for (length -= 15; length >= 255; length -= 255) out.push_back('\xff');
+  out.push_back(static_cast<char>(length));
+}
+
+// Writes a sequence: literals followed by a match, if `match` is not 0.
+inline void put_lz_sequence(::std::string& out, ::std::string_view literals,
+                            ::std::size_t offset, ::std::size_t match) {
+  const ::std::size_t token = out.size();
+  out.push_back(static_cast<char>(::std::min<::std::size_t>(
+                                      literals.size(), 15) << 4));
+  if (literals.size() >= 15) put_lz_length(out, literals.size());
+  out.append(literals);
+  if (match == 0) return;
+  out.push_back(static_cast<char>(offset & 0xff));
+  out.push_back(static_cast<char>(offset >> 8));
+  const ::std::size_t length = match - kLzMinMatch;
+  out[token] = static_cast<char>(out[token] |
+                                 ::std::min<::std::size_t>(length, 15));
+  if (length >= 15) put_lz_length(out, length);
+}
+
+inline bool get_lz_length(::std::string_view in, ::std::size_t& pos,
+                          ::std::size_t& length) {
+  if (length != 15) return true;
+  for (;;) {
+    if (pos == in.size()) return false;
+    const auto byte = static_cast<::std::uint8_t>(in[pos++]);
+    length += byte;
+    if (byte != 255) return true;
+  }
+}
+
+}  // namespace internal_dump
+
+// Compresses blocks in the LZ4 block format, greedily matching 4-byte
+// sequences found through a hash table.
+class LzCompressor {
+ public:
+  LzCompressor(): table_(::std::size_t{1} << internal_dump::kLzHashBits) {}
+
+  // Appends the compression of `in` to `out`.
+  void compress(::std::string_view in, ::std::string& out) {
+    using internal_dump::kLzMatchFromEnd;
+    const char* const p = in.data();
+    const ::std::size_t size = in.size();
+    ::std::size_t anchor = 0;
+    if (size > kLzMatchFromEnd) {
+      ::std::fill(table_.begin(), table_.end(), 0);
+      const ::std::size_t match_limit = size - internal_dump::kLzLastLiterals;
+      ::std::size_t pos = 1;
+      while (pos < size - kLzMatchFromEnd) {
+        ::std::uint32_t& entry = table_[internal_dump::lz_hash(p + pos)];
+        ::std::size_t candidate = entry;
+        entry = static_cast<::std::uint32_t>(pos);
+        if (pos - candidate > internal_dump::kLzMaxOffset ||
+            internal_dump::read_lz32(p + candidate) !=
+                internal_dump::read_lz32(p + pos)) {
+          // Skips faster through data that does not compress.
+          pos += 1 + ((pos - anchor) >> 6);
+          continue;
+        }
+        while (pos > anchor && candidate > 0 &&
+               p[pos - 1] == p[candidate - 1]) {
+          --pos;
+          --candidate;
+        }
+        ::std::size_t match = internal_dump::kLzMinMatch;
+        while (pos + match < match_limit &&
+               p[candidate + match] == p[pos + match]) {
+          ++match;
+        }
+        internal_dump::put_lz_sequence(out, in.substr(anchor, pos - anchor),
+                                       pos - candidate, match);
+        pos += match;
+        anchor = pos;
+        // Indexes the end of the match, likely repeated as well.
+        table_[internal_dump::lz_hash(p + pos - 2)] =
+            static_cast<::std::uint32_t>(pos - 2);
+      }
+    }
+    internal_dump::put_lz_sequence(out, in.substr(anchor), 0, 0);
+  }
+
+ private:
+  // Last position of each hash of 4 bytes.
+  ::std::vector<::std::uint32_t> table_;
+};
+
+// Appends the LZ4 block compression of `in` to `out`.
+inline void lz_compress(::std::string_view in, ::std::string& out) {
+  LzCompressor().compress(in, out);
+}
+
+// Appends the decompression of `in`, an LZ4 block of `size` bytes once
+// decompressed, to `out`. Returns false if `in` is malformed.
+inline bool lz_decompress(::std::string_view in, ::std::size_t size,
+                          ::std::string& out) {
+  const ::std::size_t begin = out.size();
+  out.resize(begin + size);
+  char* const block = out.data() + begin;
+  ::std::size_t written = 0;
+  ::std::size_t pos = 0;
+  for (;;) {
+    if (pos == in.size()) return false;
+    const auto token = static_cast<::std::uint8_t>(in[pos++]);
+    ::std::size_t literals = token >> 4;
+    if (!internal_dump::get_lz_length(in, pos, literals) ||
+        literals > in.size() - pos || literals > size - written) {
+      return false;
+    }
+    ::std::memcpy(block + written, in.data() + pos, literals);
+    pos += literals;
+    written += literals;
+    if (pos == in.size()) return written == size;
+    if (in.size() - pos < 2) return false;
+    const ::std::size_t offset = static_cast<::std::uint8_t>(in[pos]) |
+                                 static_cast<::std::uint8_t>(in[pos + 1]) << 8;
+    pos += 2;
+    ::std::size_t match = token & 15;
+    if (offset == 0 || offset > written ||
+        !internal_dump::get_lz_length(in, pos, match)) {
+      return false;
+    }
+    match += internal_dump::kLzMinMatch;
+    if (match > size - written) return false;
+    // Byte by byte: the match may overlap what it copies.
+    for (::std::size_t i = 0; i < match; ++i, ++written) {
+      block[written] = block[written - offset];
+    }
+  }
+}
+
+class CompressedSink : public Sink {
+ public:
+  // Writes blocks of about `block_size` bytes to `os`, starting with the
+  // magic of the format.
+  explicit CompressedSink(::std::ostream& os,
+                          ::std::size_t block_size = 64 * 1024):
+      os_(os),
+      block_size_(block_size) {
+    os_.write("DLZ1", 4);
+    block_.reserve(block_size_);
+  }
+
+  CompressedSink(const CompressedSink&) = delete;
+  CompressedSink& operator=(const CompressedSink&) = delete;
+
+  ~CompressedSink() override { flush(); }
+
+  void write(::std::string_view bytes) override {
+    if (!block_.empty() && block_.size() + bytes.size() > block_size_) {
+      write_block_();
+    }
+    block_.append(bytes);
+    if (block_.size() >= block_size_) write_block_();
+  }
+
+  // Writes the current block, even if not full.
+  void flush() override {
+    if (!block_.empty()) write_block_();
+    os_.flush();
+  }
+
+ private:
+  void write_block_() {
+    compressed_.clear();
+    compressor_.compress(block_, compressed_);
+    const bool stored = compressed_.size() >= block_.size();
+    const ::std::string& data = stored ? block_ : compressed_;
+    char header[8];
+    for (int i = 0; i < 4; ++i) {
+      header[i] = static_cast<char>(block_.size() >> (8 * i));
+      header[4 + i] = static_cast<char>(data.size() >> (8 * i));
+    }
+    os_.write(header, sizeof(header));
+    os_.write(data.data(), data.size());
+    block_.clear();
+  }
+
+  ::std::ostream& os_;
+  const ::std::size_t block_size_;
+  LzCompressor compressor_;
+  ::std::string block_;
+  // Reused across blocks.
+  ::std::string compressed_;
+};
+
+class CompressedReader {
+ public:
+  explicit CompressedReader(::std::istream& is): is_(is) {
+    char magic[4];
+    error_ = !is_.read(magic, 4) || ::std::string_view(magic, 4) != "DLZ1";
+  }
+
+  // Sets `block` to the next block. Returns false at the end of the file, or
+  // if it is malformed, in which case error() is true.
+  bool read(::std::string& block) {
+    ::std::uint32_t size;
+    ::std::uint32_t stored;
+    if (!read_header_(size, stored)) return false;
+    data_.resize(stored);
+    if (!is_.read(data_.data(), stored)) return fail_();
+    block.clear();
+    if (stored == size) {
+      block.swap(data_);
+      return true;
+    }
+    return lz_decompress(data_, size, block) || fail_();
+  }
+
+  // Skips the next block without decompressing it. Returns false at the end
+  // of the file, or if it is malformed.
+  bool skip() {
+    ::std::uint32_t size;
+    ::std::uint32_t stored;
+    if (!read_header_(size, stored)) return false;
+    return is_.seekg(stored, ::std::ios::cur) || fail_();
+  }
+
+  bool error() const { return error_; }
+
+ private:
+  bool read_header_(::std::uint32_t& size, ::std::uint32_t& stored) {
+    if (error_) return false;
+    char header[8];
+    is_.read(header, sizeof(header));
+    if (is_.gcount() == 0 && is_.eof()) return false;
+    if (is_.gcount() != sizeof(header)) return fail_();
+    size = 0;
+    stored = 0;
+    for (int i = 0; i < 4; ++i) {
+      size |= static_cast<::std::uint32_t>(
+                  static_cast<::std::uint8_t>(header[i])) << (8 * i);
+      stored |= static_cast<::std::uint32_t>(
+                    static_cast<::std::uint8_t>(header[4 + i])) << (8 * i);
+    }
+    return stored <= size || fail_();
+  }
+
+  bool fail_() {
+    error_ = true;
+    return false;
+  }
+
+  ::std::istream& is_;
+  bool error_;
+  ::std::string data_;
+};
+
+}  // namespace dump
+
+#endif // DUMP_COMPRESS_HPP_
@@ -0,0 +1,163 @@
+// Copyright 2010-2022 Google LLC
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Awaitables writing to and flushing async sinks from C++20 coroutines,
+// without blocking their thread.
+//
+// AsyncSink::flush() blocks until the sink is flushed, and write() blocks
+// while the queue is full, with AsyncOverflow::kBlock. On an event loop
+// thread, that stalls every coroutine of the loop. dump::flush() and
+// dump::write() suspend the calling coroutine instead, and resume it through
+// an executor once done.
+//
+// Example:
+//   Task Handle(Request request) {
+//     ...
+//     co_await dump::write(log, DUMP(request.id, status), loop_executor);
+//     co_await dump::flush(log, loop_executor);
+//   }
+//
+// An executor is any callable taking a std::coroutine_handle<>, which it
+// resumes later on a thread of its choice, e.g.
+//
+//   auto loop_executor = [&loop](std::coroutine_handle<> coroutine) {
+//     loop.post([coroutine] { coroutine.resume(); });
+//   };
+//
+// Without one, the coroutine is resumed on the background thread of the sink,
+// where it must not block, nor call the blocking flush() of the sink: it
+// stalls the sink until its next suspension.
+//
+// write() returns without suspending if the record fits in the queue, or is
+// dropped by the overflow policy. Otherwise, the background thread queues the
+// record once there is room, then resumes the coroutine: the record holds the
+// values of the arguments of DUMP() when it is queued. Records of waiting
+// coroutines are queued in order.
+//
+// Destroying a sink queues the records of the coroutines waiting on it, and
+// resumes them, before it returns, including those which await it again on
+// its background thread. Other threads must not start awaiting a sink being
+// destroyed, and executors must still run the coroutines they are given.
+
+#ifndef DUMP_CORO_HPP_
+#define DUMP_CORO_HPP_
+
+#include <coroutine>
+#include <type_traits>
+#include <utility>
+
+#include "dump/async.hpp"
+
+namespace dump {
+
+template <class E>
+concept CoroutineExecutor =
+    requires(E& executor, ::std::coroutine_handle<> coroutine) {
+      executor(coroutine);
+    };
+
+// Resumes coroutines on the thread completing their operation.
+struct InlineExecutor {
+  void operator()(::std::coroutine_handle<> coroutine) const {
+    coroutine.resume();
+  }
+};
+
+// Awaitable returned by write().
+template <class S, class D, class E>
+class AsyncWrite : private AsyncWaiter {
+ public:
+  AsyncWrite(S& sink, D&& dump, Severity severity, E executor):
+      sink_(sink),
+      dump_(::std::forward<D>(dump)),
+      severity_(severity),
+      executor_(::std::move(executor)) {}
+
+  bool await_ready() { return sink_.write_or_defer(dump_, severity_); }
+
+  void await_suspend(::std::coroutine_handle<> coroutine) {
+    coroutine_ = coroutine;
+    // May resume the coroutine, and destroy this, before returning.
+    sink_.wait_for_room(*this);
+  }
+
+  void await_resume() {}
+
+ private:
+  bool try_push() override { return sink_.try_write(dump_, severity_); }
+  void resume() override { executor_(coroutine_); }
+
+  S& sink_;
+  D dump_;
+  const Severity severity_;
+  E executor_;
+  ::std::coroutine_handle<> coroutine_;
+};
+
+// Awaitable returned by flush().
+template <class S, class E>
+class AsyncFlush : private AsyncWaiter {
+ public:
+  AsyncFlush(S& sink, E executor):
+      sink_(sink),
+      executor_(::std::move(executor)) {}
+
+  bool await_ready() { return false; }
+
+  void await_suspend(::std::coroutine_handle<> coroutine) {
+    coroutine_ = coroutine;
+    // May resume the coroutine, and destroy this, before returning.
+    if (!sink_.try_flush(*this)) sink_.wait_for_room(*this);
+  }
+
+  void await_resume() {}
+
+ private:
+  bool try_push() override { return sink_.try_flush(*this); }
+  void resume() override { executor_(coroutine_); }
+
+  S& sink_;
+  E executor_;
+  ::std::coroutine_handle<> coroutine_;
+};
+
+// Returns an awaitable queueing a snapshot of `dump` in `sink`, like
+// sink.write(dump, severity), which suspends the coroutine while the queue is
+// full, and resumes it with `executor`.
+template <class Queue, class D, CoroutineExecutor E = InlineExecutor>
+AsyncWrite<BasicAsyncSink<Queue>, D, E> write(BasicAsyncSink<Queue>& sink,
+                                              D&& dump, Severity severity,
+                                              E executor = {}) {
+  return AsyncWrite<BasicAsyncSink<Queue>, D, E>(
+      sink, ::std::forward<D>(dump), severity, ::std::move(executor));
+}
+
+template <class Queue, class D, CoroutineExecutor E = InlineExecutor>
+AsyncWrite<BasicAsyncSink<Queue>, D, E> write(BasicAsyncSink<Queue>& sink,
+                                              D&& dump, E executor = {}) {
+  return AsyncWrite<BasicAsyncSink<Queue>, D, E>(
+      sink, ::std::forward<D>(dump), Severity::kInfo, ::std::move(executor));
+}
+
+// Returns an awaitable suspending the coroutine until the records queued in
+// `sink` before are written and the sink is flushed, and resuming it with
+// `executor`.
+template <class Queue, CoroutineExecutor E = InlineExecutor>
+AsyncFlush<BasicAsyncSink<Queue>, E> flush(BasicAsyncSink<Queue>& sink,
+                                           E executor = {}) {
+  return AsyncFlush<BasicAsyncSink<Queue>, E>(sink, ::std::move(executor));
+}
+
+}  // namespace dump
+
+#endif // DUMP_CORO_HPP_
@@ -0,0 +1,220 @@
+// Copyright 2010-2022 Google LLC
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// CsvWriter writes DUMP() records as rows of CSV (or TSV) tables.
+//
+// The records of a DUMP() call site all have the same fields, so each call
+// site gets its own table, in its own stream: the names of the call site are
+// written once, as a header row, followed by one row of values per record.
+//
+// Example:
+//   int tables = 0;
+//   dump::CsvWriter csv([&](const dump::internal_dump::DumpSite& site,
+//                           dump::internal_dump::DumpNames names) {
+//     return std::make_unique<std::ofstream>(
+//         "dump_" + std::to_string(tables++) + ".csv");
+//   });
+//   for (const auto& p : points) {
+//     // Writes: p.x,p.y
+//     //         1,2.5
+//     //         3,4.25
+//     csv << DUMP(p.x, p.y);
+//   }
+//
+// Records are grouped by call site and names: each set of names a call site
+// is renamed to with Dump::as() gets a table of its own, with them as header.
+// The opener may return nullptr instead of a stream, which drops the records
+// of the table.
+//
+// Fields are quoted as per RFC 4180 when they contain the delimiter, a quote
+// or a line break. Numbers are written with full round-trip precision.
+// Use '\t' as delimiter for TSV:
+//
+//   dump::CsvWriter tsv(open, '\t');
+
+#ifndef DUMP_CSV_HPP_
+#define DUMP_CSV_HPP_
+
+#include <algorithm>
+#include <charconv>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "dump/dump.hpp"
+
+namespace dump {
+namespace internal_dump {
+
+inline void append_csv_field(::std::string& out, ::std::string_view field,
+                             char delimiter) {
+  const char specials[] = {delimiter, '"', '\r', '\n'};
+  if (field.find_first_of(::std::string_view(specials, 4)) ==
+      ::std::string_view::npos) {
+    out.append(field);
+    return;
+  }
+  out.push_back('"');
+  for (char c : field) {
+    if (c == '"') out.push_back('"');
+    out.push_back(c);
+  }
+  out.push_back('"');
+}
+
+template <class T>
+void append_csv_value(::std::string& out, const T& value, char delimiter) {
+  if constexpr (::std::is_same_v<T, bool>) {
+    out.append(value ? "true" : "false");
+  } else if constexpr (::std::is_same_v<T, char>) {
+    append_csv_field(out, ::std::string_view(&value, 1), delimiter);
+  } else if constexpr (::std::is_arithmetic_v<T>) {
+    char buf[64];
+    const auto result = ::std::to_chars(buf, buf + sizeof(buf), value);
+    out.append(buf, result.ptr - buf);
+  } else if constexpr (::std::is_same_v<T, const char*> ||
+                       ::std::is_same_v<T, char*>) {
+    if (value != nullptr) append_csv_field(out, value, delimiter);
+  } else if constexpr (::std::is_convertible_v<const T&, ::std::string_view>) {
+    append_csv_field(out, value, delimiter);
+  } else {
+    ::std::ostringstream oss;
+    oss << value;
+    append_csv_field(out, oss.str(), delimiter);
+  }
+}
+
+struct csv_fields {
+  template <class... Ts>
+  void operator()(const Ts&... ts) {
+    ::std::size_t n = 0;
+    ((n++ != 0 ? out.push_back(delimiter) : void(),
+      append_csv_value(out, ts, delimiter)),
+     ...);
+    out.push_back('\n');
+  }
+
+  ::std::string& out;
+  char delimiter;
+};
+
+}  // namespace internal_dump
+
+class CsvWriter {
+ public:
+  // Returns the stream to write the table of a call site named `names` to,
+  // or nullptr to drop its records.
+  using Open = ::std::function<::std::unique_ptr<::std::ostream>(
+      const internal_dump::DumpSite& site, internal_dump::DumpNames names)>;
+
+  explicit CsvWriter(Open open, char delimiter = ','):
+      open_(::std::move(open)),
+      delimiter_(delimiter) {}
+
+  CsvWriter(const CsvWriter&) = delete;
+  CsvWriter& operator=(const CsvWriter&) = delete;
+
+  // Writes the values of `dump` as one row of the table of its call site and
+  // names, preceded by a header row if it is the first one.
+  template <class D>
+  CsvWriter& write(const D& dump) {
+    row_.clear();
+    ::std::ostream* const os = table_(dump.site(), dump.names());
+    if (os == nullptr) return *this;
+    dump.visit(internal_dump::csv_fields{
+        .out=row_,
+        .delimiter=delimiter_,
+        });
+    os->write(row_.data(), row_.size());
+    return *this;
+  }
+
+  template <class D>
+  friend CsvWriter& operator<<(CsvWriter& csv, const D& dump) {
+    return csv.write(dump);
+  }
+
+  void flush() {
+    for (auto& [site, s] : sites_) {
+      if (s.os != nullptr) s.os->flush();
+      for (auto& [names, os] : s.renamed) {
+        if (os != nullptr) os->flush();
+      }
+    }
+  }
+
+ private:
+  struct Site {
+    // Whether the table of the call site with its own names was opened.
+    bool opened = false;
+    ::std::unique_ptr<::std::ostream> os;
+    // Tables of the call site with names given by Dump::as().
+    ::std::vector<::std::pair<::std::vector<::std::string>,
+                              ::std::unique_ptr<::std::ostream>>>
+        renamed;
+  };
+
+  // Returns the stream of the table of `site` named `names`, or nullptr if
+  // its records are dropped. Opens the table if new, and puts its header
+  // row in row_.
+  ::std::ostream* table_(const internal_dump::DumpSite& site,
+                         internal_dump::DumpNames names) {
+    Site& s = sites_[&site];
+    if (names.data() == site.names.data()) {
+      if (!s.opened) {
+        s.opened = true;
+        s.os = open_(site, names);
+        write_header_(names);
+      }
+      return s.os.get();
+    }
+    for (auto& [renamed, os] : s.renamed) {
+      if (::std::equal(renamed.begin(), renamed.end(), names.begin(),
+                       names.end())) {
+        return os.get();
+      }
+    }
+    s.renamed.emplace_back(
+        ::std::vector<::std::string>(names.begin(), names.end()),
+        open_(site, names));
+    write_header_(names);
+    return s.renamed.back().second.get();
+  }
+
+  void write_header_(internal_dump::DumpNames names) {
+    for (::std::size_t i = 0; i < names.size(); ++i) {
+      if (i != 0) row_.push_back(delimiter_);
+      internal_dump::append_csv_field(row_, names[i], delimiter_);
+    }
+    row_.push_back('\n');
+  }
+
+  const Open open_;
+  const char delimiter_;
+  // Tables of each call site.
+  ::std::unordered_map<const internal_dump::DumpSite*, Site> sites_;
+  // Reused across rows so that each row is written at once.
+  ::std::string row_;
+};
+
+}  // namespace dump
+
+#endif // DUMP_CSV_HPP_
@@ -10,6 +10,12 @@
 // DUMP() produces high quality human-readable output for most types:
 // builtin types, strings, anything with operator<<.
 //
+// json() renders the same record as a compact JSON object, with numbers
+// unquoted, strings escaped and containers as arrays:
+//
+//   // Prints: {"foo":42,"bar.size()":3}
+//   LOG(INFO) << DUMP(foo, bar.size()).json();
+//
 //                    ====[ Limitations ]====
 //
 // DUMP() accepts at most 8 arguments.
@@ -26,12 +32,20 @@
 #ifndef DUMP_HPP_
 #define DUMP_HPP_
 
+#include <array>
+#include <charconv>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
 #include <ostream>
+#include <span>
 #include <sstream>
 #include <string>
+#include <string_view>
 #include <type_traits>
 #include <utility>
-#include <vector>
 
 /* need extra level to force extra eval */
 #define DUMP_FOR_EACH_N0(F)
@@ -67,27 +81,58 @@
 #define DUMP_GEN_ONE_BINDING(a) , &a = a
 #define DUMP_GEN_BINDING(binding) &DUMP_FOR_EACH(DUMP_GEN_ONE_BINDING, DUMP_RM_PARENS(binding))
 
+// Returns the static DumpSite of the call site.
+#define DUMP_SITE(...)                                                   \
+  []() -> const ::dump::internal_dump::DumpSite& {                       \
+    static constexpr ::dump::internal_dump::                             \
+        DumpNameArray<DUMP_NARG(__VA_ARGS__)> names{                     \
+            DUMP_STRINGIFY(__VA_ARGS__) };                               \
+    static constexpr auto json_chars =                                   \
+        ::dump::internal_dump::json_key_chars<                           \
+            ::dump::internal_dump::json_keys_size(names)>(names);        \
+    static constexpr auto json_keys =                                    \
+        ::dump::internal_dump::json_key_views(names, json_chars);        \
+    static constexpr ::dump::internal_dump::DumpSite site{               \
+        .names=names,                                                    \
+        .json_keys=json_keys,                                            \
+        .file=__FILE__,                                                  \
+        .line=__LINE__,                                                  \
+        };                                                               \
+    return site;                                                         \
+  }()
+
 #define DUMP_INTERNAL(binding, ...)                    \
   ::dump::internal_dump::make_dump<>(                  \
-    ::dump::internal_dump::DumpNames{                  \
-          DUMP_STRINGIFY(__VA_ARGS__) },               \
-    [DUMP_GEN_BINDING(binding)](                       \
-      ::std::ostream& os,                              \
-      const ::std::string& field_sep,                  \
-      const ::std::string& kv_sep,                     \
-      const ::dump::internal_dump::DumpNames& names) { \
-      ::dump::internal_dump::print_fields {            \
-        .os=os,                                        \
-        .field_sep=field_sep,                          \
-        .kv_sep=kv_sep,                                \
-        .names=names,                                  \
-        }(__VA_ARGS__);                                \
+    DUMP_SITE(__VA_ARGS__),                            \
+    [DUMP_GEN_BINDING(binding)](auto&& visitor) {      \
+      visitor(__VA_ARGS__);                            \
       })
 
 namespace dump {
 namespace internal_dump {
 
-using DumpNames = ::std::vector<::std::string>;
+// Names of the fields of a Dump. The names of a DUMP() call site are string
+// literals stored once per call site, so building a Dump never copies them.
+using DumpNames = ::std::span<const ::std::string_view>;
+template <::std::size_t N>
+using DumpNameArray = ::std::array<::std::string_view, N>;
+
+// Names Dump::as() takes: string literals, C strings and string views, which
+// it does not copy. Strings are rejected, since the view of a temporary one
+// would dangle.
+template <class T>
+concept DumpName = ::std::is_convertible_v<const T&, ::std::string_view> &&
+                   !::std::is_same_v<T, ::std::string>;
+
+// Everything known about a DUMP() call site at compile time. There is exactly
+// one per call site, so its address identifies the call site.
+struct DumpSite {
+  DumpNames names;
+  // The `"name":` JSON object key of each field.
+  DumpNames json_keys;
+  ::std::string_view file;
+  int line;
+};
 
 struct print_fields {
   void operator()() {}
@@ -106,21 +151,249 @@ struct print_fields {
   std::ostream& os;
   const ::std::string& field_sep;
   const ::std::string& kv_sep;
-  const DumpNames& names;
+  DumpNames names;
+  ::std::size_t n = 0;
+};
+
+//                    ====[ JSON ]====
+
+// Writes the JSON escape sequence of `c`, or `c` itself, to `out` and returns
+// the number of chars written (at most 6).
+constexpr ::std::size_t json_escape(char c, char* out) {
+  char e = 0;
+  switch (c) {
+    case '"': e = '"'; break;
+    case '\\': e = '\\'; break;
+    case '\b': e = 'b'; break;
+    case '\f': e = 'f'; break;
+    case '\n': e = 'n'; break;
+    case '\r': e = 'r'; break;
+    case '\t': e = 't'; break;
+    default: break;
+  }
+  if (e != 0) {
+    out[0] = '\\';
+    out[1] = e;
+    return 2;
+  }
+  const auto u = static_cast<unsigned char>(c);
+  if (u < 0x20) {
+    constexpr char kHex[] = "0123456789abcdef";
+    out[0] = '\\';
+    out[1] = 'u';
+    out[2] = '0';
+    out[3] = '0';
+    out[4] = kHex[u >> 4];
+    out[5] = kHex[u & 0xF];
+    return 6;
+  }
+  out[0] = c;
+  return 1;
+}
+
+constexpr bool json_needs_escape(char c) {
+  return static_cast<unsigned char>(c) < 0x20 || c == '"' || c == '\\';
+}
+
+// Returns the index of the first char of `s` at or after `i` which needs to be
+// escaped, or s.size(). Scans 8 chars at a time, since most strings have none.
+inline ::std::size_t json_find_escape(::std::string_view s, ::std::size_t i) {
+  constexpr ::std::uint64_t kOnes = 0x0101010101010101;
+  constexpr ::std::uint64_t kHighs = 0x8080808080808080;
+  for (; i + 8 <= s.size(); i += 8) {
+    ::std::uint64_t w;
+    ::std::memcpy(&w, s.data() + i, 8);
+    const ::std::uint64_t quote = w ^ (kOnes * '"');
+    const ::std::uint64_t backslash = w ^ (kOnes * '\\');
+    const ::std::uint64_t hits = ((w - kOnes * 0x20) & ~w) |
+                                 ((quote - kOnes) & ~quote) |
+                                 ((backslash - kOnes) & ~backslash);
+    if ((hits & kHighs) != 0) break;
+  }
+  for (; i < s.size(); ++i) {
+    if (json_needs_escape(s[i])) return i;
+  }
+  return s.size();
+}
+
+inline void write_json_string(::std::ostream& os, ::std::string_view s) {
+  os.put('"');
+  ::std::size_t begin = 0;
+  for (::std::size_t i = json_find_escape(s, 0); i < s.size();
+       i = json_find_escape(s, begin)) {
+    os.write(s.data() + begin, i - begin);
+    char seq[6];
+    os.write(seq, json_escape(s[i], seq));
+    begin = i + 1;
+  }
+  os.write(s.data() + begin, s.size() - begin);
+  os.put('"');
+}
+
+// Size of the `"name":` keys of `names`.
+template <::std::size_t N>
+constexpr ::std::size_t json_keys_size(const DumpNameArray<N>& names) {
+  ::std::size_t size = 0;
+  for (::std::string_view name : names) {
+    size += 3;
+    for (char c : name) {
+      char seq[6] = {};
+      size += json_escape(c, seq);
+    }
+  }
+  return size;
+}
+
+// The `"name":` keys of `names`, concatenated.
+template <::std::size_t Size, ::std::size_t N>
+constexpr ::std::array<char, Size> json_key_chars(
+    const DumpNameArray<N>& names) {
+  ::std::array<char, Size> chars{};
+  char* out = chars.data();
+  for (::std::string_view name : names) {
+    *out++ = '"';
+    for (char c : name) out += json_escape(c, out);
+    *out++ = '"';
+    *out++ = ':';
+  }
+  return chars;
+}
+
+// Splits the output of json_key_chars() into one key per name.
+template <::std::size_t N, ::std::size_t Size>
+constexpr DumpNameArray<N> json_key_views(const DumpNameArray<N>& names,
+                                          const ::std::array<char, Size>& chars) {
+  DumpNameArray<N> keys{};
+  ::std::size_t offset = 0;
+  for (::std::size_t i = 0; i < N; ++i) {
+    ::std::size_t size = 3;
+    for (char c : names[i]) {
+      char seq[6] = {};
+      size += json_escape(c, seq);
+    }
+    keys[i] = ::std::string_view(chars.data() + offset, size);
+    offset += size;
+  }
+  return keys;
+}
+
+template <class T>
+void write_json(::std::ostream& os, const T& value) {
+  if constexpr (::std::is_same_v<T, bool>) {
+    os << (value ? "true" : "false");
+  } else if constexpr (::std::is_same_v<T, ::std::nullptr_t>) {
+    os << "null";
+  } else if constexpr (::std::is_same_v<T, char>) {
+    write_json_string(os, ::std::string_view(&value, 1));
+  } else if constexpr (::std::is_arithmetic_v<T>) {
+    if constexpr (::std::is_floating_point_v<T>) {
+      // JSON has no representation for them.
+      if (!::std::isfinite(value)) {
+        os << "null";
+        return;
+      }
+    }
+    char buf[64];
+    const auto result = ::std::to_chars(buf, buf + sizeof(buf), value);
+    os.write(buf, result.ptr - buf);
+  } else if constexpr (::std::is_same_v<T, const char*> ||
+                       ::std::is_same_v<T, char*>) {
+    if (value == nullptr) {
+      os << "null";
+    } else {
+      write_json_string(os, value);
+    }
+  } else if constexpr (::std::is_convertible_v<const T&, ::std::string_view>) {
+    write_json_string(os, value);
+  } else if constexpr (requires { value.first; value.second; }) {
+    os.put('[');
+    write_json(os, value.first);
+    os.put(',');
+    write_json(os, value.second);
+    os.put(']');
+  } else if constexpr (requires { ::std::begin(value); ::std::end(value); }) {
+    os.put('[');
+    bool first = true;
+    for (const auto& element : value) {
+      if (!first) os.put(',');
+      first = false;
+      write_json(os, element);
+    }
+    os.put(']');
+  } else {
+    ::std::ostringstream oss;
+    oss << value;
+    write_json_string(os, oss.str());
+  }
+}
+
+struct json_fields {
+  template <class... Ts>
+  void operator()(const Ts&... ts) {
+    os.put('{');
+    (field(ts), ...);
+    os.put('}');
+  }
+
+  template <class T>
+  void field(const T& t) {
+    if (n != 0) os.put(',');
+    if (n < keys.size()) {
+      os.write(keys[n].data(), keys[n].size());
+    } else {
+      write_json_string(os, names[n]);
+      os.put(':');
+    }
+    ++n;
+    write_json(os, t);
+  }
+
+  std::ostream& os;
+  DumpNames names;
+  // Pre-escaped `"name":` keys, or empty to escape `names` on the fly.
+  DumpNames keys;
   ::std::size_t n = 0;
 };
 
+// View returned by json(): prints the viewed dump as a JSON object.
+template <class D>
+class DumpJson {
+ public:
+  explicit DumpJson(D&& dump): dump_(::std::forward<D>(dump)) {}
+
+  ::std::string str() const {
+    ::std::ostringstream oss;
+    oss << *this;
+    return oss.str();
+  }
+
+  friend ::std::ostream& operator<<(::std::ostream& os, const DumpJson& json) {
+    json.dump_.visit(json_fields{
+        .os=os,
+        .names=json.dump_.names(),
+        .keys=json.dump_.json_keys(),
+        });
+    return os;
+  }
+
+ private:
+  D dump_;
+};
+
+template <class D, ::std::size_t N>
+class DumpAs;
+
 template <class F>
 class Dump {
  public:
   explicit Dump(
       const ::std::string&& field_sep,
       const ::std::string&& kv_sep,
-      DumpNames&& names,
+      const DumpSite& site,
       F f):
         field_sep_(::std::move(field_sep)),
         kv_sep_(::std::move(kv_sep)),
-        names_(::std::move(names)),
+        site_(&site),
         f_(::std::move(f)) {}
 
   ::std::string str() const {
@@ -129,15 +402,36 @@ class Dump {
     return oss.str();
   }
 
-  template <class... N>
-  Dump<F> as(N&&... names) const {
-    return Dump<F>(
-        ::std::string{field_sep_},
-        ::std::string{kv_sep_},
-        DumpNames{names...},
-        f_);
+  const DumpSite& site() const { return *site_; }
+  DumpNames names() const { return site_->names; }
+  DumpNames json_keys() const { return site_->json_keys; }
+
+  // Calls `visitor(values...)` with the current values of the fields.
+  template <class V>
+  void visit(V&& visitor) const {
+    f_(visitor);
   }
 
+  // Returns a view printing this dump with other names. The names are not
+  // copied, so they must outlive the view (string literals always do): to
+  // rename with a std::string, keep it alive and pass a string_view of it.
+  template <DumpName... N>
+  DumpAs<const Dump&, sizeof...(N)> as(const N&... names) const& {
+    return DumpAs<const Dump&, sizeof...(N)>(
+        *this, DumpNameArray<sizeof...(N)>{::std::string_view(names)...});
+  }
+
+  // Same as above, but the view takes over this temporary dump.
+  template <DumpName... N>
+  DumpAs<Dump, sizeof...(N)> as(const N&... names) && {
+    return DumpAs<Dump, sizeof...(N)>(
+        ::std::move(*this),
+        DumpNameArray<sizeof...(N)>{::std::string_view(names)...});
+  }
+
+  DumpJson<const Dump&> json() const& { return DumpJson<const Dump&>(*this); }
+  DumpJson<Dump> json() && { return DumpJson<Dump>(::std::move(*this)); }
+
   Dump& sep(::std::string&& field_sep) {
     field_sep_ = ::std::move(field_sep);
     return *this;
@@ -150,32 +444,118 @@ class Dump {
   }
 
   friend ::std::ostream& operator<<(::std::ostream& os, const Dump& dump) {
-    dump.print_fields_(os);
+    dump.print_fields_(os, dump.names());
     return os;
   }
 
  private:
-  void print_fields_(::std::ostream& os) const {
-    f_(os, field_sep_, kv_sep_, names_);
+  template <class D, ::std::size_t N>
+  friend class DumpAs;
+
+  void print_fields_(::std::ostream& os, DumpNames names) const {
+    f_(print_fields{
+        .os=os,
+        .field_sep=field_sep_,
+        .kv_sep=kv_sep_,
+        .names=names,
+        });
   }
 
   ::std::string field_sep_;
   ::std::string kv_sep_;
-  DumpNames names_;
+  const DumpSite* site_;
   F f_;
 };
 
+// View returned by Dump::as(). It borrows the closure and separators of an
+// lvalue Dump, or takes over those of a temporary one, and only stores the
+// overriding names.
+template <class D, ::std::size_t N>
+class DumpAs {
+ public:
+  DumpAs(D&& dump, DumpNameArray<N> names):
+      dump_(::std::forward<D>(dump)),
+      names_(names) {}
+
+  ::std::string str() const {
+    ::std::ostringstream oss;
+    oss << *this;
+    return oss.str();
+  }
+
+  const DumpSite& site() const { return dump_.site(); }
+  DumpNames names() const { return names_; }
+  // The overriding names are only known at run time.
+  DumpNames json_keys() const { return {}; }
+
+  template <class V>
+  void visit(V&& visitor) const {
+    dump_.visit(::std::forward<V>(visitor));
+  }
+
+  // Renaming a view renames the underlying dump: views never nest.
+  template <DumpName... M>
+  DumpAs<const ::std::remove_cvref_t<D>&, sizeof...(M)> as(
+      const M&... names) const& {
+    return dump_.as(names...);
+  }
+
+  template <DumpName... M>
+  DumpAs<D, sizeof...(M)> as(const M&... names) && {
+    return DumpAs<D, sizeof...(M)>(
+        ::std::forward<D>(dump_),
+        DumpNameArray<sizeof...(M)>{::std::string_view(names)...});
+  }
+
+  DumpJson<const DumpAs&> json() const& {
+    return DumpJson<const DumpAs&>(*this);
+  }
+  DumpJson<DumpAs> json() && { return DumpJson<DumpAs>(::std::move(*this)); }
+
+  DumpAs& sep(::std::string&& field_sep)
+    requires(!::std::is_reference_v<D>) {
+    dump_.sep(::std::move(field_sep));
+    return *this;
+  }
+
+  DumpAs& sep(::std::string&& field_sep, ::std::string&& kv_sep)
+    requires(!::std::is_reference_v<D>) {
+    dump_.sep(::std::move(field_sep), ::std::move(kv_sep));
+    return *this;
+  }
+
+  friend ::std::ostream& operator<<(::std::ostream& os, const DumpAs& dump) {
+    dump.print_fields_(os);
+    return os;
+  }
+
+ private:
+  void print_fields_(::std::ostream& os) const {
+    dump_.print_fields_(os, names_);
+  }
+
+  D dump_;
+  DumpNameArray<N> names_;
+};
+
 template <class F>
-Dump<F> make_dump(DumpNames&& names, F f) {
+Dump<F> make_dump(const DumpSite& site, F f) {
   return Dump<F>(
       /*field_sep=*/", ",
       /*kv_sep=*/" = ",
-      ::std::move(names),
+      site,
       ::std::move(f)
   );
 }
 
 }  // namespace internal_dump
+
+// Returns a view printing `dump` as a compact JSON object.
+template <class D>
+auto as_json(D&& dump) {
+  return ::std::forward<D>(dump).json();
+}
+
 }  // namespace dump
 
 #endif // DUMP_HPP_
@@ -0,0 +1,587 @@
+// Copyright 2010-2022 Google LLC
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// FlightRecorder keeps the last DUMP() records of each thread in memory, and
+// only writes them out when the process crashes.
+//
+// Example:
+//   dump::FlightRecorder recorder;
+//   recorder.install(open("crash.dlog", O_WRONLY | O_CREAT | O_TRUNC, 0644));
+//   ...
+//   recorder << DUMP(request.id, state);  // Copies request.id and state.
+//
+// On SIGSEGV, SIGBUS, SIGFPE, SIGILL or SIGABRT, the records go to the file
+// as a binary log (see binlog.hpp), and the signal then takes the action it
+// had before install(), e.g. killing the process with a core dump. The log
+// decodes with BinlogReader, with a line for the signal and for each thread
+// before its records, oldest first:
+//
+//   signal = 11
+//   thread = 1234
+//   request.id = 42, state = 3
+//   ...
+//
+// Recording copies the values into a ring of the thread, as encoded in a
+// binary log. Only values of types without a binary encoding are formatted,
+// and nothing is written to the file before the crash.
+//
+// The signal handler is async-signal-safe: it allocates nothing, takes no
+// lock, and only calls write(2), which is why the file is opened before the
+// crash. write_to() writes the same log on demand, e.g. from a custom
+// handler.
+//
+//                    ====[ Rings ]====
+//
+// Each thread records to its own ring of `records` slots, overwriting the
+// oldest one:
+//
+//   dump::FlightRecorder recorder({.records = 1024, .record_size = 512});
+//
+// A record whose values take more than `record_size` bytes is written as
+// `truncated = file:line` of its call site, and names given by Dump::as() are
+// not kept (see slot_ring.hpp).
+//
+// The ring of a thread outlives it, until another thread takes it over. A
+// record being written when the signal arrives, on any thread, is skipped.
+//
+// There is at most one installed FlightRecorder at a time. A recorder must
+// not be destroyed while threads record to it. Handlers run on the alternate
+// signal stack of the thread if it has one (see sigaltstack(2)), which a
+// stack overflow needs; they use a few kilobytes of it.
+//
+// FlightRecorder needs POSIX signals: on Windows, this header declares
+// nothing.
+
+#ifndef DUMP_FLIGHT_HPP_
+#define DUMP_FLIGHT_HPP_
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#ifndef _WIN32
+#include <signal.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include "dump/binlog.hpp"
+#include "dump/dump.hpp"
+#include "dump/slot_ring.hpp"
+
+namespace dump {
+
+class FlightRecorder;
+
+namespace internal_dump {
+
+// Signals the handler writes the records on.
+inline constexpr int kFlightSignals[] = {SIGSEGV, SIGBUS, SIGFPE, SIGILL,
+                                         SIGABRT};
+// Bytes the handler buffers on its stack before writing.
+inline constexpr ::std::size_t kFlightBufferSize = 2048;
+// Bounds record_size, for a record to fit in the buffer of the handler.
+inline constexpr ::std::size_t kFlightMaxRecordSize = 1024;
+// Call sites the handler writes a schema once for. It writes one per record
+// for the others.
+inline constexpr ::std::size_t kFlightSites = 128;
+
+// Schema IDs of the lines which are not records.
+enum FlightSchema : ::std::uint32_t {
+  kFlightSignal = 1,
+  kFlightThread,
+  kFlightTruncatedSite,
+  kFlightFirstSite,
+};
+
+inline ::std::uint64_t flight_thread_id() {
+#ifdef __linux__
+  return static_cast<::std::uint64_t>(::syscall(SYS_gettid));
+#else
+  static ::std::atomic<::std::uint64_t> next_id = 1;
+  return next_id.fetch_add(1, ::std::memory_order_relaxed);
+#endif
+}
+
+// Last records of a thread. Only its thread writes to it, and the handler
+// reads it without a lock, skipping the records overwritten meanwhile.
+struct FlightRing {
+  FlightRing(::std::size_t records, ::std::size_t record_size):
+      slots(records, record_size) {}
+
+  SlotRing slots;
+  // Position of the first record of the thread, which may have taken over
+  // the ring of an exited one.
+  ::std::atomic<::std::uint64_t> first = 0;
+  ::std::atomic<::std::uint64_t> thread = 0;
+  // Set while a thread records to the ring.
+  ::std::atomic<bool> owned = true;
+  // Set once the recorder is destroyed.
+  ::std::atomic<bool> closed = false;
+  // Next ring of the recorder, for the handler.
+  FlightRing* next = nullptr;
+};
+
+// Rings of the current thread, by ID of their FlightRecorder.
+class FlightRingCache {
+ public:
+  ~FlightRingCache() {
+    for (auto& [id, ring] : rings_) {
+      ring->owned.store(false, ::std::memory_order_release);
+    }
+  }
+
+  // Returns the ring of the current thread for `id`, or nullptr.
+  FlightRing* find(::std::uint64_t id) const {
+    for (const auto& [ring_id, ring] : rings_) {
+      if (ring_id == id) return ring.get();
+    }
+    return nullptr;
+  }
+
+  void add(::std::uint64_t id, ::std::shared_ptr<FlightRing> ring) {
+    // Forgets the rings of destroyed recorders.
+    ::std::erase_if(rings_, [](const auto& entry) {
+      return entry.second->closed.load(::std::memory_order_relaxed);
+    });
+    rings_.emplace_back(id, ::std::move(ring));
+  }
+
+ private:
+  ::std::vector<::std::pair<::std::uint64_t, ::std::shared_ptr<FlightRing>>>
+      rings_;
+};
+
+inline FlightRingCache& flight_ring_cache() {
+  static thread_local FlightRingCache cache;
+  return cache;
+}
+
+// Binary log output, with only write(2).
+class FlightOutput {
+ public:
+  explicit FlightOutput(int fd): fd_(fd) {}
+
+  FlightOutput(const FlightOutput&) = delete;
+  FlightOutput& operator=(const FlightOutput&) = delete;
+
+  void put(::std::uint8_t byte) {
+    if (size_ == kFlightBufferSize) flush();
+    buffer_[size_++] = byte;
+  }
+
+  void put(const void* data, ::std::size_t size) {
+    if (kFlightBufferSize - size_ < size) flush();
+    if (size > kFlightBufferSize) {
+      write_(data, size);
+      return;
+    }
+    ::std::memcpy(buffer_ + size_, data, size);
+    size_ += size;
+  }
+
+  void put_varint(::std::uint64_t value) {
+    while (value >= 0x80) {
+      put(static_cast<::std::uint8_t>(value) | 0x80);
+      value >>= 7;
+    }
+    put(static_cast<::std::uint8_t>(value));
+  }
+
+  void put_string(::std::string_view s) {
+    put_varint(s.size());
+    put(s.data(), s.size());
+  }
+
+  // Makes room for `size` bytes, at most kFlightBufferSize, in the buffer, so
+  // that what is put next can be taken back with resize().
+  void reserve(::std::size_t size) {
+    if (kFlightBufferSize - size_ < size) flush();
+  }
+
+  ::std::size_t size() const { return size_; }
+  void resize(::std::size_t size) { size_ = size; }
+
+  // Writes the buffer. Returns false if any write failed.
+  bool flush() {
+    write_(buffer_, size_);
+    size_ = 0;
+    return ok_;
+  }
+
+ private:
+  void write_(const void* data, ::std::size_t size) {
+    const auto* p = static_cast<const ::std::uint8_t*>(data);
+    while (size > 0) {
+      const ::ssize_t written = ::write(fd_, p, size);
+      if (written < 0) {
+        if (errno == EINTR) continue;
+        ok_ = false;
+        return;
+      }
+      p += written;
+      size -= static_cast<::std::size_t>(written);
+    }
+  }
+
+  const int fd_;
+  bool ok_ = true;
+  ::std::size_t size_ = 0;
+  ::std::uint8_t buffer_[kFlightBufferSize];
+};
+
+// Schema IDs of the call sites written so far by the handler.
+class FlightSites {
+ public:
+  // Returns the ID of `site`, and whether it is new. Call sites beyond
+  // kFlightSites are always new.
+  ::std::pair<::std::uint32_t, bool> id(const DumpSite* site) {
+    const ::std::size_t hash =
+        ::std::hash<const DumpSite*>()(site) % kFlightSites;
+    for (::std::size_t i = 0; i < kFlightSites; ++i) {
+      Entry& entry = entries_[(hash + i) % kFlightSites];
+      if (entry.site == site) return {entry.id, false};
+      if (entry.site == nullptr) {
+        entry = {.site=site, .id=next_id_++};
+        return {entry.id, true};
+      }
+    }
+    return {next_id_++, true};
+  }
+
+ private:
+  struct Entry {
+    const DumpSite* site;
+    ::std::uint32_t id;
+  };
+
+  Entry entries_[kFlightSites] = {};
+  ::std::uint32_t next_id_ = kFlightFirstSite;
+};
+
+inline void put_flight_schema(FlightOutput& out, ::std::uint32_t id,
+                              ::std::string_view file, int line,
+                              DumpNames names, const BinlogType* types) {
+  out.put(kBinlogSchema);
+  out.put_varint(id);
+  out.put(0);
+  out.put_varint(static_cast<::std::uint32_t>(line));
+  out.put_string(file);
+  out.put(static_cast<::std::uint8_t>(names.size()));
+  for (::std::size_t i = 0; i < names.size(); ++i) {
+    out.put(types[i]);
+    out.put_string(names[i]);
+  }
+}
+
+// Writes the record of `site` which did not fit in its slot.
+inline void put_flight_truncated(FlightOutput& out, const DumpSite& site) {
+  char digits[16];
+  char* const end = digits + sizeof(digits);
+  char* p = end;
+  for (unsigned line = static_cast<unsigned>(site.line); p == end || line != 0;
+       line /= 10) {
+    *--p = static_cast<char>('0' + line % 10);
+  }
+  out.put(kBinlogRecord);
+  out.put_varint(kFlightTruncatedSite);
+  const ::std::size_t size = static_cast<::std::size_t>(end - p);
+  out.put_varint(site.file.size() + 1 + size);
+  out.put(site.file.data(), site.file.size());
+  out.put(':');
+  out.put(p, size);
+}
+
+// What install() installs, and what it replaced.
+struct FlightHandlers {
+  // Guards installation.
+  ::std::mutex mutex;
+  ::std::atomic<const FlightRecorder*> recorder = nullptr;
+  ::std::atomic<int> fd = -1;
+  // Set by the first handler to run.
+  ::std::atomic<bool> crashed = false;
+  bool installed = false;
+  struct sigaction previous[::std::size(kFlightSignals)];
+};
+
+inline FlightHandlers& flight_handlers() {
+  static FlightHandlers handlers;
+  return handlers;
+}
+
+inline void flight_signal_handler(int signal);
+
+}  // namespace internal_dump
+
+struct FlightRecorderOptions {
+  // Records kept per thread, rounded up to a power of two.
+  ::std::size_t records = 256;
+  // Bytes of values kept per record, at most 1024. Larger records are kept
+  // as their call site.
+  ::std::size_t record_size = 256;
+};
+
+class FlightRecorder {
+ public:
+  explicit FlightRecorder(FlightRecorderOptions options = {}):
+      records_(options.records),
+      record_size_(::std::min(options.record_size,
+                              internal_dump::kFlightMaxRecordSize)) {}
+
+  FlightRecorder(const FlightRecorder&) = delete;
+  FlightRecorder& operator=(const FlightRecorder&) = delete;
+
+  ~FlightRecorder() {
+    uninstall();
+    ::std::lock_guard<::std::mutex> lock(mutex_);
+    for (const auto& ring : rings_) {
+      ring->closed.store(true, ::std::memory_order_relaxed);
+    }
+  }
+
+  // Keeps a snapshot of `dump` in the ring of the current thread.
+  template <class D>
+  FlightRecorder& write(const D& dump) {
+    internal_dump::FlightRing& ring = local_ring_();
+    dump.visit([&](const auto&... values) {
+      ring.slots.push(dump.site(), values...);
+    });
+    return *this;
+  }
+
+  template <class D>
+  friend FlightRecorder& operator<<(FlightRecorder& recorder,
+                                    const D& dump) {
+    return recorder.write(dump);
+  }
+
+  // Writes the kept records of each thread to `fd`, as a binary log. Returns
+  // false if a write failed. Async-signal-safe.
+  bool write_to(int fd) const {
+    internal_dump::FlightOutput out(fd);
+    write_(out, 0);
+    return out.flush();
+  }
+
+  // Installs handlers of fatal signals writing the kept records to `fd`, in
+  // place of the recorder installed before, if any. Returns false if a
+  // handler cannot be installed.
+  bool install(int fd) {
+    internal_dump::FlightHandlers& handlers = internal_dump::flight_handlers();
+    ::std::lock_guard<::std::mutex> lock(handlers.mutex);
+    handlers.fd.store(fd, ::std::memory_order_relaxed);
+    handlers.recorder.store(this, ::std::memory_order_release);
+    if (handlers.installed) return true;
+    struct sigaction action = {};
+    action.sa_handler = internal_dump::flight_signal_handler;
+    action.sa_flags = SA_ONSTACK;
+    sigemptyset(&action.sa_mask);
+    for (::std::size_t i = 0; i < ::std::size(internal_dump::kFlightSignals);
+         ++i) {
+      if (::sigaction(internal_dump::kFlightSignals[i], &action,
+                      &handlers.previous[i]) != 0) {
+        restore_(handlers, i);
+        handlers.recorder.store(nullptr, ::std::memory_order_relaxed);
+        return false;
+      }
+    }
+    handlers.installed = true;
+    return true;
+  }
+
+  // Restores the handlers install() replaced, if this recorder is installed.
+  void uninstall() {
+    internal_dump::FlightHandlers& handlers = internal_dump::flight_handlers();
+    ::std::lock_guard<::std::mutex> lock(handlers.mutex);
+    if (handlers.recorder.load(::std::memory_order_relaxed) != this) return;
+    restore_(handlers, ::std::size(internal_dump::kFlightSignals));
+    handlers.installed = false;
+    handlers.recorder.store(nullptr, ::std::memory_order_release);
+  }
+
+ private:
+  friend void internal_dump::flight_signal_handler(int signal);
+
+  // Restores the first `n` handlers.
+  static void restore_(internal_dump::FlightHandlers& handlers,
+                       ::std::size_t n) {
+    for (::std::size_t i = 0; i < n; ++i) {
+      ::sigaction(internal_dump::kFlightSignals[i], &handlers.previous[i],
+                  nullptr);
+    }
+  }
+
+  internal_dump::FlightRing& local_ring_() {
+    internal_dump::FlightRingCache& cache = internal_dump::flight_ring_cache();
+    if (internal_dump::FlightRing* ring = cache.find(id_)) return *ring;
+    ::std::shared_ptr<internal_dump::FlightRing> ring;
+    {
+      ::std::lock_guard<::std::mutex> lock(mutex_);
+      // Takes over the ring of an exited thread, if any.
+      for (const auto& r : rings_) {
+        bool owned = false;
+        if (r->owned.compare_exchange_strong(owned, true,
+                                             ::std::memory_order_acquire)) {
+          ring = r;
+          break;
+        }
+      }
+      if (ring == nullptr) {
+        ring = ::std::make_shared<internal_dump::FlightRing>(records_,
+                                                             record_size_);
+        rings_.push_back(ring);
+        ring->next = head_.load(::std::memory_order_relaxed);
+        head_.store(ring.get(), ::std::memory_order_release);
+      }
+    }
+    ring->thread.store(internal_dump::flight_thread_id(),
+                       ::std::memory_order_relaxed);
+    ring->first.store(ring->slots.tail(), ::std::memory_order_release);
+    internal_dump::FlightRing& local = *ring;
+    cache.add(id_, ::std::move(ring));
+    return local;
+  }
+
+  // Writes the log, starting with `signal` unless 0.
+  void write_(internal_dump::FlightOutput& out, int signal) const {
+    using internal_dump::BinlogType;
+    out.put(internal_dump::kBinlogMagic, sizeof(internal_dump::kBinlogMagic));
+    out.put(internal_dump::kBinlogVersion);
+    out.put(internal_dump::kBinlogEndian);
+    out.put(0);
+    if (signal != 0) {
+      static constexpr ::std::string_view kNames[] = {"signal"};
+      static constexpr BinlogType kTypes[] = {internal_dump::kBinlogInt32};
+      internal_dump::put_flight_schema(out, internal_dump::kFlightSignal, "",
+                                       0, kNames, kTypes);
+      out.put(internal_dump::kBinlogRecord);
+      out.put_varint(internal_dump::kFlightSignal);
+      out.put_varint(internal_dump::zigzag_encode(signal));
+    }
+    {
+      static constexpr ::std::string_view kNames[] = {"thread"};
+      static constexpr BinlogType kTypes[] = {internal_dump::kBinlogUInt64};
+      internal_dump::put_flight_schema(out, internal_dump::kFlightThread, "",
+                                       0, kNames, kTypes);
+    }
+    {
+      static constexpr ::std::string_view kNames[] = {"truncated"};
+      static constexpr BinlogType kTypes[] = {internal_dump::kBinlogString};
+      internal_dump::put_flight_schema(out,
+                                       internal_dump::kFlightTruncatedSite, "",
+                                       0, kNames, kTypes);
+    }
+    internal_dump::FlightSites sites;
+    for (const internal_dump::FlightRing* ring =
+             head_.load(::std::memory_order_acquire);
+         ring != nullptr; ring = ring->next) {
+      write_ring_(out, *ring, sites);
+    }
+  }
+
+  static void write_ring_(internal_dump::FlightOutput& out,
+                          const internal_dump::FlightRing& ring,
+                          internal_dump::FlightSites& sites) {
+    const internal_dump::SlotRing& slots = ring.slots;
+    const ::std::uint64_t tail = slots.tail();
+    const ::std::uint64_t first =
+        ::std::max(ring.first.load(::std::memory_order_acquire),
+                   slots.oldest(tail));
+    if (first >= tail) return;
+    out.put(internal_dump::kBinlogRecord);
+    out.put_varint(internal_dump::kFlightThread);
+    out.put_varint(ring.thread.load(::std::memory_order_relaxed));
+    for (::std::uint64_t position = first; position < tail; ++position) {
+      internal_dump::SlotRead read;
+      if (!slots.begin_read(position, read) || !slots.validate(read)) {
+        continue;
+      }
+      if (read.truncated()) {
+        internal_dump::put_flight_truncated(out, *read.site);
+        continue;
+      }
+      if (read.size > slots.record_size()) continue;
+      const auto [id, new_site] = sites.id(read.site);
+      if (new_site) {
+        internal_dump::put_flight_schema(out, id, read.site->file,
+                                         read.site->line, read.site->names,
+                                         read.types);
+      }
+      // Takes the record back if overwritten meanwhile.
+      out.reserve(1 + 5 + read.size);
+      const ::std::size_t mark = out.size();
+      out.put(internal_dump::kBinlogRecord);
+      out.put_varint(id);
+      slots.read_values(read, [&](const void* data, ::std::size_t size) {
+        out.put(data, size);
+      });
+      if (!slots.validate(read)) out.resize(mark);
+    }
+  }
+
+  const ::std::uint64_t id_ = [] {
+    static ::std::atomic<::std::uint64_t> next_id = 0;
+    return next_id.fetch_add(1, ::std::memory_order_relaxed);
+  }();
+  const ::std::size_t records_;
+  const ::std::size_t record_size_;
+
+  // Guards rings_.
+  ::std::mutex mutex_;
+  ::std::vector<::std::shared_ptr<internal_dump::FlightRing>> rings_;
+  // The rings, as a list the handler can walk without the lock.
+  ::std::atomic<internal_dump::FlightRing*> head_ = nullptr;
+};
+
+namespace internal_dump {
+
+inline void flight_signal_handler(int signal) {
+  const int saved_errno = errno;
+  FlightHandlers& handlers = flight_handlers();
+  // Threads crashing meanwhile wait for the first one to end the process.
+  if (handlers.crashed.exchange(true, ::std::memory_order_acq_rel)) {
+    for (;;) ::pause();
+  }
+  if (const FlightRecorder* recorder =
+          handlers.recorder.load(::std::memory_order_acquire)) {
+    FlightOutput out(handlers.fd.load(::std::memory_order_relaxed));
+    recorder->write_(out, signal);
+    out.flush();
+  }
+  // The signal, blocked until the handler returns, then takes its previous
+  // action.
+  FlightRecorder::restore_(handlers, ::std::size(kFlightSignals));
+  ::raise(signal);
+  errno = saved_errno;
+}
+
+}  // namespace internal_dump
+
+}  // namespace dump
+
+#endif // _WIN32
+
+#endif // DUMP_FLIGHT_HPP_
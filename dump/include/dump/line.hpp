@@ -0,0 +1,141 @@
+// Copyright 2010-2022 Google LLC
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// line() prints a DUMP() record as a whole line, with a single write to the
+// stream.
+//
+// Printing a dump inserts each name, separator and value into the stream on
+// its own. When several threads print to a shared stream, such as std::cerr,
+// their records interleave mid-field, and the stream is locked for each
+// insertion. line() renders the record and its newline into a thread-local
+// buffer first, and writes the buffer at once: lines stay intact, and the
+// stream is locked once per line.
+//
+// Example:
+//   // Prints: foo = 42, bar = hello\n
+//   std::cerr << dump::line(DUMP(foo, bar));
+//   std::cerr << dump::line(DUMP(foo, bar).json());
+//
+// The record is rendered with the flags, precision, fill and locale of the
+// stream. The buffer keeps the capacity of the longest line of its thread, so
+// printing a line usually does not allocate.
+//
+// A line is intact if the stream writes a buffer at once: std::cerr and
+// std::cout do, as do streams of a std::filebuf with a large enough buffer.
+// Other streams still need to be guarded by their users.
+
+#ifndef DUMP_LINE_HPP_
+#define DUMP_LINE_HPP_
+
+#include <ios>
+#include <ostream>
+#include <sstream>
+#include <streambuf>
+#include <string>
+#include <string_view>
+#include <utility>
+
+namespace dump {
+namespace internal_dump {
+
+// Stream buffer appending to a string, reused across lines.
+class LineBuffer : public ::std::streambuf {
+ public:
+  ::std::string_view view() const { return line_; }
+  void clear() { line_.clear(); }
+
+ protected:
+  int_type overflow(int_type c) override {
+    if (!traits_type::eq_int_type(c, traits_type::eof())) {
+      line_.push_back(traits_type::to_char_type(c));
+    }
+    return traits_type::not_eof(c);
+  }
+
+  ::std::streamsize xsputn(const char* s, ::std::streamsize n) override {
+    line_.append(s, static_cast<::std::size_t>(n));
+    return n;
+  }
+
+ private:
+  ::std::string line_;
+};
+
+struct LineStream {
+  LineBuffer buffer;
+  ::std::ostream os{&buffer};
+  // Whether a line is being rendered, so that a value printing a line itself
+  // does not clobber it.
+  bool busy = false;
+};
+
+inline LineStream& line_stream() {
+  thread_local LineStream stream;
+  return stream;
+}
+
+// Prints `value` and a newline to `os` with a single write.
+template <class T>
+void write_line(::std::ostream& os, const T& value) {
+  LineStream& stream = line_stream();
+  if (stream.busy) {
+    ::std::ostringstream line;
+    line.copyfmt(os);
+    line << value << '\n';
+    os.write(line.view().data(), static_cast<::std::streamsize>(
+                                     line.view().size()));
+    return;
+  }
+  struct Guard {
+    ~Guard() { stream.busy = false; }
+    LineStream& stream;
+  } guard{stream};
+  stream.busy = true;
+  stream.buffer.clear();
+  stream.os.clear();
+  stream.os.flags(os.flags());
+  stream.os.precision(os.precision());
+  stream.os.fill(os.fill());
+  if (stream.os.getloc() != os.getloc()) stream.os.imbue(os.getloc());
+  stream.os << value << '\n';
+  const ::std::string_view line = stream.buffer.view();
+  os.write(line.data(), static_cast<::std::streamsize>(line.size()));
+}
+
+}  // namespace internal_dump
+
+// View returned by line(): prints the viewed record as a line, at once.
+template <class D>
+class DumpLine {
+ public:
+  explicit DumpLine(D&& dump): dump_(::std::forward<D>(dump)) {}
+
+  friend ::std::ostream& operator<<(::std::ostream& os, const DumpLine& line) {
+    internal_dump::write_line(os, line.dump_);
+    return os;
+  }
+
+ private:
+  D dump_;
+};
+
+// Returns a view printing `dump`, or anything printable, followed by a
+// newline with a single write.
+template <class D>
+DumpLine<D> line(D&& dump) {
+  return DumpLine<D>(::std::forward<D>(dump));
+}
+
+}  // namespace dump
+
+#endif // DUMP_LINE_HPP_
@@ -0,0 +1,231 @@
+// Copyright 2010-2022 Google LLC
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// NUMA topology and node-local memory, without libnuma.
+//
+// On machines with several NUMA nodes (sockets, usually), memory is attached
+// to a node, and threads on other nodes reach it more slowly. Logging queues
+// are written by the threads producing records: numa_allocate() places them
+// on the node of those threads.
+//
+// Example:
+//   const dump::NumaTopology& topology = dump::NumaTopology::system();
+//   const std::size_t node = topology.current_node();
+//   void* buffer = dump::numa_allocate(size, topology.id(node));
+//   ...
+//   dump::numa_deallocate(buffer, size);
+//
+// The topology is read from /sys/devices/system/node on Linux. Elsewhere, or
+// if it cannot be read, it has a single node, and memory is allocated as
+// usual.
+//
+// Nodes are numbered from 0 to nodes() - 1, in the order of their IDs, which
+// may not be contiguous: id() gives the ID the kernel knows a node by.
+
+#ifndef DUMP_NUMA_HPP_
+#define DUMP_NUMA_HPP_
+
+#include <charconv>
+#include <cstddef>
+#include <fstream>
+#include <new>
+#include <span>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#ifdef __linux__
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace dump {
+namespace internal_dump {
+
+// MPOL_PREFERRED of <linux/mempolicy.h>: allocate on the node if it can.
+inline constexpr int kMpolPreferred = 1;
+// Bounds CPU and node numbers, against malformed lists.
+inline constexpr int kMaxCpus = 1 << 16;
+// Nodes an mbind() mask can hold.
+inline constexpr int kMaxNumaNodes = 1024;
+// Alignment of numa_allocate() where pages cannot be mapped.
+inline constexpr ::std::size_t kNumaAlignment = 4096;
+
+}  // namespace internal_dump
+
+// Appends the CPUs of `list`, in the format of Linux CPU lists (e.g.
+// "0-3,8,10-11"), to `cpus`. Returns false if `list` is malformed. Lists of
+// nodes have the same format.
+inline bool parse_cpu_list(::std::string_view list,
+                           ::std::vector<int>& cpus) {
+  while (!list.empty() && (list.back() == '\n' || list.back() == ' ')) {
+    list.remove_suffix(1);
+  }
+  const char* p = list.data();
+  const char* const end = p + list.size();
+  while (p != end) {
+    int first;
+    ::std::from_chars_result result = ::std::from_chars(p, end, first);
+    if (result.ec != ::std::errc() || first < 0) return false;
+    int last = first;
+    if (result.ptr != end && *result.ptr == '-') {
+      result = ::std::from_chars(result.ptr + 1, end, last);
+      if (result.ec != ::std::errc() || last < first) return false;
+    }
+    if (last >= internal_dump::kMaxCpus) return false;
+    for (int cpu = first; cpu <= last; ++cpu) cpus.push_back(cpu);
+    const char* const next = result.ptr;
+    if (next != end && (*next != ',' || next + 1 == end)) return false;
+    p = next == end ? end : next + 1;
+  }
+  return true;
+}
+
+class NumaTopology {
+ public:
+  // Reads the nodes from `root`, a directory with an `online` list of node
+  // IDs, and a node<ID>/cpulist file for each.
+  static NumaTopology read(
+      const ::std::string& root = "/sys/devices/system/node") {
+    NumaTopology topology;
+    ::std::vector<int> ids;
+    if (::std::string list; read_line_(root + "/online", list)) {
+      parse_cpu_list(list, ids);
+    }
+    for (int id : ids) {
+      ::std::vector<int> cpus;
+      ::std::string list;
+      if (read_line_(root + "/node" + ::std::to_string(id) + "/cpulist",
+                     list) &&
+          parse_cpu_list(list, cpus)) {
+        topology.add_(id, ::std::move(cpus));
+      }
+    }
+    if (topology.ids_.empty()) topology.add_(0, {});
+    return topology;
+  }
+
+  // The topology of this machine, read once.
+  static const NumaTopology& system() {
+    static const NumaTopology topology = read();
+    return topology;
+  }
+
+  ::std::size_t nodes() const { return ids_.size(); }
+
+  // The ID of `node`, for the kernel.
+  int id(::std::size_t node) const { return ids_[node]; }
+
+  // The CPUs of `node`, or none if unknown.
+  const ::std::vector<int>& cpus(::std::size_t node) const {
+    return cpus_[node];
+  }
+
+  // The node of `cpu`, or 0 if unknown.
+  ::std::size_t node_of_cpu(int cpu) const {
+    if (cpu < 0 || static_cast<::std::size_t>(cpu) >= node_of_cpu_.size()) {
+      return 0;
+    }
+    return node_of_cpu_[cpu];
+  }
+
+  // The node of the CPU the calling thread runs on.
+  ::std::size_t current_node() const {
+    if (ids_.size() == 1) return 0;
+#ifdef __linux__
+    return node_of_cpu(::sched_getcpu());
+#else
+    return 0;
+#endif
+  }
+
+ private:
+  static bool read_line_(const ::std::string& path, ::std::string& line) {
+    ::std::ifstream file(path);
+    return static_cast<bool>(::std::getline(file, line));
+  }
+
+  void add_(int id, ::std::vector<int> cpus) {
+    for (int cpu : cpus) {
+      if (static_cast<::std::size_t>(cpu) >= node_of_cpu_.size()) {
+        node_of_cpu_.resize(cpu + 1, 0);
+      }
+      node_of_cpu_[cpu] = ids_.size();
+    }
+    ids_.push_back(id);
+    cpus_.push_back(::std::move(cpus));
+  }
+
+  ::std::vector<int> ids_;
+  ::std::vector<::std::vector<int>> cpus_;
+  ::std::vector<::std::size_t> node_of_cpu_;
+};
+
+// Allocates `size` bytes, page-aligned, on the node of ID `node` if
+// possible, or wherever its pages are first written. Returns nullptr if out
+// of memory.
+inline void* numa_allocate(::std::size_t size, int node) {
+#ifdef __linux__
+  void* p = ::mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) return nullptr;
+  if (node >= 0 && node < internal_dump::kMaxNumaNodes &&
+      NumaTopology::system().nodes() > 1) {
+    constexpr int kBits = 8 * sizeof(unsigned long);
+    unsigned long mask[internal_dump::kMaxNumaNodes / kBits] = {};
+    mask[node / kBits] = 1ul << (node % kBits);
+    // Best effort: first touch places the pages otherwise.
+    ::syscall(SYS_mbind, p, size, internal_dump::kMpolPreferred, mask,
+              internal_dump::kMaxNumaNodes, 0);
+  }
+  return p;
+#else
+  (void)node;
+  return ::operator new(size, ::std::align_val_t(internal_dump::kNumaAlignment),
+                        ::std::nothrow);
+#endif
+}
+
+// Frees `p`, returned by numa_allocate(`size`, ...).
+inline void numa_deallocate(void* p, ::std::size_t size) {
+#ifdef __linux__
+  ::munmap(p, size);
+#else
+  (void)size;
+  ::operator delete(p, ::std::align_val_t(internal_dump::kNumaAlignment));
+#endif
+}
+
+// Restricts the calling thread to `cpus`. Returns false if it cannot, or if
+// `cpus` is empty.
+inline bool pin_thread(::std::span<const int> cpus) {
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu : cpus) {
+    if (cpu >= 0 && cpu < CPU_SETSIZE) CPU_SET(cpu, &set);
+  }
+  return CPU_COUNT(&set) != 0 &&
+         ::sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+  (void)cpus;
+  return false;
+#endif
+}
+
+}  // namespace dump
+
+#endif // DUMP_NUMA_HPP_
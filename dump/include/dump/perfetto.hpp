@@ -0,0 +1,528 @@
+// Copyright 2010-2022 Google LLC
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// PerfettoWriter writes DUMP() records and spans in Perfetto's binary trace
+// format: protobuf TracePackets, encoded in-tree without a protobuf library.
+// Traces open in Perfetto UI (ui.perfetto.dev) and trace_processor.
+//
+// Example:
+//   std::vector<std::uint8_t> trace;
+//   dump::PerfettoWriter perfetto(trace, {.track_name = "worker"});
+//   perfetto << DUMP(foo, bar);  // Instant event, foo and bar as arguments.
+//   {
+//     DUMP_PERFETTO_SPAN(perfetto, "Handle", request.id);
+//     ...
+//   }  // Slice "Handle" over the scope, request.id as argument.
+//   file.write(reinterpret_cast<const char*>(trace.data()), trace.size());
+//
+// Record events are named after their call site ("file.cc:42"), and carry
+// it as their source location. DUMP() fields become debug annotations: bools,
+// integers, floating point values and strings keep their type, other values
+// are formatted with their operator<<.
+//
+// Event names, field names and call sites are interned: each is written once
+// per writer, in the interned data of the first packet using it, then
+// referred to by ID. Records of a call site thus take little more than their
+// values.
+//
+// A writer is one packet sequence, shown as one track, and is not
+// thread-safe: use one writer per thread. On Linux and macOS, the track is
+// that of the thread which constructs the writer, as the OS knows it, for
+// events of other sources on the same thread to line up with its own.
+// Elsewhere, it is a track of its own, with only a name.
+//
+// A trace is a concatenation of packets, so the outputs of several writers
+// can simply be concatenated into one trace, as long as their sequence IDs
+// differ, which they do by default.
+//
+// Timestamps are read with TscClock, and written as steady_clock time, in
+// nanoseconds.
+
+#ifndef DUMP_PERFETTO_HPP_
+#define DUMP_PERFETTO_HPP_
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#include <unistd.h>
+#elif defined(__APPLE__)
+#include <pthread.h>
+#endif
+
+#include "dump/clock.hpp"
+#include "dump/dump.hpp"
+#include "dump/trace.hpp"
+
+#define DUMP_PERFETTO_SPAN(writer, name, ...) \
+  DUMP_PERFETTO_SPAN_(__LINE__, writer, name, __VA_ARGS__)
+#define DUMP_PERFETTO_SPAN_(line, writer, name, ...)                  \
+  ::dump::PerfettoSpan DUMP_CONCATENATE(dump_perfetto_span_, line)( \
+      writer, name, DUMP(__VA_ARGS__))
+
+namespace dump {
+namespace internal_dump {
+
+enum ProtoWireType : ::std::uint8_t {
+  kProtoVarint = 0,
+  kProtoFixed64 = 1,
+  kProtoBytes = 2,
+};
+
+inline void put_proto_varint(::std::vector<::std::uint8_t>& out,
+                             ::std::uint64_t value) {
+  while (value >= 0x80) {
+    out.push_back(static_cast<::std::uint8_t>(value | 0x80));
+    value >>= 7;
+  }
+  out.push_back(static_cast<::std::uint8_t>(value));
+}
+
+inline void put_proto_tag(::std::vector<::std::uint8_t>& out,
+                          ::std::uint32_t field, ProtoWireType type) {
+  put_proto_varint(out, field << 3 | type);
+}
+
+inline void put_proto_uint(::std::vector<::std::uint8_t>& out,
+                           ::std::uint32_t field, ::std::uint64_t value) {
+  put_proto_tag(out, field, kProtoVarint);
+  put_proto_varint(out, value);
+}
+
+inline void put_proto_double(::std::vector<::std::uint8_t>& out,
+                             ::std::uint32_t field, double value) {
+  ::std::uint64_t bits;
+  ::std::memcpy(&bits, &value, sizeof(bits));
+  put_proto_tag(out, field, kProtoFixed64);
+  for (int i = 0; i < 8; ++i) {
+    out.push_back(static_cast<::std::uint8_t>(bits >> (8 * i)));
+  }
+}
+
+inline void put_proto_bytes(::std::vector<::std::uint8_t>& out,
+                            ::std::uint32_t field, ::std::string_view s) {
+  put_proto_tag(out, field, kProtoBytes);
+  put_proto_varint(out, s.size());
+  out.insert(out.end(), s.begin(), s.end());
+}
+
+// Starts a nested message, and returns the position of its size, written by
+// end_proto_message(). As in Perfetto's own protozero, the size is a varint
+// padded to 4 bytes, so that messages are written in place.
+inline ::std::size_t begin_proto_message(::std::vector<::std::uint8_t>& out,
+                                         ::std::uint32_t field) {
+  put_proto_tag(out, field, kProtoBytes);
+  out.resize(out.size() + 4);
+  return out.size() - 4;
+}
+
+inline void end_proto_message(::std::vector<::std::uint8_t>& out,
+                              ::std::size_t pos) {
+  const ::std::size_t size = out.size() - pos - 4;
+  for (int i = 0; i < 4; ++i) {
+    out[pos + i] = static_cast<::std::uint8_t>((size >> (7 * i)) & 0x7f) |
+                   (i < 3 ? 0x80 : 0);
+  }
+}
+
+// Field numbers of the Perfetto protos, by message.
+// Trace.
+inline constexpr ::std::uint32_t kTracePacket = 1;
+// TracePacket.
+inline constexpr ::std::uint32_t kPacketTimestamp = 8;
+inline constexpr ::std::uint32_t kPacketSequenceId = 10;
+inline constexpr ::std::uint32_t kPacketTrackEvent = 11;
+inline constexpr ::std::uint32_t kPacketInternedData = 12;
+inline constexpr ::std::uint32_t kPacketSequenceFlags = 13;
+inline constexpr ::std::uint32_t kPacketTrackDescriptor = 60;
+// TrackDescriptor.
+inline constexpr ::std::uint32_t kTrackUuid = 1;
+inline constexpr ::std::uint32_t kTrackName = 2;
+inline constexpr ::std::uint32_t kTrackThread = 4;
+// ThreadDescriptor.
+inline constexpr ::std::uint32_t kThreadPid = 1;
+inline constexpr ::std::uint32_t kThreadTid = 2;
+inline constexpr ::std::uint32_t kThreadName = 5;
+// TrackEvent.
+inline constexpr ::std::uint32_t kEventDebugAnnotations = 4;
+inline constexpr ::std::uint32_t kEventType = 9;
+inline constexpr ::std::uint32_t kEventNameIid = 10;
+inline constexpr ::std::uint32_t kEventTrackUuid = 11;
+inline constexpr ::std::uint32_t kEventSourceLocationIid = 34;
+// DebugAnnotation.
+inline constexpr ::std::uint32_t kAnnotationNameIid = 1;
+inline constexpr ::std::uint32_t kAnnotationBool = 2;
+inline constexpr ::std::uint32_t kAnnotationUint = 3;
+inline constexpr ::std::uint32_t kAnnotationInt = 4;
+inline constexpr ::std::uint32_t kAnnotationDouble = 5;
+inline constexpr ::std::uint32_t kAnnotationString = 6;
+// InternedData.
+inline constexpr ::std::uint32_t kInternedEventNames = 2;
+inline constexpr ::std::uint32_t kInternedAnnotationNames = 3;
+inline constexpr ::std::uint32_t kInternedSourceLocations = 4;
+// EventName and DebugAnnotationName.
+inline constexpr ::std::uint32_t kInternedIid = 1;
+inline constexpr ::std::uint32_t kInternedName = 2;
+// SourceLocation.
+inline constexpr ::std::uint32_t kLocationIid = 1;
+inline constexpr ::std::uint32_t kLocationFile = 2;
+inline constexpr ::std::uint32_t kLocationLine = 4;
+
+// TracePacket.SequenceFlags.
+inline constexpr ::std::uint64_t kSeqIncrementalStateCleared = 1;
+inline constexpr ::std::uint64_t kSeqNeedsIncrementalState = 2;
+
+// TrackEvent.Type.
+enum PerfettoEventType : ::std::uint8_t {
+  kPerfettoSliceBegin = 1,
+  kPerfettoSliceEnd = 2,
+  kPerfettoInstant = 3,
+};
+
+template <class T>
+void put_perfetto_value(::std::vector<::std::uint8_t>& out, const T& value) {
+  if constexpr (::std::is_same_v<T, bool>) {
+    put_proto_uint(out, kAnnotationBool, value);
+  } else if constexpr (::std::is_same_v<T, char>) {
+    put_proto_bytes(out, kAnnotationString, ::std::string_view(&value, 1));
+  } else if constexpr (::std::is_integral_v<T> && ::std::is_signed_v<T>) {
+    put_proto_uint(out, kAnnotationInt,
+                   static_cast<::std::uint64_t>(
+                       static_cast<::std::int64_t>(value)));
+  } else if constexpr (::std::is_integral_v<T>) {
+    put_proto_uint(out, kAnnotationUint, value);
+  } else if constexpr (::std::is_floating_point_v<T>) {
+    put_proto_double(out, kAnnotationDouble, static_cast<double>(value));
+  } else if constexpr (::std::is_same_v<T, const char*> ||
+                       ::std::is_same_v<T, char*>) {
+    put_proto_bytes(out, kAnnotationString,
+                    value != nullptr ? value : ::std::string_view());
+  } else if constexpr (::std::is_convertible_v<const T&, ::std::string_view>) {
+    put_proto_bytes(out, kAnnotationString, value);
+  } else {
+    ::std::ostringstream oss;
+    oss << value;
+    put_proto_bytes(out, kAnnotationString, oss.str());
+  }
+}
+
+// Starts a packet of the sequence, and returns the position of its size.
+inline ::std::size_t begin_perfetto_packet(::std::vector<::std::uint8_t>& out,
+                                           ::std::uint64_t ticks,
+                                           ::std::uint32_t sequence_id,
+                                           ::std::uint64_t flags) {
+  const ::std::size_t packet = begin_proto_message(out, kTracePacket);
+  put_proto_uint(out, kPacketTimestamp,
+                 ::std::chrono::duration_cast<::std::chrono::nanoseconds>(
+                     TscClock::to_steady(ticks).time_since_epoch())
+                     .count());
+  put_proto_uint(out, kPacketSequenceId, sequence_id);
+  put_proto_uint(out, kPacketSequenceFlags, flags);
+  return packet;
+}
+
+// OS ID of the current thread, or 0 where there is none to get cheaply.
+inline ::std::uint64_t perfetto_thread_id() {
+#if defined(__linux__)
+  return static_cast<::std::uint64_t>(::syscall(SYS_gettid));
+#elif defined(__APPLE__)
+  ::std::uint64_t tid = 0;
+  ::pthread_threadid_np(nullptr, &tid);
+  return tid;
+#else
+  return 0;
+#endif
+}
+
+// Describes the track `uuid`, as the thread `tid` if not 0, or else as a
+// track only named `name`, which Perfetto does not tie to any thread.
+inline void put_perfetto_track(::std::vector<::std::uint8_t>& out,
+                               ::std::uint64_t uuid, ::std::uint64_t tid,
+                               ::std::string_view name) {
+  const ::std::size_t track = begin_proto_message(out, kPacketTrackDescriptor);
+  put_proto_uint(out, kTrackUuid, uuid);
+  if (tid == 0) {
+    put_proto_bytes(out, kTrackName, name);
+  } else {
+    const ::std::size_t thread = begin_proto_message(out, kTrackThread);
+    put_proto_uint(out, kThreadPid, trace_pid());
+    put_proto_uint(out, kThreadTid, tid);
+    put_proto_bytes(out, kThreadName, name);
+    end_proto_message(out, thread);
+  }
+  end_proto_message(out, track);
+}
+
+// Writes an EventName or DebugAnnotationName entry of InternedData.
+inline void put_perfetto_interned(::std::vector<::std::uint8_t>& out,
+                                  ::std::uint32_t field, ::std::uint64_t iid,
+                                  ::std::string_view name) {
+  const ::std::size_t entry = begin_proto_message(out, field);
+  put_proto_uint(out, kInternedIid, iid);
+  put_proto_bytes(out, kInternedName, name);
+  end_proto_message(out, entry);
+}
+
+inline void put_perfetto_location(::std::vector<::std::uint8_t>& out,
+                                  ::std::uint64_t iid, const DumpSite& site) {
+  const ::std::size_t entry = begin_proto_message(out, kInternedSourceLocations);
+  put_proto_uint(out, kLocationIid, iid);
+  put_proto_bytes(out, kLocationFile, site.file);
+  put_proto_uint(out, kLocationLine, site.line);
+  end_proto_message(out, entry);
+}
+
+struct perfetto_fields {
+  template <class... Ts>
+  void operator()(const Ts&... ts) {
+    (field(ts), ...);
+  }
+
+  template <class T>
+  void field(const T& t) {
+    const ::std::size_t annotation =
+        begin_proto_message(out, kEventDebugAnnotations);
+    put_proto_uint(out, kAnnotationNameIid, name_iids[n++]);
+    put_perfetto_value(out, t);
+    end_proto_message(out, annotation);
+  }
+
+  ::std::vector<::std::uint8_t>& out;
+  // Interning ID of the name of each field.
+  const ::std::uint64_t* name_iids;
+  ::std::size_t n = 0;
+};
+
+}  // namespace internal_dump
+
+struct PerfettoOptions {
+  // Identifies the packet sequence of the writer in the trace. 0 picks one
+  // not used by other writers of the process.
+  ::std::uint32_t sequence_id = 0;
+  // Name of the track of the writer.
+  ::std::string track_name = "dump";
+};
+
+class PerfettoWriter {
+ public:
+  // Appends the trace to `out`, starting with the description of its track.
+  explicit PerfettoWriter(::std::vector<::std::uint8_t>& out,
+                          PerfettoOptions options = {}):
+      out_(out),
+      sequence_id_(options.sequence_id != 0 ? options.sequence_id
+                                            : next_sequence_id_()),
+      // Any ID unique in the trace, derived from the sequence ID for it to be
+      // stable across runs.
+      track_uuid_(0x64756d70'00000000 | sequence_id_) {
+    const ::std::size_t packet = internal_dump::begin_perfetto_packet(
+        out_, TscClock::now(), sequence_id_,
+        internal_dump::kSeqIncrementalStateCleared);
+    internal_dump::put_perfetto_track(out_, track_uuid_,
+                                      internal_dump::perfetto_thread_id(),
+                                      options.track_name);
+    internal_dump::end_proto_message(out_, packet);
+  }
+
+  PerfettoWriter(const PerfettoWriter&) = delete;
+  PerfettoWriter& operator=(const PerfettoWriter&) = delete;
+
+  // Writes `dump` as an instant event, named after its call site.
+  template <class D>
+  PerfettoWriter& write(const D& dump) {
+    Site& site = site_(dump.site());
+    if (site.name_iid == 0) {
+      ::std::string_view file = dump.site().file;
+      file.remove_prefix(file.find_last_of("/\\") + 1);
+      site.name_iid = intern_(event_names_, internal_dump::kInternedEventNames,
+                              ::std::string(file) + ":" +
+                                  ::std::to_string(dump.site().line));
+    }
+    write_event_(TscClock::now(), internal_dump::kPerfettoInstant,
+                 site.name_iid, site.location_iid, dump);
+    return *this;
+  }
+
+  template <class D>
+  friend PerfettoWriter& operator<<(PerfettoWriter& perfetto, const D& dump) {
+    return perfetto.write(dump);
+  }
+
+  // Writes a slice from `begin` to `end`, TscClock ticks, with the fields of
+  // `dump` as arguments.
+  template <class D>
+  PerfettoWriter& slice(::std::string_view name, const D& dump,
+                        ::std::uint64_t begin, ::std::uint64_t end) {
+    const Site& site = site_(dump.site());
+    const ::std::uint64_t name_iid =
+        intern_(event_names_, internal_dump::kInternedEventNames, name);
+    write_event_(begin, internal_dump::kPerfettoSliceBegin, name_iid,
+                 site.location_iid, dump);
+    const ::std::size_t packet = internal_dump::begin_perfetto_packet(
+        out_, end, sequence_id_, internal_dump::kSeqNeedsIncrementalState);
+    const ::std::size_t event = internal_dump::begin_proto_message(
+        out_, internal_dump::kPacketTrackEvent);
+    internal_dump::put_proto_uint(out_, internal_dump::kEventType,
+                                  internal_dump::kPerfettoSliceEnd);
+    internal_dump::put_proto_uint(out_, internal_dump::kEventTrackUuid,
+                                  track_uuid_);
+    internal_dump::end_proto_message(out_, event);
+    internal_dump::end_proto_message(out_, packet);
+    return *this;
+  }
+
+  ::std::uint32_t sequence_id() const { return sequence_id_; }
+
+ private:
+  struct Hash {
+    using is_transparent = void;
+    ::std::size_t operator()(::std::string_view s) const {
+      return ::std::hash<::std::string_view>()(s);
+    }
+  };
+
+  using InternTable =
+      ::std::unordered_map<::std::string, ::std::uint64_t, Hash,
+                           ::std::equal_to<>>;
+
+  struct Site {
+    // Interning ID of the name of the records of the call site, 0 until one
+    // is written.
+    ::std::uint64_t name_iid = 0;
+    ::std::uint64_t location_iid = 0;
+    // Interning IDs of the names of the call site itself.
+    ::std::vector<::std::uint64_t> field_iids;
+  };
+
+  static ::std::uint32_t next_sequence_id_() {
+    static ::std::atomic<::std::uint32_t> next = 1;
+    return next.fetch_add(1, ::std::memory_order_relaxed);
+  }
+
+  // Returns the interning ID of `s`, adding it to the interned data of the
+  // next packet if new.
+  ::std::uint64_t intern_(InternTable& table, ::std::uint32_t field,
+                          ::std::string_view s) {
+    if (const auto it = table.find(s); it != table.end()) return it->second;
+    const ::std::uint64_t iid = table.size() + 1;
+    table.emplace(s, iid);
+    internal_dump::put_perfetto_interned(interned_, field, iid, s);
+    return iid;
+  }
+
+  Site& site_(const internal_dump::DumpSite& dump_site) {
+    auto [it, inserted] = sites_.try_emplace(&dump_site);
+    Site& site = it->second;
+    if (!inserted) return site;
+    site.location_iid = sites_.size();
+    internal_dump::put_perfetto_location(interned_, site.location_iid,
+                                         dump_site);
+    site.field_iids = field_iids_(dump_site.names);
+    return site;
+  }
+
+  ::std::vector<::std::uint64_t> field_iids_(internal_dump::DumpNames names) {
+    ::std::vector<::std::uint64_t> iids;
+    for (::std::string_view name : names) {
+      iids.push_back(intern_(annotation_names_,
+                             internal_dump::kInternedAnnotationNames, name));
+    }
+    return iids;
+  }
+
+  template <class D>
+  void write_event_(::std::uint64_t ticks, internal_dump::PerfettoEventType type,
+                    ::std::uint64_t name_iid, ::std::uint64_t location_iid,
+                    const D& dump) {
+    ::std::vector<::std::uint64_t> renamed_iids;
+    const ::std::uint64_t* field_iids = sites_[&dump.site()].field_iids.data();
+    if (dump.names().data() != dump.site().names.data()) {
+      renamed_iids = field_iids_(dump.names());
+      field_iids = renamed_iids.data();
+    }
+    const ::std::size_t packet = internal_dump::begin_perfetto_packet(
+        out_, ticks, sequence_id_, internal_dump::kSeqNeedsIncrementalState);
+    if (!interned_.empty()) {
+      internal_dump::put_proto_bytes(
+          out_, internal_dump::kPacketInternedData,
+          ::std::string_view(reinterpret_cast<const char*>(interned_.data()),
+                             interned_.size()));
+      interned_.clear();
+    }
+    const ::std::size_t event = internal_dump::begin_proto_message(
+        out_, internal_dump::kPacketTrackEvent);
+    internal_dump::put_proto_uint(out_, internal_dump::kEventType, type);
+    internal_dump::put_proto_uint(out_, internal_dump::kEventTrackUuid,
+                                  track_uuid_);
+    internal_dump::put_proto_uint(out_, internal_dump::kEventNameIid,
+                                  name_iid);
+    internal_dump::put_proto_uint(
+        out_, internal_dump::kEventSourceLocationIid, location_iid);
+    dump.visit(internal_dump::perfetto_fields{
+        .out=out_,
+        .name_iids=field_iids,
+        });
+    internal_dump::end_proto_message(out_, event);
+    internal_dump::end_proto_message(out_, packet);
+  }
+
+  ::std::vector<::std::uint8_t>& out_;
+  const ::std::uint32_t sequence_id_;
+  const ::std::uint64_t track_uuid_;
+  InternTable event_names_;
+  InternTable annotation_names_;
+  ::std::unordered_map<const internal_dump::DumpSite*, Site> sites_;
+  // Interned data not written yet, for the next packet.
+  ::std::vector<::std::uint8_t> interned_;
+};
+
+// Writes a slice from its construction to its destruction, see
+// DUMP_PERFETTO_SPAN().
+template <class D>
+class PerfettoSpan {
+ public:
+  PerfettoSpan(PerfettoWriter& writer, ::std::string_view name, D&& dump):
+      writer_(writer),
+      name_(name),
+      dump_(::std::move(dump)),
+      begin_(TscClock::now()) {}
+
+  PerfettoSpan(const PerfettoSpan&) = delete;
+  PerfettoSpan& operator=(const PerfettoSpan&) = delete;
+
+  ~PerfettoSpan() { writer_.slice(name_, dump_, begin_, TscClock::now()); }
+
+ private:
+  PerfettoWriter& writer_;
+  const ::std::string_view name_;
+  const D dump_;
+  const ::std::uint64_t begin_;
+};
+
+template <class D>
+PerfettoSpan(PerfettoWriter&, ::std::string_view, D&&) -> PerfettoSpan<D>;
+
+}  // namespace dump
+
+#endif // DUMP_PERFETTO_HPP_
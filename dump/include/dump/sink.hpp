@@ -0,0 +1,72 @@
+// Copyright 2010-2022 Google LLC
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Sink is a destination for rendered or encoded DUMP() records: a stream, a
+// compressed file... Writers that produce bytes hand them to a Sink, so the
+// destination can be changed without changing the writer.
+//
+// Example:
+//   dump::OstreamSink sink(std::cerr);
+//   sink << DUMP(foo, bar);  // Writes: foo = 42, bar = hello\n
+//
+// operator<< renders a record as a line of text, and writes it at once.
+//
+// Sinks are not thread-safe, unless stated otherwise.
+
+#ifndef DUMP_SINK_HPP_
+#define DUMP_SINK_HPP_
+
+#include <ostream>
+#include <sstream>
+#include <string_view>
+
+namespace dump {
+
+class Sink {
+ public:
+  virtual ~Sink() = default;
+
+  // Writes `bytes`: one or more whole records.
+  virtual void write(::std::string_view bytes) = 0;
+
+  // Pushes buffered bytes to their final destination.
+  virtual void flush() {}
+};
+
+// Writes `dump` as a line of text.
+template <class D>
+  requires requires(const D& dump) { dump.site(); }
+Sink& operator<<(Sink& sink, const D& dump) {
+  ::std::ostringstream oss;
+  oss << dump << '\n';
+  sink.write(oss.str());
+  return sink;
+}
+
+class OstreamSink : public Sink {
+ public:
+  explicit OstreamSink(::std::ostream& os): os_(os) {}
+
+  void write(::std::string_view bytes) override {
+    os_.write(bytes.data(), bytes.size());
+  }
+
+  void flush() override { os_.flush(); }
+
+ private:
+  ::std::ostream& os_;
+};
+
+}  // namespace dump
+
+#endif // DUMP_SINK_HPP_
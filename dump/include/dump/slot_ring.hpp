@@ -0,0 +1,220 @@
+// Copyright 2010-2022 Google LLC
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// SlotRing is the ring of DUMP() records under BroadcastRing and
+// FlightRecorder: one thread writes records into fixed-size slots,
+// overwriting the oldest one, while other threads, or a signal handler, read
+// them without ever making it wait.
+//
+// A record is the call site of a DUMP() and its values, encoded as in a
+// binary log (see binlog.hpp), and copied into the slot as 64-bit words. A
+// record whose values take more than `record_size` bytes only keeps its call
+// site. Names given by Dump::as() are dropped: they are views, which may not
+// outlive the record, so a record has the names of its call site.
+//
+// Each slot is a sequence lock. Everything in a slot is a relaxed atomic,
+// since readers may read a slot while it is rewritten: they check its
+// sequence number once done, and discard what they read if it changed.
+// Reading allocates nothing and takes no lock, hence works in a signal
+// handler.
+
+#ifndef DUMP_SLOT_RING_HPP_
+#define DUMP_SLOT_RING_HPP_
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <vector>
+
+#include "dump/binlog.hpp"
+#include "dump/dump.hpp"
+
+namespace dump {
+namespace internal_dump {
+
+// Lock-free, hence readable from a signal handler.
+static_assert(::std::atomic<::std::uint64_t>::is_always_lock_free);
+
+// Size of a record whose values did not fit in its slot.
+inline constexpr ::std::uint32_t kSlotTruncated = ~::std::uint32_t{0};
+
+// Header of a slot, followed by its values, as words.
+struct RingSlot {
+  // 2 * position + 1 while the record of that position is written, then
+  // 2 * position + 2.
+  ::std::atomic<::std::uint64_t> sequence = 0;
+  ::std::atomic<const DumpSite*> site = nullptr;
+  ::std::atomic<const BinlogType*> types = nullptr;
+  // Bytes of values, or kSlotTruncated.
+  ::std::atomic<::std::uint32_t> size = 0;
+
+  ::std::atomic<::std::uint64_t>* words() {
+    return ::std::launder(
+        reinterpret_cast<::std::atomic<::std::uint64_t>*>(this + 1));
+  }
+  const ::std::atomic<::std::uint64_t>* words() const {
+    return ::std::launder(
+        reinterpret_cast<const ::std::atomic<::std::uint64_t>*>(this + 1));
+  }
+};
+
+// Header of a record read by SlotRing::begin_read().
+struct SlotRead {
+  ::std::uint64_t position;
+  ::std::uint64_t sequence;
+  const DumpSite* site;
+  const BinlogType* types;
+  // Bytes of values, or kSlotTruncated.
+  ::std::uint32_t size;
+
+  bool truncated() const { return size == kSlotTruncated; }
+};
+
+class SlotRing {
+ public:
+  // Keeps `capacity` records, rounded up to a power of two, of at most
+  // `record_size` bytes of values.
+  SlotRing(::std::size_t capacity, ::std::size_t record_size):
+      mask_(::std::bit_ceil(::std::max<::std::size_t>(capacity, 1)) - 1),
+      record_size_(record_size),
+      stride_(sizeof(RingSlot) + words_(record_size) * sizeof(::std::uint64_t)),
+      storage_(new ::std::byte[(mask_ + 1) * stride_]) {
+    for (::std::size_t i = 0; i <= mask_; ++i) {
+      ::std::byte* const slot = storage_.get() + i * stride_;
+      new (slot) RingSlot;
+      for (::std::size_t j = 0; j < words_(record_size_); ++j) {
+        new (slot + sizeof(RingSlot) + j * sizeof(::std::uint64_t))
+            ::std::atomic<::std::uint64_t>(0);
+      }
+    }
+  }
+
+  SlotRing(const SlotRing&) = delete;
+  SlotRing& operator=(const SlotRing&) = delete;
+
+  ::std::size_t capacity() const { return mask_ + 1; }
+  ::std::size_t record_size() const { return record_size_; }
+
+  // Position of the next record.
+  ::std::uint64_t tail() const {
+    return tail_.load(::std::memory_order_acquire);
+  }
+
+  // Position of the oldest record still in the ring, before `tail`.
+  ::std::uint64_t oldest(::std::uint64_t tail) const {
+    return tail - ::std::min<::std::uint64_t>(tail, capacity());
+  }
+
+  // Writes the record of `site` into the next slot. Only one thread at a
+  // time may push.
+  template <class... Ts>
+  void push(const DumpSite& site, const Ts&... values) {
+    scratch_.clear();
+    (put_binlog_value(scratch_, values, nullptr, nullptr), ...);
+    const ::std::uint64_t position = tail_.load(::std::memory_order_relaxed);
+    RingSlot& s = slot_(position);
+    s.sequence.store(2 * position + 1, ::std::memory_order_relaxed);
+    ::std::atomic_thread_fence(::std::memory_order_release);
+    s.site.store(&site, ::std::memory_order_relaxed);
+    s.types.store(kBinlogTypes<Ts...>, ::std::memory_order_relaxed);
+    if (scratch_.size() <= record_size_) {
+      s.size.store(static_cast<::std::uint32_t>(scratch_.size()),
+                   ::std::memory_order_relaxed);
+      ::std::atomic<::std::uint64_t>* const words = s.words();
+      for (::std::size_t i = 0; i < words_(scratch_.size()); ++i) {
+        const ::std::size_t offset = i * sizeof(::std::uint64_t);
+        ::std::uint64_t word = 0;
+        ::std::memcpy(&word, scratch_.data() + offset,
+                      ::std::min(sizeof(word), scratch_.size() - offset));
+        words[i].store(word, ::std::memory_order_relaxed);
+      }
+    } else {
+      s.size.store(kSlotTruncated, ::std::memory_order_relaxed);
+    }
+    s.sequence.store(2 * position + 2, ::std::memory_order_release);
+    tail_.store(position + 1, ::std::memory_order_release);
+  }
+
+  // Reads the header of the record at `position` into `read`. Returns false
+  // if its slot holds another record. What is read of the record is only
+  // valid if validate() returns true afterwards.
+  bool begin_read(::std::uint64_t position, SlotRead& read) const {
+    const RingSlot& s = slot_(position);
+    read.position = position;
+    read.sequence = s.sequence.load(::std::memory_order_acquire);
+    if (read.sequence != 2 * position + 2) return false;
+    read.site = s.site.load(::std::memory_order_relaxed);
+    read.types = s.types.load(::std::memory_order_relaxed);
+    read.size = s.size.load(::std::memory_order_relaxed);
+    return true;
+  }
+
+  // Calls `put(data, size)` with the values of the record of `read`, but a
+  // truncated one, by chunks of at most a word.
+  template <class F>
+  void read_values(const SlotRead& read, F&& put) const {
+    const RingSlot& s = slot_(read.position);
+    // Bounded, in case the size is from a later record.
+    const ::std::size_t size =
+        ::std::min<::std::size_t>(read.size, record_size_);
+    for (::std::size_t i = 0; i < words_(size); ++i) {
+      const ::std::size_t offset = i * sizeof(::std::uint64_t);
+      const ::std::uint64_t word =
+          s.words()[i].load(::std::memory_order_relaxed);
+      put(&word, ::std::min(sizeof(word), size - offset));
+    }
+  }
+
+  // Whether the slot of `read` still holds its record, i.e. whether what was
+  // read of it since begin_read() is whole.
+  bool validate(const SlotRead& read) const {
+    ::std::atomic_thread_fence(::std::memory_order_acquire);
+    return slot_(read.position).sequence.load(::std::memory_order_relaxed) ==
+           read.sequence;
+  }
+
+ private:
+  static ::std::size_t words_(::std::size_t bytes) {
+    return (bytes + sizeof(::std::uint64_t) - 1) / sizeof(::std::uint64_t);
+  }
+
+  RingSlot& slot_(::std::uint64_t position) {
+    return *::std::launder(reinterpret_cast<RingSlot*>(
+        storage_.get() + (position & mask_) * stride_));
+  }
+  const RingSlot& slot_(::std::uint64_t position) const {
+    return *::std::launder(reinterpret_cast<const RingSlot*>(
+        storage_.get() + (position & mask_) * stride_));
+  }
+
+  const ::std::size_t mask_;
+  const ::std::size_t record_size_;
+  // Bytes from a slot to the next.
+  const ::std::size_t stride_;
+  const ::std::unique_ptr<::std::byte[]> storage_;
+  // Values of the record being pushed.
+  ::std::vector<::std::uint8_t> scratch_;
+  // Position of the next record. Readers poll it: it has a cache line of its
+  // own.
+  alignas(64) ::std::atomic<::std::uint64_t> tail_ = 0;
+};
+
+}  // namespace internal_dump
+}  // namespace dump
+
+#endif // DUMP_SLOT_RING_HPP_
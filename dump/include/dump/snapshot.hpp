@@ -0,0 +1,196 @@
+// Copyright 2010-2022 Google LLC
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// DumpSnapshot is a DUMP() record holding copies of its values.
+//
+// DUMP() captures its arguments by reference, and evaluates them each time it
+// is printed. A snapshot evaluates them once, when it is taken, and keeps the
+// values: it can be printed later, or on another thread, once the arguments
+// are gone.
+//
+// Example:
+//   dump::AnyDump record;
+//   {
+//     std::string name = "foo";
+//     dump::visit_snapshot(DUMP(name), [&](auto&& snapshot) {
+//       record = std::move(snapshot);
+//     });
+//   }
+//   LOG(INFO) << record;  // Prints: name = foo
+//
+// The type of a snapshot depends on the types of the values, which are only
+// known to the visitor of the dump: visit_snapshot() passes the snapshot to a
+// callback rather than returning it.
+//
+// A snapshot prints, and renders as JSON, like the dump it was taken from,
+// but with the default separators.
+//
+//                    ====[ Values ]====
+//
+// Values are stored as their decayed type. C strings and string views become
+// std::string (a null C string becomes an empty string), since what they
+// point to is usually as short-lived as the arguments. Other views, pointers
+// and spans still refer to the data they did.
+//
+// Names given with Dump::as() are copied too, since they may be views of
+// strings as short-lived as the arguments.
+
+#ifndef DUMP_SNAPSHOT_HPP_
+#define DUMP_SNAPSHOT_HPP_
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include "dump/dump.hpp"
+
+namespace dump {
+namespace internal_dump {
+
+template <class T>
+inline constexpr bool kIsSnapshotString =
+    ::std::is_same_v<::std::decay_t<T>, const char*> ||
+    ::std::is_same_v<::std::decay_t<T>, char*> ||
+    ::std::is_same_v<::std::remove_cvref_t<T>, ::std::string_view>;
+
+// Type of the copy of a value of type T.
+template <class T>
+using snapshot_value_t =
+    ::std::conditional_t<kIsSnapshotString<T>, ::std::string,
+                         ::std::decay_t<T>>;
+
+template <class T>
+snapshot_value_t<T> snapshot_value(const T& value) {
+  if constexpr (::std::is_pointer_v<::std::decay_t<T>> &&
+                kIsSnapshotString<T>) {
+    const char* s = value;
+    return s == nullptr ? ::std::string() : ::std::string(s);
+  } else {
+    return snapshot_value_t<T>(value);
+  }
+}
+
+}  // namespace internal_dump
+
+template <class... Ts>
+class DumpSnapshot {
+ public:
+  // Copies `values`, the values of the fields of `dump`.
+  template <class D, class... Vs>
+  explicit DumpSnapshot(const D& dump, const Vs&... values):
+      site_(&dump.site()),
+      renamed_(dump.names().data() != dump.site().names.data()),
+      values_(internal_dump::snapshot_value(values)...) {
+    static_assert(sizeof...(Vs) == sizeof...(Ts));
+    if (renamed_) own_names_(dump.names());
+  }
+
+  DumpSnapshot(const DumpSnapshot& other):
+      site_(other.site_),
+      renamed_(other.renamed_),
+      values_(other.values_) {
+    if (renamed_) own_names_(other.names_);
+  }
+  // The names stay where they are, in name_chars_.
+  DumpSnapshot(DumpSnapshot&&) = default;
+
+  DumpSnapshot& operator=(const DumpSnapshot& other) {
+    if (this != &other) *this = DumpSnapshot(other);
+    return *this;
+  }
+  DumpSnapshot& operator=(DumpSnapshot&&) = default;
+
+  ::std::string str() const {
+    ::std::ostringstream oss;
+    oss << *this;
+    return oss.str();
+  }
+
+  const internal_dump::DumpSite& site() const { return *site_; }
+
+  internal_dump::DumpNames names() const {
+    return renamed_ ? internal_dump::DumpNames(names_) : site_->names;
+  }
+
+  internal_dump::DumpNames json_keys() const {
+    return renamed_ ? internal_dump::DumpNames() : site_->json_keys;
+  }
+
+  // Calls `visitor(values...)` with the copied values.
+  template <class V>
+  void visit(V&& visitor) const {
+    ::std::apply([&](const Ts&... values) { visitor(values...); }, values_);
+  }
+
+  internal_dump::DumpJson<const DumpSnapshot&> json() const& {
+    return internal_dump::DumpJson<const DumpSnapshot&>(*this);
+  }
+  internal_dump::DumpJson<DumpSnapshot> json() && {
+    return internal_dump::DumpJson<DumpSnapshot>(::std::move(*this));
+  }
+
+  friend ::std::ostream& operator<<(::std::ostream& os,
+                                    const DumpSnapshot& dump) {
+    static const ::std::string field_sep = ", ";
+    static const ::std::string kv_sep = " = ";
+    dump.visit(internal_dump::print_fields{
+        .os=os,
+        .field_sep=field_sep,
+        .kv_sep=kv_sep,
+        .names=dump.names(),
+        });
+    return os;
+  }
+
+ private:
+  // Copies the characters of `names` into name_chars_, and views them.
+  void own_names_(internal_dump::DumpNames names) {
+    const ::std::size_t n = ::std::min(names.size(), names_.size());
+    ::std::size_t size = 0;
+    for (::std::size_t i = 0; i < n; ++i) size += names[i].size();
+    name_chars_ = ::std::make_unique<char[]>(size);
+    char* chars = name_chars_.get();
+    for (::std::size_t i = 0; i < n; ++i) {
+      ::std::copy_n(names[i].data(), names[i].size(), chars);
+      names_[i] = ::std::string_view(chars, names[i].size());
+      chars += names[i].size();
+    }
+  }
+
+  const internal_dump::DumpSite* site_;
+  bool renamed_;
+  // The names of a renamed dump, viewing name_chars_.
+  internal_dump::DumpNameArray<sizeof...(Ts)> names_{};
+  ::std::unique_ptr<char[]> name_chars_;
+  ::std::tuple<Ts...> values_;
+};
+
+// Calls `f(snapshot)` with a DumpSnapshot of `dump`, an rvalue.
+template <class D, class F>
+void visit_snapshot(const D& dump, F&& f) {
+  dump.visit([&](const auto&... values) {
+    f(DumpSnapshot<internal_dump::snapshot_value_t<decltype(values)>...>(
+        dump, values...));
+  });
+}
+
+}  // namespace dump
+
+#endif // DUMP_SNAPSHOT_HPP_
@@ -0,0 +1,351 @@
+// Copyright 2010-2022 Google LLC
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// DUMP_SPAN() times the rest of the enclosing scope, and records it as a
+// Chrome Trace Event Format event, with its DUMP() fields as arguments. The
+// trace opens as is in Perfetto UI (ui.perfetto.dev) or about://tracing.
+//
+// Example:
+//   std::ofstream file("trace.json");
+//   dump::ChromeTrace trace(file);
+//   ...
+//   void Handle(const Request& request) {
+//     DUMP_SPAN("Handle", request.id, request.size());
+//     ...
+//   }  // Records: {"name":"Handle","ph":"X","ts":...,"dur":...,
+//      //           "args":{"request.id":42,"request.size()":3},...}
+//
+// Like DUMP(), DUMP_SPAN() captures its arguments by reference: they are
+// evaluated when the span ends, and must outlive it.
+//
+// Spans are timed with TscClock. Ending a span appends its ticks and the
+// values of its arguments, encoded as in a binary log (see binlog.hpp), to a
+// buffer of its thread: only values of types without a binary encoding are
+// formatted then, as text, which their arguments hold as JSON strings. The
+// buffers are converted to events, and written to the trace stream, on
+// flush(), when their thread exits, when the trace is destroyed, and by the
+// thread ending a span once its buffer is full. Events keep the names of
+// their call site: names given by Dump::as() are not kept, since they may
+// not outlive the buffer.
+//
+// There is at most one ChromeTrace at a time. Spans ending while there is
+// none are not recorded. A trace must not be destroyed while spans end on
+// other threads.
+
+#ifndef DUMP_TRACE_HPP_
+#define DUMP_TRACE_HPP_
+
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <span>
+#include <string_view>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "dump/binlog.hpp"
+#include "dump/clock.hpp"
+#include "dump/dump.hpp"
+
+// Names the span variable from __COUNTER__ where available, for spans on the
+// same line not to clash.
+#ifdef __COUNTER__
+#define DUMP_SPAN(name, ...) DUMP_SPAN_(__COUNTER__, name, __VA_ARGS__)
+#else
+#define DUMP_SPAN(name, ...) DUMP_SPAN_(__LINE__, name, __VA_ARGS__)
+#endif
+// Extra level for the ID to be expanded before concatenation.
+#define DUMP_SPAN_(id, name, ...)                   \
+  ::dump::TraceSpan DUMP_CONCATENATE(dump_span_, id)( \
+      name, DUMP(__VA_ARGS__))
+
+namespace dump {
+
+class ChromeTrace;
+
+namespace internal_dump {
+
+// Guards the active trace, the buffers registered with it, and its stream.
+inline ::std::mutex& trace_mutex() {
+  static ::std::mutex mutex;
+  return mutex;
+}
+
+inline ::std::atomic<ChromeTrace*>& active_trace() {
+  static ::std::atomic<ChromeTrace*> trace = nullptr;
+  return trace;
+}
+
+// A span ended, followed in TraceSpans::bytes by its name and the values
+// of its fields.
+struct TraceSpanEntry {
+  const DumpSite* site;
+  const BinlogType* types;
+  // TscClock ticks.
+  ::std::uint64_t begin;
+  ::std::uint64_t end;
+  ::std::uint32_t name_size;
+  ::std::uint32_t values_size;
+};
+
+struct TraceSpans {
+  bool empty() const { return entries.empty(); }
+
+  ::std::size_t size() const {
+    return entries.size() * sizeof(TraceSpanEntry) + bytes.size();
+  }
+
+  template <class... Ts>
+  void add(::std::string_view name, const DumpSite& site,
+           ::std::uint64_t begin, ::std::uint64_t end, const Ts&... values) {
+    const ::std::size_t offset = bytes.size();
+    bytes.insert(bytes.end(), name.begin(), name.end());
+    (put_binlog_value(bytes, values, nullptr, nullptr), ...);
+    entries.push_back(TraceSpanEntry{
+        .site=&site,
+        .types=kBinlogTypes<Ts...>,
+        .begin=begin,
+        .end=end,
+        .name_size=static_cast<::std::uint32_t>(name.size()),
+        .values_size=static_cast<::std::uint32_t>(bytes.size() - offset -
+                                                  name.size()),
+        });
+  }
+
+  ::std::vector<TraceSpanEntry> entries;
+  ::std::vector<::std::uint8_t> bytes;
+};
+
+// Spans of a thread not yet written to the trace.
+struct TraceBuffer {
+  TraceBuffer();
+  ~TraceBuffer();
+
+  // Returns the buffered spans, and empties the buffer.
+  TraceSpans take() {
+    ::std::lock_guard<::std::mutex> lock(mutex);
+    return ::std::exchange(spans, {});
+  }
+
+  // Trace the buffer is registered with, if any.
+  ::std::atomic<ChromeTrace*> trace = nullptr;
+  const int tid;
+  ::std::mutex mutex;
+  TraceSpans spans;
+};
+
+inline void write_micros(
+    ::std::ostream& os, ::std::chrono::duration<double, ::std::micro> time) {
+  char buf[32];
+  const auto result = ::std::to_chars(buf, buf + sizeof(buf), time.count(),
+                                      ::std::chars_format::fixed, 3);
+  os.write(buf, result.ptr - buf);
+}
+
+inline int trace_pid() {
+#ifdef _WIN32
+  return _getpid();
+#else
+  return getpid();
+#endif
+}
+
+inline TraceBuffer& trace_buffer() {
+  static thread_local TraceBuffer buffer;
+  return buffer;
+}
+
+template <class D>
+void end_span(::std::string_view name, const D& dump, ::std::uint64_t begin,
+              ::std::uint64_t end);
+
+}  // namespace internal_dump
+
+class ChromeTrace {
+ public:
+  // Starts a trace written to `os`, by chunks of the spans of a thread, of
+  // about `buffer_size` bytes.
+  explicit ChromeTrace(::std::ostream& os,
+                       ::std::size_t buffer_size = 64 * 1024):
+      os_(os),
+      buffer_size_(buffer_size),
+      origin_(TscClock::now()) {
+    ::std::lock_guard<::std::mutex> lock(internal_dump::trace_mutex());
+    os_ << "[\n";
+    internal_dump::active_trace().store(this, ::std::memory_order_release);
+  }
+
+  ChromeTrace(const ChromeTrace&) = delete;
+  ChromeTrace& operator=(const ChromeTrace&) = delete;
+
+  // Writes the buffered events of all threads, and ends the trace.
+  ~ChromeTrace() {
+    ::std::lock_guard<::std::mutex> lock(internal_dump::trace_mutex());
+    internal_dump::active_trace().store(nullptr, ::std::memory_order_release);
+    for (internal_dump::TraceBuffer* buffer : buffers_) {
+      write_(buffer->take(), buffer->tid);
+      buffer->trace.store(nullptr, ::std::memory_order_relaxed);
+    }
+    os_ << "\n]\n";
+    os_.flush();
+  }
+
+  // Writes the buffered events of all threads.
+  void flush() {
+    ::std::lock_guard<::std::mutex> lock(internal_dump::trace_mutex());
+    for (internal_dump::TraceBuffer* buffer : buffers_) {
+      write_(buffer->take(), buffer->tid);
+    }
+    os_.flush();
+  }
+
+ private:
+  friend struct internal_dump::TraceBuffer;
+  template <class D>
+  friend void internal_dump::end_span(::std::string_view name, const D& dump,
+                                      ::std::uint64_t begin,
+                                      ::std::uint64_t end);
+
+  // Writes `spans` of the thread `tid` as events, separated by `,\n`.
+  void write_(const internal_dump::TraceSpans& spans, int tid) {
+    if (spans.empty()) return;
+    const TscClock::Calibration c = TscClock::calibration();
+    const int pid = internal_dump::trace_pid();
+    ::std::size_t offset = 0;
+    for (const internal_dump::TraceSpanEntry& span : spans.entries) {
+      if (separator_) os_ << ",\n";
+      separator_ = true;
+      os_ << "{\"name\":";
+      internal_dump::write_json_string(
+          os_, ::std::string_view(
+                   reinterpret_cast<const char*>(spans.bytes.data()) + offset,
+                   span.name_size));
+      offset += span.name_size;
+      os_ << ",\"cat\":\"dump\",\"ph\":\"X\",\"ts\":";
+      internal_dump::write_micros(
+          os_, TscClock::duration(
+                   static_cast<::std::int64_t>(span.begin - origin_), c));
+      os_ << ",\"dur\":";
+      internal_dump::write_micros(
+          os_, TscClock::duration(
+                   static_cast<::std::int64_t>(span.end - span.begin), c));
+      os_ << ",\"pid\":" << pid << ",\"tid\":" << tid << ",\"args\":{";
+      internal_dump::BinlogInput in(::std::span<const ::std::uint8_t>(
+          spans.bytes.data() + offset, span.values_size));
+      offset += span.values_size;
+      const internal_dump::DumpNames keys = span.site->json_keys;
+      for (::std::size_t i = 0; i < keys.size(); ++i) {
+        if (i != 0) os_.put(',');
+        os_.write(keys[i].data(), keys[i].size());
+        internal_dump::visit_binlog_value(
+            in, span.types[i], nullptr,
+            [&](const auto& value) { internal_dump::write_json(os_, value); });
+      }
+      os_ << "}}";
+    }
+  }
+
+  ::std::ostream& os_;
+  const ::std::size_t buffer_size_;
+  // Event times are relative to the start of the trace, in ticks.
+  const ::std::uint64_t origin_;
+  ::std::unordered_set<internal_dump::TraceBuffer*> buffers_;
+  bool separator_ = false;
+};
+
+namespace internal_dump {
+
+inline TraceBuffer::TraceBuffer(): tid([] {
+  static ::std::atomic<int> next_tid = 1;
+  return next_tid.fetch_add(1, ::std::memory_order_relaxed);
+}()) {}
+
+inline TraceBuffer::~TraceBuffer() {
+  ::std::lock_guard<::std::mutex> lock(trace_mutex());
+  if (ChromeTrace* t = trace.load(::std::memory_order_relaxed)) {
+    t->write_(take(), tid);
+    t->buffers_.erase(this);
+  }
+}
+
+template <class D>
+void end_span(::std::string_view name, const D& dump, ::std::uint64_t begin,
+              ::std::uint64_t end) {
+  ChromeTrace* trace = active_trace().load(::std::memory_order_acquire);
+  if (trace == nullptr) return;
+  TraceBuffer& buffer = trace_buffer();
+  if (buffer.trace.load(::std::memory_order_relaxed) != trace) {
+    ::std::lock_guard<::std::mutex> lock(trace_mutex());
+    if (active_trace().load(::std::memory_order_relaxed) != trace) return;
+    trace->buffers_.insert(&buffer);
+    buffer.trace.store(trace, ::std::memory_order_relaxed);
+  }
+  TraceSpans full;
+  {
+    ::std::lock_guard<::std::mutex> lock(buffer.mutex);
+    dump.visit([&](const auto&... values) {
+      buffer.spans.add(name, dump.site(), begin, end, values...);
+    });
+    if (buffer.spans.size() >= trace->buffer_size_) {
+      full = ::std::exchange(buffer.spans, {});
+    }
+  }
+  if (!full.empty()) {
+    ::std::lock_guard<::std::mutex> lock(trace_mutex());
+    if (ChromeTrace* t = buffer.trace.load(::std::memory_order_relaxed)) {
+      t->write_(full, buffer.tid);
+    }
+  }
+}
+
+}  // namespace internal_dump
+
+// Records the time from its construction to its destruction, see DUMP_SPAN().
+template <class D>
+class TraceSpan {
+ public:
+  TraceSpan(::std::string_view name, D&& dump):
+      name_(name),
+      dump_(::std::move(dump)),
+      begin_(TscClock::now()) {}
+
+  TraceSpan(const TraceSpan&) = delete;
+  TraceSpan& operator=(const TraceSpan&) = delete;
+
+  ~TraceSpan() {
+    internal_dump::end_span(name_, dump_, begin_, TscClock::now());
+  }
+
+ private:
+  const ::std::string_view name_;
+  const D dump_;
+  const ::std::uint64_t begin_;
+};
+
+template <class D>
+TraceSpan(::std::string_view, D&&) -> TraceSpan<D>;
+
+}  // namespace dump
+
+#endif // DUMP_TRACE_HPP_
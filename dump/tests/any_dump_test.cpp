@@ -0,0 +1,95 @@
+// Copyright 2010-2022 Google LLC
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "dump/any_dump.hpp"
+
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "dump/dump.hpp"
+#include "gtest/gtest.h"
+
+namespace dump {
+namespace {
+
+template <class T>
+::std::string ToString(const T& t) {
+  ::std::ostringstream oss;
+  oss << t;
+  return oss.str();
+}
+
+TEST(AnyDump, Empty) {
+  AnyDump d;
+  EXPECT_TRUE(d.empty());
+  EXPECT_EQ("", ToString(d));
+  EXPECT_EQ("", d.str());
+  EXPECT_TRUE(AnyDump(DUMP()).str().empty());
+}
+
+TEST(AnyDump, Heterogeneous) {
+  int foo = 42;
+  int bar = 24;
+  const ::std::string baz = "hello";
+  ::std::vector<AnyDump> records;
+  records.emplace_back(DUMP(foo, bar));
+  records.emplace_back(DUMP(baz).as("qux"));
+  records.push_back(DUMP(2 + 2));
+  ASSERT_EQ(3, records.size());
+  EXPECT_EQ("foo = 42, bar = 24", ToString(records[0]));
+  EXPECT_EQ("qux = hello", records[1].str());
+  EXPECT_EQ("2 + 2 = 4", records[2].str());
+}
+
+TEST(AnyDump, Move) {
+  int a = 1;
+  AnyDump d = DUMP(a);
+  AnyDump e = ::std::move(d);
+  EXPECT_TRUE(d.empty());
+  EXPECT_EQ("a = 1", e.str());
+  d = ::std::move(e);
+  EXPECT_TRUE(e.empty());
+  EXPECT_EQ("a = 1", d.str());
+  d.reset();
+  EXPECT_TRUE(d.empty());
+}
+
+TEST(AnyDump, LazyEvaluation) {
+  int n = 0;
+  auto F = [&]() { return ++n; };
+  AnyDump d = DUMP(F());
+  EXPECT_EQ(0, n);
+  EXPECT_EQ("F() = 1", d.str());
+  EXPECT_EQ("F() = 2", d.str());
+  EXPECT_EQ(2, n);
+}
+
+TEST(AnyDump, ManyArgs) {
+  int a = 1, b = 2, c = 3, d = 5, e = 7, f = 11, g = 13, h = 17;
+  AnyDump any = DUMP(a, b, c, d, e, f, g, h);
+  EXPECT_EQ("a = 1, b = 2, c = 3, d = 5, e = 7, f = 11, g = 13, h = 17",
+            any.str());
+}
+
+TEST(AnyDump, Capacity) {
+  const ::std::string s(64, 'x');
+  BasicAnyDump<512> big = DUMP(s).as("s");
+  EXPECT_EQ("s = " + s, big.str());
+  EXPECT_LE(sizeof(AnyDump),
+            kAnyDumpCapacity + alignof(::std::max_align_t));
+}
+
+}  // namespace
+}  // namespace dump
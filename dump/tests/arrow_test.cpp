@@ -0,0 +1,235 @@
+// Copyright 2010-2022 Google LLC
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "dump/arrow.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "dump/dump.hpp"
+#include "gtest/gtest.h"
+
+namespace dump {
+namespace {
+
+template <class T>
+T Read(const ::std::string& bytes, ::std::size_t pos) {
+  T value;
+  ::std::memcpy(&value, bytes.data() + pos, sizeof(T));
+  return value;
+}
+
+// Just enough of a FlatBuffers reader to check what ArrowSink writes.
+struct Table {
+  // Returns the position of field `id`, or 0 if it is absent.
+  ::std::size_t field(int id) const {
+    const ::std::size_t vtable = pos - Read<::std::int32_t>(bytes, pos);
+    if (4 + 2 * id >= Read<::std::uint16_t>(bytes, vtable)) return 0;
+    const auto offset = Read<::std::uint16_t>(bytes, vtable + 4 + 2 * id);
+    return offset == 0 ? 0 : pos + offset;
+  }
+
+  template <class T>
+  T scalar(int id) const {
+    return field(id) == 0 ? T{} : Read<T>(bytes, field(id));
+  }
+
+  ::std::size_t deref(int id) const {
+    return field(id) + Read<::std::uint32_t>(bytes, field(id));
+  }
+
+  Table child(int id) const { return {bytes, deref(id)}; }
+
+  ::std::string_view string(int id) const {
+    return ::std::string_view(bytes).substr(
+        deref(id) + 4, Read<::std::uint32_t>(bytes, deref(id)));
+  }
+
+  ::std::size_t size(int id) const {
+    return Read<::std::uint32_t>(bytes, deref(id));
+  }
+
+  Table table(int id, ::std::size_t i) const {
+    const ::std::size_t element = deref(id) + 4 + 4 * i;
+    return {bytes, element + Read<::std::uint32_t>(bytes, element)};
+  }
+
+  // Element `i` of a vector of structs of `size` bytes.
+  ::std::size_t element(int id, ::std::size_t i, ::std::size_t size) const {
+    return deref(id) + 4 + size * i;
+  }
+
+  const ::std::string& bytes;
+  ::std::size_t pos;
+};
+
+Table Root(const ::std::string& bytes, ::std::size_t pos) {
+  return {bytes, pos + Read<::std::uint32_t>(bytes, pos)};
+}
+
+class ArrowSinkTest : public ::testing::Test {
+ protected:
+  // Opens streams to buffers that outlive the sink.
+  ArrowSink::Open Open() {
+    return [this](const internal_dump::DumpSite&, internal_dump::DumpNames) {
+      files_.push_back(::std::make_unique<::std::stringbuf>());
+      return ::std::make_unique<::std::ostream>(files_.back().get());
+    };
+  }
+
+  ::std::string File(::std::size_t i) const { return files_[i]->str(); }
+
+  ::std::vector<::std::unique_ptr<::std::stringbuf>> files_;
+};
+
+TEST_F(ArrowSinkTest, File) {
+  ArrowSink arrow(Open(), {.batch_rows=2});
+  for (int i = 0; i < 5; ++i) {
+    bool b = i % 2 == 0;
+    double d = i / 2.0;
+    ::std::string s(i, 'x');
+    arrow << DUMP(i, b, d, s);
+  }
+  arrow.close();
+  ASSERT_EQ(1u, files_.size());
+  const ::std::string file = File(0);
+  EXPECT_EQ(::std::string_view("ARROW1\0\0", 8), file.substr(0, 8));
+  EXPECT_EQ("ARROW1", file.substr(file.size() - 6));
+
+  const ::std::size_t footer_size =
+      Read<::std::int32_t>(file, file.size() - 10);
+  const Table footer = Root(file, file.size() - 10 - footer_size);
+  EXPECT_EQ(4, footer.scalar<::std::int16_t>(0));
+  const Table schema = footer.child(1);
+  ASSERT_EQ(4u, schema.size(1));
+  const char* names[] = {"i", "b", "d", "s"};
+  const ::std::uint8_t types[] = {2, 6, 3, 5};
+  for (int n = 0; n < 4; ++n) {
+    EXPECT_EQ(names[n], schema.table(1, n).string(0));
+    EXPECT_EQ(types[n], schema.table(1, n).scalar<::std::uint8_t>(2));
+  }
+  const Table int_type = schema.table(1, 0).child(3);
+  EXPECT_EQ(32, int_type.scalar<::std::int32_t>(0));
+  EXPECT_TRUE(int_type.scalar<bool>(1));
+  EXPECT_EQ(2, schema.table(1, 2).child(3).scalar<::std::int16_t>(0));
+
+  // Batches of 2, 2 and 1 rows.
+  ASSERT_EQ(3u, footer.size(3));
+  const ::std::size_t block = footer.element(3, 2, 24);
+  const ::std::size_t offset = Read<::std::int64_t>(file, block);
+  const ::std::size_t metadata_size = Read<::std::int32_t>(file, block + 8);
+  EXPECT_EQ(0xFFFFFFFF, Read<::std::uint32_t>(file, offset));
+  const Table message = Root(file, offset + 8);
+  EXPECT_EQ(3, message.scalar<::std::uint8_t>(1));
+  EXPECT_EQ(Read<::std::int64_t>(file, block + 16),
+            message.scalar<::std::int64_t>(3));
+  const Table batch = message.child(2);
+  EXPECT_EQ(1, batch.scalar<::std::int64_t>(0));
+  // Validity and values for i, b and d, then validity, offsets and chars.
+  ASSERT_EQ(4u, batch.size(1));
+  ASSERT_EQ(9u, batch.size(2));
+  const ::std::size_t body = offset + metadata_size;
+  const auto buffer = [&](int n) {
+    return body + Read<::std::int64_t>(file, batch.element(2, n, 16));
+  };
+  EXPECT_EQ(4, Read<::std::int32_t>(file, buffer(1)));
+  EXPECT_EQ(1, Read<::std::uint8_t>(file, buffer(3)));
+  EXPECT_EQ(2.0, Read<double>(file, buffer(5)));
+  EXPECT_EQ(4, Read<::std::int32_t>(file, buffer(7) + 4));
+  EXPECT_EQ("xxxx", file.substr(buffer(8), 4));
+}
+
+TEST_F(ArrowSinkTest, Stream) {
+  ArrowSink arrow(Open(), {.stream=true});
+  for (int i = 0; i < 3; ++i) {
+    arrow << DUMP(i);
+  }
+  arrow.flush();
+  // The schema, then the batch.
+  ::std::string stream = File(0);
+  ASSERT_EQ(0u, stream.size() % 8);
+  EXPECT_EQ(0xFFFFFFFF, Read<::std::uint32_t>(stream, 0));
+  EXPECT_EQ(1, Root(stream, 8).scalar<::std::uint8_t>(1));
+  const ::std::size_t batch = 8 + Read<::std::int32_t>(stream, 4);
+  EXPECT_EQ(3, Root(stream, batch + 8).scalar<::std::uint8_t>(1));
+  EXPECT_EQ(3, Root(stream, batch + 8).child(2).scalar<::std::int64_t>(0));
+
+  arrow.close();
+  stream = File(0);
+  EXPECT_EQ(::std::string_view("\xFF\xFF\xFF\xFF\0\0\0\0", 8),
+            stream.substr(stream.size() - 8));
+}
+
+TEST_F(ArrowSinkTest, TablePerSite) {
+  ArrowSink arrow(Open(), {.stream=true});
+  int x = 1;
+  ::std::string y = "y";
+  arrow << DUMP(x);
+  arrow << DUMP(y) << DUMP(x).as("z");
+  arrow.close();
+  ASSERT_EQ(3u, files_.size());
+  const char* names[] = {"x", "y", "z"};
+  const ::std::uint8_t types[] = {2, 5, 2};
+  for (int n = 0; n < 3; ++n) {
+    const ::std::string stream = File(n);
+    const Table schema = Root(stream, 8).child(2);
+    EXPECT_EQ(names[n], schema.table(1, 0).string(0));
+    EXPECT_EQ(types[n], schema.table(1, 0).scalar<::std::uint8_t>(2));
+  }
+}
+
+TEST_F(ArrowSinkTest, Renamed) {
+  ArrowSink arrow(Open(), {.stream=true});
+  int x = 1;
+  for (const char* name : {"a", "b", "a"}) {
+    arrow << DUMP(x).as(name);
+  }
+  arrow.close();
+  // One table per set of names.
+  ASSERT_EQ(2u, files_.size());
+  const char* names[] = {"a", "b"};
+  for (int n = 0; n < 2; ++n) {
+    const ::std::string stream = File(n);
+    EXPECT_EQ(names[n], Root(stream, 8).child(2).table(1, 0).string(0));
+  }
+}
+
+TEST_F(ArrowSinkTest, Dropped) {
+  ::std::stringbuf file;
+  int opened = 0;
+  ArrowSink arrow([&](const internal_dump::DumpSite&,
+                      internal_dump::DumpNames names)
+                      -> ::std::unique_ptr<::std::ostream> {
+    ++opened;
+    if (names[0] == "x") return nullptr;
+    return ::std::make_unique<::std::ostream>(&file);
+  }, {.stream=true});
+  int x = 1;
+  int y = 2;
+  for (int i = 0; i < 2; ++i) {
+    arrow << DUMP(x) << DUMP(y);
+  }
+  arrow.close();
+  // Tables without a stream are only opened once.
+  EXPECT_EQ(2, opened);
+  const ::std::string stream = file.str();
+  EXPECT_EQ("y", Root(stream, 8).child(2).table(1, 0).string(0));
+}
+
+}  // namespace
+}  // namespace dump
@@ -0,0 +1,530 @@
+// Copyright 2010-2022 Google LLC
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "dump/async.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <new>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "dump/dump.hpp"
+#include "dump/sink.hpp"
+#include "gtest/gtest.h"
+#include "test_sinks.hpp"
+
+namespace dump {
+namespace {
+
+using ::dump::tests::GatedSink;
+using ::dump::tests::RecordingSink;
+
+// Takes some time to write.
+class SlowSink : public Sink {
+ public:
+  void write(::std::string_view) override {
+    ::std::this_thread::sleep_for(::std::chrono::microseconds(50));
+    writes.fetch_add(1);
+  }
+
+  ::std::atomic<int> writes = 0;
+};
+
+// Writes a record, and waits for the background thread to be blocked writing
+// it, holding its slot.
+template <class S>
+void Block(S& async, GatedSink& sink) {
+  int i = 0;
+  async << DUMP(i);
+  sink.entered.wait(false);
+}
+
+template <class S>
+void ExpectWrites(AsyncOptions options = {}) {
+  RecordingSink sink;
+  {
+    S async(sink, options);
+    int foo = 42;
+    ::std::string bar = "hello";
+    async << DUMP(foo, bar);
+    foo = 24;
+    bar = "world";
+    async << DUMP(foo, bar).as("baz", "qux");
+    async.flush();
+    EXPECT_EQ("foo = 42, bar = hello\nbaz = 24, qux = world\n", sink.out);
+    EXPECT_EQ(1, sink.flushes);
+    async << DUMP(foo);
+  }
+  EXPECT_EQ("foo = 42, bar = hello\nbaz = 24, qux = world\nfoo = 24\n",
+            sink.out);
+  EXPECT_EQ(2, sink.flushes);
+}
+
+// Checks that records of each thread are written in order, with small rings
+// which fill up.
+template <class S>
+void ExpectThreads(AsyncOptions options = {.capacity=16, .batch_size=256}) {
+  constexpr int kThreads = 4;
+  constexpr int kRecords = 10000;
+  RecordingSink sink;
+  {
+    S async(sink, options);
+    ::std::vector<::std::thread> threads;
+    for (int t = 0; t < kThreads; ++t) {
+      threads.emplace_back([&async, t] {
+        for (int i = 0; i < kRecords; ++i) {
+          async << DUMP(t, i);
+          if (i % 1000 == 0) async.flush();
+        }
+      });
+    }
+    for (::std::thread& thread : threads) thread.join();
+  }
+  ::std::istringstream lines(sink.out);
+  ::std::map<int, int> next;
+  int count = 0;
+  for (::std::string line; ::std::getline(lines, line); ++count) {
+    int t;
+    int i;
+    ASSERT_EQ(2, ::std::sscanf(line.c_str(), "t = %d, i = %d", &t, &i));
+    EXPECT_EQ(next[t]++, i);
+  }
+  EXPECT_EQ(kThreads * kRecords, count);
+}
+
+TEST(AsyncSink, Writes) { ExpectWrites<AsyncSink>(); }
+
+TEST(AsyncSink, Temporaries) {
+  RecordingSink sink;
+  {
+    AsyncSink async(sink);
+    for (int i = 0; i < 3; ++i) {
+      async << DUMP(::std::to_string(i) + "!");
+    }
+  }
+  EXPECT_EQ(
+      "::std::to_string(i) + \"!\" = 0!\n"
+      "::std::to_string(i) + \"!\" = 1!\n"
+      "::std::to_string(i) + \"!\" = 2!\n",
+      sink.out);
+}
+
+// Names given with as() may be gone by the time the record is written.
+template <class S>
+void ExpectShortLivedNames() {
+  GatedSink sink;
+  {
+    S async(sink);
+    Block(async, sink);
+    int foo = 42;
+    {
+      ::std::string name = "renamed";
+      async << DUMP(foo).as(::std::string_view(name));
+      name.assign(name.size(), 'x');
+    }
+    sink.open.store(true);
+    sink.open.notify_all();
+    async.flush();
+  }
+  EXPECT_EQ("i = 0\nrenamed = 42\n", sink.out);
+}
+
+TEST(AsyncSink, ShortLivedNames) { ExpectShortLivedNames<AsyncSink>(); }
+
+TEST(PerThreadAsyncSink, ShortLivedNames) {
+  ExpectShortLivedNames<PerThreadAsyncSink>();
+}
+
+TEST(AsyncSink, Threads) { ExpectThreads<AsyncSink>(); }
+
+TEST(AsyncSink, FormatThreads) {
+  ExpectWrites<AsyncSink>({.format_threads=2});
+  ExpectThreads<AsyncSink>(
+      {.capacity=16, .batch_size=256, .format_threads=3, .format_batch=7});
+}
+
+TEST(AsyncSink, Wait) {
+  for (AsyncWait wait : {AsyncWait::kSpin, AsyncWait::kAdaptive}) {
+    ExpectWrites<AsyncSink>({.wait=wait});
+    ExpectThreads<AsyncSink>({.capacity=16, .batch_size=256, .wait=wait});
+  }
+}
+
+TEST(AsyncSink, AdaptiveBatching) {
+  ExpectWrites<AsyncSink>({.adaptive_batching=true});
+  ExpectThreads<AsyncSink>(
+      {.capacity=16, .batch_size=256, .adaptive_batching=true});
+}
+
+// Writes cover what arrives during 8 writes, at most the max size.
+TEST(AsyncBatcher, Target) {
+  internal_dump::AsyncBatcher batcher(1 << 16, ::std::chrono::seconds(1));
+  EXPECT_EQ(1u << 16, batcher.target());
+  // Records of 10 bytes every 100 ticks, and writes taking 1000 ticks.
+  for (::std::uint64_t i = 0; i < 400; ++i) {
+    batcher.add(10, 1000 + 100 * i);
+    if (i % 2 == 1) batcher.written(1000);
+  }
+  EXPECT_NEAR(8.0 * 1000 / 100 * 10, batcher.target(), 8);
+  // Records arriving faster than the sink takes writes are written together.
+  for (::std::uint64_t i = 0; i < 400; ++i) batcher.written(1000000);
+  EXPECT_EQ(1u << 16, batcher.target());
+  // Records arriving slower are written at once.
+  for (::std::uint64_t i = 0; i < 400; ++i) {
+    batcher.add(10, 100000 + 1000000 * i);
+    batcher.written(1000);
+  }
+  EXPECT_EQ(0u, batcher.target());
+}
+
+// Pending records wait for the target if they should reach it soon.
+TEST(AsyncBatcher, HoldUntil) {
+  internal_dump::AsyncBatcher batcher(1 << 16, ::std::chrono::seconds(1));
+  constexpr ::std::uint64_t kNow = 1000000;
+  // Nothing is known of the load yet.
+  EXPECT_EQ(0u, batcher.hold_until(10, kNow, kNow));
+  for (::std::uint64_t i = 0; i < 400; ++i) {
+    batcher.add(10, 1000 + 100 * i);
+    batcher.written(1000);
+  }
+  const ::std::size_t target = batcher.target();
+  ASSERT_NEAR(800, target, 8);
+  EXPECT_EQ(0u, batcher.hold_until(target, kNow, kNow));
+  // 40 more records, at 100 ticks each, with twice that as margin.
+  const ::std::size_t size = target - 400;
+  EXPECT_NEAR(kNow + 8000, batcher.hold_until(size, kNow, kNow), 100);
+  // Never after the max delay since the oldest record.
+  internal_dump::AsyncBatcher hasty(1 << 16, ::std::chrono::nanoseconds(1));
+  for (::std::uint64_t i = 0; i < 400; ++i) {
+    hasty.add(10, 1000 + 100 * i);
+    hasty.written(1000);
+  }
+  EXPECT_EQ(0u, hasty.hold_until(size, kNow, kNow));
+}
+
+// A lone record is written without waiting for a flush.
+TEST(AsyncSink, AdaptiveBatchingIdle) {
+  SlowSink sink;
+  AsyncSink async(sink, {.adaptive_batching=true,
+                         .max_delay=::std::chrono::milliseconds(10)});
+  for (int i = 0; i < 3; ++i) {
+    async << DUMP(i);
+    const auto begin = ::std::chrono::steady_clock::now();
+    while (sink.writes.load() == i) {
+      ASSERT_LT(::std::chrono::steady_clock::now() - begin,
+                ::std::chrono::seconds(1));
+      ::std::this_thread::yield();
+    }
+  }
+}
+
+TEST(PerThreadAsyncSink, Writes) { ExpectWrites<PerThreadAsyncSink>(); }
+
+TEST(PerThreadAsyncSink, Threads) { ExpectThreads<PerThreadAsyncSink>(); }
+
+TEST(PerThreadAsyncSink, FormatThreads) {
+  ExpectWrites<PerThreadAsyncSink>({.format_threads=2});
+  ExpectThreads<PerThreadAsyncSink>(
+      {.capacity=16, .batch_size=256, .format_threads=3, .format_batch=7});
+}
+
+TEST(PerThreadAsyncSink, Wait) {
+  for (AsyncWait wait : {AsyncWait::kSpin, AsyncWait::kAdaptive}) {
+    ExpectWrites<PerThreadAsyncSink>({.wait=wait});
+    ExpectThreads<PerThreadAsyncSink>(
+        {.capacity=16, .batch_size=256, .wait=wait});
+  }
+}
+
+TEST(PerThreadAsyncSink, Pinned) {
+  ExpectWrites<PerThreadAsyncSink>({.cpus=NumaTopology::system().cpus(0)});
+}
+
+TEST(PerThreadAsyncSink, MergesByStamp) {
+  RecordingSink sink;
+  {
+    PerThreadAsyncSink async(sink);
+    // Each thread writes to its own ring, all before the next one starts.
+    for (int t = 0; t < 8; ++t) {
+      ::std::thread([&async, t] {
+        for (int i = 0; i < 3; ++i) async << DUMP(t, i);
+      }).join();
+    }
+  }
+  ::std::string expected;
+  for (int t = 0; t < 8; ++t) {
+    for (int i = 0; i < 3; ++i) expected += DUMP(t, i).str() + "\n";
+  }
+  EXPECT_EQ(expected, sink.out);
+}
+
+TEST(PerThreadAsyncSink, Sinks) {
+  RecordingSink a;
+  RecordingSink b;
+  {
+    PerThreadAsyncSink async_a(a);
+    int x = 1;
+    async_a << DUMP(x);
+    {
+      PerThreadAsyncSink async_b(b);
+      async_b << DUMP(x);
+    }
+    // A new sink gets a new ring, where the destroyed one was.
+    PerThreadAsyncSink async_b(b);
+    async_b << DUMP(x);
+    async_a << DUMP(x);
+  }
+  EXPECT_EQ("x = 1\nx = 1\n", a.out);
+  EXPECT_EQ("x = 1\nx = 1\n", b.out);
+}
+
+// Records 1 to 4 fill the ring, the others overflow.
+template <class S>
+void ExpectDropNewest() {
+  GatedSink sink;
+  int line;
+  {
+    S async(sink, {.capacity=4, .batch_size=1,
+                   .overflow=AsyncOverflow::kDropNewest});
+    Block(async, sink);
+    for (int i = 1; i < 10; ++i) {
+      async << DUMP(i);
+    }
+    line = __LINE__ - 2;
+    EXPECT_EQ(5u, async.dropped());
+    const auto dropped = async.dropped_by_site();
+    ASSERT_EQ(1u, dropped.size());
+    EXPECT_EQ(line, dropped[0].first->line);
+    EXPECT_EQ(5u, dropped[0].second);
+    sink.open.store(true);
+    sink.open.notify_all();
+  }
+  EXPECT_EQ("i = 0\ndropped 5 records from async_test.cpp:" +
+                ::std::to_string(line) + "\ni = 1\ni = 2\ni = 3\ni = 4\n",
+            sink.out);
+}
+
+template <class S>
+void ExpectDropOldest() {
+  GatedSink sink;
+  int line;
+  {
+    S async(sink, {.capacity=4, .batch_size=1,
+                   .overflow=AsyncOverflow::kDropOldest});
+    Block(async, sink);
+    for (int i = 1; i < 10; ++i) {
+      async << DUMP(i);
+    }
+    line = __LINE__ - 2;
+    EXPECT_EQ(5u, async.dropped());
+    sink.open.store(true);
+    sink.open.notify_all();
+  }
+  EXPECT_EQ("i = 0\ndropped 5 records from async_test.cpp:" +
+                ::std::to_string(line) + "\ni = 6\ni = 7\ni = 8\ni = 9\n",
+            sink.out);
+}
+
+template <class S>
+void ExpectSample() {
+  GatedSink sink;
+  {
+    S async(sink, {.capacity=4, .batch_size=1,
+                   .overflow=AsyncOverflow::kSample, .sample_rate=3});
+    Block(async, sink);
+    // Records 5 and 6 are dropped, 7 waits for room.
+    ::std::thread producer([&async] {
+      for (int i = 1; i < 8; ++i) async << DUMP(i);
+    });
+    while (async.dropped() != 2) ::std::this_thread::yield();
+    sink.open.store(true);
+    sink.open.notify_all();
+    producer.join();
+    EXPECT_EQ(2u, async.dropped());
+  }
+  EXPECT_NE(::std::string::npos, sink.out.find("dropped 2 records from"));
+  EXPECT_NE(::std::string::npos,
+            sink.out.find("\ni = 1\ni = 2\ni = 3\ni = 4\ni = 7\n"));
+}
+
+// The error record bypasses the records queued while the background thread
+// is blocked, and is flushed at once.
+template <class S>
+void ExpectUrgent() {
+  GatedSink sink;
+  {
+    S async(sink, {.batch_size=1});
+    Block(async, sink);
+    for (int i = 1; i < 3; ++i) async << DUMP(i);
+    int i = 3;
+    async.write(DUMP(i), Severity::kWarning);
+    const char* error = "disk full";
+    async.write(DUMP(error), Severity::kError);
+    sink.open.store(true);
+    sink.open.notify_all();
+    async.flush();
+    EXPECT_EQ(2, sink.flushes);
+  }
+  EXPECT_EQ("i = 0\nerror = disk full\ni = 1\ni = 2\ni = 3\n", sink.out);
+}
+
+::std::string UtcTime(::std::chrono::system_clock::time_point time) {
+  ::std::ostringstream oss;
+  internal_dump::write_utc_time(oss, time);
+  return oss.str();
+}
+
+// Throws when copied, like a string copy running out of memory.
+struct ThrowsOnCopy {
+  ThrowsOnCopy() = default;
+  ThrowsOnCopy(const ThrowsOnCopy&) { throw ::std::bad_alloc(); }
+  ThrowsOnCopy(ThrowsOnCopy&&) = default;
+};
+
+::std::ostream& operator<<(::std::ostream& os, const ThrowsOnCopy&) {
+  return os << "copied";
+}
+
+// A snapshot throwing after its slot is claimed must not stall the queue.
+template <class S>
+void ExpectThrowingSnapshot(AsyncOptions options) {
+  RecordingSink sink;
+  {
+    S async(sink, options);
+    ThrowsOnCopy bad;
+    int foo = 42;
+    for (int i = 0; i < 3; ++i) {
+      EXPECT_THROW(async.write(DUMP(bad), Severity::kError),
+                   ::std::bad_alloc);
+      EXPECT_THROW(async << DUMP(bad), ::std::bad_alloc);
+      async << DUMP(foo);
+    }
+    async.flush();
+    EXPECT_EQ("foo = 42\nfoo = 42\nfoo = 42\n", sink.out);
+  }
+}
+
+// Lines start with the time their record was queued at.
+template <class S>
+void ExpectTimestamps(AsyncOptions options) {
+  options.timestamps = true;
+  RecordingSink sink;
+  // Lines and bounds convert with this calibration, good for a second: the
+  // bounds hold whatever its error against the system clock. The margin is
+  // for a recalibration meanwhile, on a loaded machine.
+  TscClock::recalibrate();
+  const ::std::uint64_t begin = TscClock::now();
+  {
+    S async(sink, options);
+    for (int i = 0; i < 3; ++i) async << DUMP(i);
+    async.write(DUMP(options.timestamps), Severity::kError);
+  }
+  const ::std::uint64_t end = TscClock::now();
+  const auto margin = ::std::chrono::milliseconds(1);
+  const ::std::string before = UtcTime(TscClock::to_system(begin) - margin);
+  const ::std::string after = UtcTime(TscClock::to_system(end) + margin);
+  ::std::istringstream lines(sink.out);
+  ::std::vector<::std::string> fields;
+  for (::std::string line; ::std::getline(lines, line);) {
+    const ::std::string time = line.substr(0, before.size());
+    EXPECT_LE(before, time);
+    EXPECT_GE(after, time);
+    fields.push_back(line.substr(before.size()));
+  }
+  // The urgent record may come first.
+  ::std::sort(fields.begin(), fields.end());
+  EXPECT_EQ((::std::vector<::std::string>{" i = 0", " i = 1", " i = 2",
+                                           " options.timestamps = 1"}),
+            fields);
+}
+
+TEST(AsyncSink, Timestamps) {
+  ExpectTimestamps<AsyncSink>({});
+  ExpectTimestamps<AsyncSink>({.format_threads=2, .format_batch=2});
+}
+
+TEST(PerThreadAsyncSink, Timestamps) {
+  ExpectTimestamps<PerThreadAsyncSink>({});
+  ExpectTimestamps<PerThreadAsyncSink>({.format_threads=2, .format_batch=2});
+}
+
+TEST(AsyncSink, ThrowingSnapshot) {
+  // Small rings, which wrap around.
+  ExpectThrowingSnapshot<AsyncSink>({.capacity=2, .urgent_capacity=2});
+  ExpectThrowingSnapshot<AsyncSink>(
+      {.capacity=2, .urgent_capacity=2, .format_threads=2});
+}
+
+TEST(PerThreadAsyncSink, ThrowingSnapshot) {
+  ExpectThrowingSnapshot<PerThreadAsyncSink>(
+      {.capacity=2, .urgent_capacity=2});
+}
+
+TEST(AsyncSink, Urgent) { ExpectUrgent<AsyncSink>(); }
+
+TEST(PerThreadAsyncSink, Urgent) { ExpectUrgent<PerThreadAsyncSink>(); }
+
+TEST(NumaAsyncSink, Writes) {
+  const NumaTopology& topology = NumaTopology::system();
+  ::std::vector<RecordingSink> sinks(topology.nodes());
+  {
+    NumaAsyncSink async([&](::std::size_t node) -> Sink& {
+      return sinks[node];
+    });
+    EXPECT_EQ(topology.nodes(), async.nodes());
+    int foo = 42;
+    async << DUMP(foo);
+    async.flush();
+    EXPECT_EQ("foo = 42\n", sinks[topology.current_node()].out);
+  }
+  for (const RecordingSink& sink : sinks) EXPECT_EQ(2, sink.flushes);
+}
+
+TEST(AsyncSink, DropNewest) { ExpectDropNewest<AsyncSink>(); }
+
+TEST(AsyncSink, DropOldest) { ExpectDropOldest<AsyncSink>(); }
+
+TEST(AsyncSink, Sample) { ExpectSample<AsyncSink>(); }
+
+TEST(PerThreadAsyncSink, DropNewest) { ExpectDropNewest<PerThreadAsyncSink>(); }
+
+TEST(PerThreadAsyncSink, DropOldest) { ExpectDropOldest<PerThreadAsyncSink>(); }
+
+TEST(AsyncSink, FlushIsNotDropped) {
+  GatedSink sink;
+  {
+    AsyncSink async(sink, {.capacity=2, .batch_size=1,
+                           .overflow=AsyncOverflow::kDropNewest});
+    Block(async, sink);
+    int i = 1;
+    async << DUMP(i);
+    ::std::thread flusher([&async] { async.flush(); });
+    while (async.dropped() == 0) async << DUMP(i);
+    sink.open.store(true);
+    sink.open.notify_all();
+    // Returns, once the flush is written.
+    flusher.join();
+  }
+  EXPECT_EQ(0u, sink.out.find("i = 0\n"));
+}
+
+}  // namespace
+}  // namespace dump
@@ -0,0 +1,357 @@
+// Copyright 2010-2022 Google LLC
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "dump/binlog.hpp"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <limits>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "dump/clock.hpp"
+#include "dump/dump.hpp"
+#include "gtest/gtest.h"
+
+namespace dump {
+namespace {
+
+::std::string Decode(const ::std::vector<::std::uint8_t>& log) {
+  ::std::ostringstream oss;
+  BinlogReader reader;
+  EXPECT_TRUE(reader.decode(log, oss));
+  return oss.str();
+}
+
+struct Point {
+  int x;
+  int y;
+};
+
+::std::ostream& operator<<(::std::ostream& os, const Point& p) {
+  return os << '(' << p.x << ", " << p.y << ')';
+}
+
+TEST(Binlog, Empty) {
+  ::std::vector<::std::uint8_t> log;
+  BinlogWriter writer(log);
+  EXPECT_EQ("", Decode(log));
+  writer << DUMP();
+  EXPECT_EQ("\n", Decode(log));
+}
+
+TEST(Binlog, SameAsText) {
+  ::std::vector<::std::uint8_t> log;
+  BinlogWriter writer(log);
+  bool b = true;
+  char c = 'c';
+  ::std::int8_t i8 = -8;
+  ::std::uint16_t u16 = 16;
+  int i = -42;
+  unsigned long long ull = 1ull << 63;
+  float f = 1.25f;
+  double d = 3.14159265;
+  long double ld = 2.5;
+  ::std::string s = "hello";
+  ::std::string_view sv = "world";
+  const char* p = "!";
+  Point pt{1, 2};
+  ::std::string expected;
+  for (int n = 0; n < 2; ++n) {
+    writer << DUMP(b, c, i8, u16) << DUMP(i, ull, f, d, ld)
+           << DUMP(s, sv, p, pt);
+    expected += DUMP(b, c, i8, u16).str() + "\n" +
+                DUMP(i, ull, f, d, ld).str() + "\n" +
+                DUMP(s, sv, p, pt).str() + "\n";
+  }
+  EXPECT_EQ(expected, Decode(log));
+}
+
+TEST(Binlog, SchemaOncePerSite) {
+  ::std::vector<::std::uint8_t> log;
+  BinlogWriter writer(log);
+  ::std::vector<::std::size_t> sizes;
+  for (::std::int32_t a = 0; a < 3; ++a) {
+    writer << DUMP(a);
+    sizes.push_back(log.size());
+  }
+  // Kind, site ID and value.
+  EXPECT_EQ(1 + 1 + 1, sizes[2] - sizes[1]);
+  EXPECT_EQ(1 + 1 + 1, sizes[1] - sizes[0]);
+  EXPECT_EQ("a = 0\na = 1\na = 2\n", Decode(log));
+}
+
+TEST(Binlog, Varints) {
+  ::std::vector<::std::uint8_t> log;
+  BinlogWriter writer(log);
+  ::std::string expected;
+  const ::std::int64_t values[] = {0, 1, -1, 63, -64, 64, -65, 1 << 20,
+                                   ::std::numeric_limits<::std::int64_t>::max(),
+                                   ::std::numeric_limits<::std::int64_t>::min()};
+  for (::std::int64_t i : values) {
+    const ::std::int16_t i16 = static_cast<::std::int16_t>(i);
+    const ::std::uint32_t u32 = static_cast<::std::uint32_t>(i);
+    const ::std::uint64_t u64 = static_cast<::std::uint64_t>(i);
+    writer << DUMP(i, i16, u32, u64);
+    expected += DUMP(i, i16, u32, u64).str() + "\n";
+  }
+  EXPECT_EQ(expected, Decode(log));
+}
+
+TEST(Binlog, Delta) {
+  ::std::vector<::std::uint8_t> plain;
+  ::std::vector<::std::uint8_t> delta;
+  BinlogWriter plain_writer(plain);
+  BinlogWriter delta_writer(delta, {.delta = true});
+  ::std::string expected;
+  ::std::uint64_t timestamp = 1'700'000'000'000'000'000;
+  ::std::int32_t gauge = 1000;
+  for (::std::uint32_t counter = 0; counter < 100; ++counter) {
+    timestamp += 1000 + counter % 7;
+    gauge += counter % 2 == 0 ? -3 : 2;
+    plain_writer << DUMP(counter, timestamp, gauge);
+    delta_writer << DUMP(counter, timestamp, gauge);
+    expected += DUMP(counter, timestamp, gauge).str() + "\n";
+  }
+  EXPECT_EQ(expected, Decode(plain));
+  EXPECT_EQ(expected, Decode(delta));
+  EXPECT_LT(delta.size() * 2, plain.size());
+}
+
+TEST(Binlog, DeltaWraps) {
+  ::std::vector<::std::uint8_t> log;
+  BinlogWriter writer(log, {.delta = true});
+  ::std::string expected;
+  for (::std::uint64_t u : {::std::numeric_limits<::std::uint64_t>::max(),
+                            ::std::uint64_t{0},
+                            ::std::numeric_limits<::std::uint64_t>::max()}) {
+    const auto i = static_cast<::std::int64_t>(u ^ (u >> 1));
+    writer << DUMP(u, i);
+    expected += DUMP(u, i).str() + "\n";
+  }
+  EXPECT_EQ(expected, Decode(log));
+}
+
+TEST(Binlog, Dictionary) {
+  ::std::vector<::std::uint8_t> plain;
+  ::std::vector<::std::uint8_t> interned;
+  BinlogWriter plain_writer(plain);
+  BinlogWriter interned_writer(interned, {.dictionary_size = 16});
+  const ::std::string endpoints[] = {"/api/v1/users", "/api/v1/orders",
+                                     "/healthz"};
+  ::std::string expected;
+  for (int i = 0; i < 30; ++i) {
+    const ::std::string& endpoint = endpoints[i % 3];
+    const Point point{i % 2, 0};
+    plain_writer << DUMP(endpoint, point);
+    interned_writer << DUMP(endpoint, point);
+    expected += DUMP(endpoint, point).str() + "\n";
+  }
+  EXPECT_EQ(expected, Decode(plain));
+  EXPECT_EQ(expected, Decode(interned));
+  EXPECT_LT(interned.size() * 2, plain.size());
+}
+
+TEST(Binlog, DictionaryIsBounded) {
+  ::std::vector<::std::uint8_t> log;
+  BinlogWriter writer(log, {.dictionary_size = 2});
+  ::std::vector<::std::size_t> sizes = {log.size()};
+  ::std::string expected;
+  for (const char* s : {"a", "b", "c", "a", "b", "c", "d"}) {
+    writer << DUMP(s);
+    sizes.push_back(log.size());
+    expected += DUMP(s).str() + "\n";
+  }
+  EXPECT_EQ(expected, Decode(log));
+  // Kind, site ID, then tag and string.
+  EXPECT_EQ(1 + 1 + 1 + 2, sizes[2] - sizes[1]);
+  EXPECT_EQ(1 + 1 + 1 + 2, sizes[3] - sizes[2]);
+  // Kind, site ID and ID.
+  EXPECT_EQ(1 + 1 + 1, sizes[4] - sizes[3]);
+  EXPECT_EQ(1 + 1 + 1, sizes[5] - sizes[4]);
+  EXPECT_EQ(1 + 1 + 1 + 2, sizes[6] - sizes[5]);
+}
+
+TEST(Binlog, Segments) {
+  ::std::vector<::std::uint8_t> log;
+  BinlogWriter writer(log, {.delta = true, .dictionary_size = 16});
+  ::std::vector<::std::size_t> segments = {0};
+  ::std::string expected[3];
+  for (int segment = 0; segment < 3; ++segment) {
+    if (segment != 0) {
+      segments.push_back(log.size());
+      writer.new_segment();
+    }
+    for (int i = 0; i < 3; ++i) {
+      ::std::string s = "same";
+      int n = segment * 10 + i;
+      writer << DUMP(s, n);
+      expected[segment] += DUMP(s, n).str() + "\n";
+    }
+  }
+  // The whole log, then each segment on its own.
+  EXPECT_EQ(expected[0] + expected[1] + expected[2], Decode(log));
+  segments.push_back(log.size());
+  for (int segment = 0; segment < 3; ++segment) {
+    EXPECT_EQ(expected[segment],
+              Decode(::std::vector<::std::uint8_t>(
+                  log.begin() + segments[segment],
+                  log.begin() + segments[segment + 1])));
+  }
+  EXPECT_EQ(expected[1] + expected[2],
+            Decode(::std::vector<::std::uint8_t>(log.begin() + segments[1],
+                                                 log.end())));
+}
+
+TEST(Binlog, Renamed) {
+  ::std::vector<::std::uint8_t> log;
+  BinlogWriter writer(log);
+  int a = 1;
+  for (const char* name : {"x", "y", "x"}) {
+    auto vars = DUMP(a);
+    writer << vars << vars.as(name);
+  }
+  EXPECT_EQ("a = 1\nx = 1\na = 1\ny = 1\na = 1\nx = 1\n", Decode(log));
+}
+
+TEST(Binlog, ValuesAreCopied) {
+  ::std::vector<::std::uint8_t> log;
+  BinlogWriter writer(log);
+  ::std::string s = "before";
+  writer << DUMP(s);
+  s = "after";
+  EXPECT_EQ("s = before\n", Decode(log));
+}
+
+TEST(Binlog, Chunks) {
+  ::std::vector<::std::uint8_t> log;
+  BinlogWriter writer(log);
+  int a = 1;
+  writer << DUMP(a);
+  ::std::ostringstream oss;
+  BinlogReader reader(";", ":");
+  EXPECT_TRUE(reader.decode(log, oss));
+  log.clear();
+  int b = 2;
+  writer << DUMP(a, b);
+  EXPECT_TRUE(reader.decode(log, oss));
+  EXPECT_EQ("a:1\na:1;b:2\n", oss.str());
+}
+
+// Parses the UTC time of a line printed with timestamps.
+::std::chrono::system_clock::time_point ParseTime(const ::std::string& line) {
+  int year;
+  unsigned month;
+  unsigned day;
+  int hours;
+  int minutes;
+  int seconds;
+  long long nanoseconds;
+  EXPECT_EQ(7, ::std::sscanf(line.c_str(), "%d-%u-%uT%d:%d:%d.%lldZ ", &year,
+                             &month, &day, &hours, &minutes, &seconds,
+                             &nanoseconds))
+      << line;
+  return ::std::chrono::sys_days(::std::chrono::year(year) /
+                                 ::std::chrono::month(month) /
+                                 ::std::chrono::day(day)) +
+         ::std::chrono::duration_cast<::std::chrono::system_clock::duration>(
+             ::std::chrono::hours(hours) + ::std::chrono::minutes(minutes) +
+             ::std::chrono::seconds(seconds) +
+             ::std::chrono::nanoseconds(nanoseconds));
+}
+
+TEST(Binlog, Timestamps) {
+  ::std::vector<::std::uint8_t> log;
+  BinlogWriter writer(log, {.timestamps=true});
+  const auto before = ::std::chrono::system_clock::now();
+  int foo = 42;
+  writer << DUMP(foo);
+  ::std::this_thread::sleep_for(::std::chrono::milliseconds(10));
+  writer.new_segment();
+  writer << DUMP(foo) << DUMP(foo);
+  const auto after = ::std::chrono::system_clock::now();
+  ::std::istringstream lines(Decode(log));
+  ::std::vector<::std::chrono::system_clock::time_point> times;
+  for (::std::string line; ::std::getline(lines, line);) {
+    EXPECT_EQ(" foo = 42", line.substr(line.find('Z') + 1));
+    times.push_back(ParseTime(line));
+  }
+  ASSERT_EQ(3u, times.size());
+  const auto margin = ::std::chrono::milliseconds(1);
+  EXPECT_GT(times[0], before - margin);
+  EXPECT_GT(times[1] - times[0], ::std::chrono::milliseconds(10) - margin);
+  EXPECT_LE(times[1], times[2]);
+  EXPECT_LT(times[2], after + margin);
+}
+
+TEST(Binlog, Calibrations) {
+  // Kind, ticks, system time and rate.
+  constexpr ::std::size_t kCalibration = 1 + 8 + 8 + 8;
+  ::std::vector<::std::uint8_t> log;
+  BinlogWriter writer(log, {.timestamps=true});
+  // Calibrated when constructed, before the first record.
+  const ::std::size_t header = log.size();
+  EXPECT_EQ(3u, log[header - kCalibration]);
+  int foo = 42;
+  writer << DUMP(foo);
+  const ::std::size_t size = log.size();
+  // Written once made.
+  TscClock::recalibrate();
+  writer.calibrate();
+  EXPECT_EQ(size + kCalibration, log.size());
+  EXPECT_EQ(3u, log[size]);
+  writer << DUMP(foo);
+  ::std::istringstream lines(Decode(log));
+  int n = 0;
+  for (::std::string line; ::std::getline(lines, line); ++n) {
+    EXPECT_EQ(" foo = 42", line.substr(line.find('Z') + 1));
+  }
+  EXPECT_EQ(2, n);
+}
+
+TEST(Binlog, Malformed) {
+  ::std::vector<::std::uint8_t> log;
+  BinlogWriter writer(log);
+  ::std::ostringstream oss;
+  EXPECT_FALSE(BinlogReader().decode({}, oss));
+  EXPECT_FALSE(
+      BinlogReader().decode(::std::vector<::std::uint8_t>{'D', 'L'}, oss));
+  int a = 1;
+  writer << DUMP(a);
+  log.pop_back();
+  EXPECT_FALSE(BinlogReader().decode(log, oss));
+  log.push_back(0);
+  log.push_back(0xff);
+  EXPECT_FALSE(BinlogReader().decode(log, oss));
+  // Calibrations are only allowed with timestamps.
+  log.clear();
+  writer.new_segment();
+  log.push_back(3);
+  EXPECT_FALSE(BinlogReader().decode(log, oss));
+  // Bools are only 0 or 1.
+  log.clear();
+  writer.new_segment();
+  bool b = true;
+  writer << DUMP(b);
+  EXPECT_TRUE(BinlogReader().decode(log, oss));
+  log.back() = 2;
+  EXPECT_FALSE(BinlogReader().decode(log, oss));
+}
+
+}  // namespace
+}  // namespace dump
@@ -0,0 +1,215 @@
+// Copyright 2010-2022 Google LLC
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "dump/broadcast.hpp"
+
+#include <cstdint>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "dump/dump.hpp"
+#include "gtest/gtest.h"
+
+namespace dump {
+namespace {
+
+struct Point {
+  int x;
+  int y;
+};
+
+::std::ostream& operator<<(::std::ostream& os, const Point& p) {
+  return os << '(' << p.x << ", " << p.y << ')';
+}
+
+// Reads what is left for `reader`, a line per record.
+::std::string ReadAll(BroadcastReader& reader) {
+  ::std::string out;
+  BroadcastRecord record;
+  while (reader.read(record)) out += record.str() + "\n";
+  return out;
+}
+
+TEST(BroadcastRing, Empty) {
+  BroadcastRing ring;
+  BroadcastReader reader(ring);
+  BroadcastRecord record;
+  EXPECT_FALSE(reader.read(record));
+  EXPECT_EQ(0u, ring.written());
+}
+
+TEST(BroadcastRing, SameAsText) {
+  BroadcastRing ring;
+  BroadcastReader reader(ring);
+  bool b = true;
+  char c = 'x';
+  ::std::int8_t i8 = -8;
+  ::std::uint64_t u64 = ~::std::uint64_t{0};
+  double d = 3.25;
+  const char* s = "hello \"world\"";
+  Point p{1, 2};
+  ring << DUMP(b, c, i8, u64, d, s, p) << DUMP();
+  BroadcastRecord record;
+  ASSERT_TRUE(reader.read(record));
+  EXPECT_EQ(DUMP(b, c, i8, u64, d, s, p).str(), record.str());
+  EXPECT_EQ(DUMP(b, c, i8, u64, d, s, p).json().str(), record.json().str());
+  ASSERT_TRUE(reader.read(record));
+  EXPECT_EQ("", record.str());
+  EXPECT_EQ("{}", record.json().str());
+  EXPECT_FALSE(reader.read(record));
+}
+
+TEST(BroadcastRing, VisitFields) {
+  BroadcastRing ring;
+  BroadcastReader reader(ring);
+  int i = -3;
+  ::std::string s = "foo";
+  Point p{1, 2};
+  ring << DUMP(i, s, p);
+  BroadcastRecord record;
+  ASSERT_TRUE(reader.read(record));
+  EXPECT_EQ(DUMP(i).site().file, record.site().file);
+  ::std::vector<::std::string> fields;
+  record.visit_fields([&](::std::string_view name, const auto& value) {
+    ::std::ostringstream oss;
+    oss << name << ':';
+    if constexpr (::std::is_same_v<decltype(value), const int&>) {
+      oss << "int " << value;
+    } else if constexpr (::std::is_same_v<decltype(value),
+                                          const ::std::string_view&>) {
+      oss << "string " << value;
+    } else {
+      oss << "other";
+    }
+    fields.push_back(oss.str());
+  });
+  EXPECT_EQ((::std::vector<::std::string>{"i:int -3", "s:string foo",
+                                          "p:string (1, 2)"}),
+            fields);
+}
+
+TEST(BroadcastRing, Readers) {
+  BroadcastRing ring({.capacity=8});
+  BroadcastReader first(ring);
+  BroadcastReader second(ring);
+  ::std::string expected;
+  for (int i = 0; i < 3; ++i) {
+    ring << DUMP(i);
+    expected += DUMP(i).str() + "\n";
+  }
+  // Each reader reads every record, at its own pace.
+  EXPECT_EQ(expected, ReadAll(first));
+  const ::std::string last = "last";
+  ring << DUMP(last);
+  expected += DUMP(last).str() + "\n";
+  EXPECT_EQ(expected, ReadAll(second));
+  EXPECT_EQ(DUMP(last).str() + "\n", ReadAll(first));
+  // New readers start at the oldest record.
+  BroadcastReader third(ring);
+  EXPECT_EQ(expected, ReadAll(third));
+  EXPECT_EQ(0u, first.skipped());
+  EXPECT_EQ(0u, second.skipped());
+  EXPECT_EQ(4u, ring.written());
+}
+
+TEST(BroadcastRing, Overrun) {
+  BroadcastRing ring({.capacity=4});
+  BroadcastReader reader(ring);
+  ::std::string expected;
+  for (int i = 0; i < 10; ++i) {
+    ring << DUMP(i);
+    if (i >= 6) expected += DUMP(i).str() + "\n";
+  }
+  EXPECT_EQ(expected, ReadAll(reader));
+  EXPECT_EQ(6u, reader.skipped());
+  ring << DUMP(expected);
+  BroadcastRecord record;
+  ASSERT_TRUE(reader.read(record));
+  EXPECT_EQ(DUMP(expected).str(), record.str());
+  EXPECT_EQ(6u, reader.skipped());
+}
+
+TEST(BroadcastRing, Truncated) {
+  BroadcastRing ring({.record_size=8});
+  BroadcastReader reader(ring);
+  ::std::string s = "longer than 8 bytes";
+  const int line = __LINE__ + 1;
+  ring << DUMP(s);
+  int foo = 42;
+  ring << DUMP(foo);
+  BroadcastRecord record;
+  ASSERT_TRUE(reader.read(record));
+  EXPECT_TRUE(record.truncated());
+  const ::std::string site =
+      ::std::string(__FILE__) + ":" + ::std::to_string(line);
+  EXPECT_EQ("truncated = " + site, record.str());
+  EXPECT_EQ("{\"truncated\":\"" + site + "\"}", record.json().str());
+  ASSERT_TRUE(reader.read(record));
+  EXPECT_FALSE(record.truncated());
+  EXPECT_EQ("foo = 42", record.str());
+}
+
+TEST(BroadcastRing, Threads) {
+  constexpr int kRecords = 100000;
+  BroadcastRing ring({.capacity=64});
+  ::std::vector<::std::thread> readers;
+  for (int r = 0; r < 2; ++r) {
+    readers.emplace_back([&ring, r] {
+      BroadcastReader reader(ring);
+      BroadcastRecord record;
+      ::std::uint64_t read = 0;
+      int last = -1;
+      while (last != kRecords - 1) {
+        if (!reader.read(record)) {
+          ::std::this_thread::yield();
+          continue;
+        }
+        ++read;
+        int i = -1;
+        ::std::string s;
+        record.visit_fields([&](::std::string_view, const auto& value) {
+          if constexpr (::std::is_same_v<decltype(value), const int&>) {
+            i = value;
+          } else if constexpr (::std::is_same_v<
+                                   decltype(value),
+                                   const ::std::string_view&>) {
+            s = value;
+          }
+        });
+        // Records come in order, whole.
+        EXPECT_LT(last, i);
+        EXPECT_EQ(::std::to_string(i), s);
+        last = i;
+        // The slow reader gets overrun.
+        if (r == 1 && i % 16 == 0) ::std::this_thread::yield();
+      }
+      // Less if the reader started after the first records were overwritten.
+      EXPECT_LE(read + reader.skipped(),
+                static_cast<::std::uint64_t>(kRecords));
+    });
+  }
+  for (int i = 0; i < kRecords; ++i) {
+    const ::std::string s = ::std::to_string(i);
+    ring << DUMP(i, s);
+  }
+  for (::std::thread& reader : readers) reader.join();
+  EXPECT_EQ(static_cast<::std::uint64_t>(kRecords), ring.written());
+}
+
+}  // namespace
+}  // namespace dump
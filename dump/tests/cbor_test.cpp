@@ -0,0 +1,153 @@
+// Copyright 2010-2022 Google LLC
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "dump/cbor.hpp"
+
+#include <cstdint>
+#include <limits>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "dump/dump.hpp"
+#include "gtest/gtest.h"
+
+namespace dump {
+namespace {
+
+using Bytes = ::std::vector<::std::uint8_t>;
+
+TEST(Cbor, Empty) {
+  EXPECT_EQ(Bytes({0xa0}), to_cbor(DUMP()));
+}
+
+TEST(Cbor, Map) {
+  int foo = 42;
+  ::std::string bar = "hi";
+  EXPECT_EQ(Bytes({0xa2, 0x63, 'f', 'o', 'o', 0x18, 0x2a,
+                   0x63, 'b', 'a', 'r', 0x62, 'h', 'i'}),
+            to_cbor(DUMP(foo, bar)));
+  EXPECT_EQ(Bytes({0xa1, 0x61, 'x', 0x18, 0x2a}), to_cbor(DUMP(foo).as("x")));
+}
+
+TEST(Cbor, Integers) {
+  EXPECT_EQ(Bytes({0xa1, 0x61, 'x', 0x00}), to_cbor(DUMP(0).as("x")));
+  EXPECT_EQ(Bytes({0xa1, 0x61, 'x', 0x17}), to_cbor(DUMP(23).as("x")));
+  EXPECT_EQ(Bytes({0xa1, 0x61, 'x', 0x19, 0x01, 0x00}),
+            to_cbor(DUMP(256).as("x")));
+  EXPECT_EQ(Bytes({0xa1, 0x61, 'x', 0x1a, 0x00, 0x01, 0x00, 0x00}),
+            to_cbor(DUMP(65536u).as("x")));
+  EXPECT_EQ(Bytes({0xa1, 0x61, 'x', 0x1b, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+                   0xff, 0xff}),
+            to_cbor(DUMP(::std::numeric_limits<::std::uint64_t>::max())
+                        .as("x")));
+  EXPECT_EQ(Bytes({0xa1, 0x61, 'x', 0x20}), to_cbor(DUMP(-1).as("x")));
+  EXPECT_EQ(Bytes({0xa1, 0x61, 'x', 0x38, 0x63}), to_cbor(DUMP(-100).as("x")));
+  EXPECT_EQ(Bytes({0xa1, 0x61, 'x', 0x3b, 0x7f, 0xff, 0xff, 0xff, 0xff, 0xff,
+                   0xff, 0xff}),
+            to_cbor(DUMP(::std::numeric_limits<::std::int64_t>::min())
+                        .as("x")));
+}
+
+TEST(Cbor, Scalars) {
+  bool t = true;
+  bool f = false;
+  float x = 1.5f;
+  double y = -4.1;
+  char c = 'c';
+  const char* p = nullptr;
+  EXPECT_EQ(Bytes({0xa6,
+                   0x61, 't', 0xf5,
+                   0x61, 'f', 0xf4,
+                   0x61, 'x', 0xfa, 0x3f, 0xc0, 0x00, 0x00,
+                   0x61, 'y', 0xfb, 0xc0, 0x10, 0x66, 0x66, 0x66, 0x66, 0x66,
+                   0x66,
+                   0x61, 'c', 0x61, 'c',
+                   0x61, 'p', 0xf6}),
+            to_cbor(DUMP(t, f, x, y, c, p)));
+}
+
+TEST(Cbor, Containers) {
+  ::std::vector<int> v = {1, 2, 3};
+  ::std::map<::std::string, int> m = {{"a", 1}, {"b", -1}};
+  EXPECT_EQ(Bytes({0xa2,
+                   0x61, 'v', 0x83, 0x01, 0x02, 0x03,
+                   0x61, 'm', 0xa2, 0x61, 'a', 0x01, 0x61, 'b', 0x20}),
+            to_cbor(DUMP(v, m)));
+}
+
+TEST(CborWriter, Schema) {
+  Bytes buffer;
+  CborWriter cbor(buffer);
+  CborSchema schema;
+  int foo = 42;
+  ::std::string bar = "hi";
+  for (int i = 0; i < 2; ++i) {
+    const auto record = DUMP(foo, bar);
+    if (i == 0) schema = cbor.register_schema(record);
+    cbor << record;
+  }
+  cbor << DUMP(foo);
+  EXPECT_EQ(0u, schema.id);
+  EXPECT_EQ(Bytes({0x82, 0x00, 0x82, 0x63, 'f', 'o', 'o', 0x63, 'b', 'a', 'r'}),
+            schema.bytes);
+  EXPECT_EQ(Bytes({0x82, 0x00, 0xa2, 0x00, 0x18, 0x2a, 0x01, 0x62, 'h', 'i',
+                   0x82, 0x00, 0xa2, 0x00, 0x18, 0x2a, 0x01, 0x62, 'h', 'i',
+                   0xa1, 0x63, 'f', 'o', 'o', 0x18, 0x2a}),
+            buffer);
+}
+
+// Records of two call sites, interleaved, carry the ID of their own schema.
+TEST(CborWriter, Schemas) {
+  Bytes buffer;
+  CborWriter cbor(buffer);
+  int foo = 42;
+  bool bar = true;
+  const auto first = DUMP(foo);
+  const auto second = DUMP(bar);
+  EXPECT_EQ(Bytes({0x82, 0x00, 0x81, 0x63, 'f', 'o', 'o'}),
+            cbor.register_schema(first).bytes);
+  EXPECT_EQ(Bytes({0x82, 0x01, 0x81, 0x63, 'b', 'a', 'r'}),
+            cbor.register_schema(second).bytes);
+  cbor << first << second << first;
+  EXPECT_EQ(Bytes({0x82, 0x00, 0xa1, 0x00, 0x18, 0x2a,
+                   0x82, 0x01, 0xa1, 0x00, 0xf5,
+                   0x82, 0x00, 0xa1, 0x00, 0x18, 0x2a}),
+            buffer);
+}
+
+TEST(CborWriter, SchemaRenamed) {
+  Bytes buffer;
+  CborWriter cbor(buffer);
+  int foo = 42;
+  for (int i = 0; i < 2; ++i) {
+    const auto record = DUMP(foo);
+    if (i == 0) cbor.register_schema(record);
+    // Keys of the schema would name the field "foo".
+    cbor << record << record.as("x");
+  }
+  const auto record = DUMP(foo);
+  // A new schema, with a new ID.
+  EXPECT_EQ(1u, cbor.register_schema(record.as("x")).id);
+  cbor << record.as("x") << record;
+  EXPECT_EQ(Bytes({0x82, 0x00, 0xa1, 0x00, 0x18, 0x2a,
+                   0xa1, 0x61, 'x', 0x18, 0x2a,
+                   0x82, 0x00, 0xa1, 0x00, 0x18, 0x2a,
+                   0xa1, 0x61, 'x', 0x18, 0x2a,
+                   0x82, 0x01, 0xa1, 0x00, 0x18, 0x2a,
+                   0xa1, 0x63, 'f', 'o', 'o', 0x18, 0x2a}),
+            buffer);
+}
+
+}  // namespace
+}  // namespace dump
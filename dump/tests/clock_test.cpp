@@ -0,0 +1,110 @@
+// Copyright 2010-2022 Google LLC
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "dump/clock.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace dump {
+namespace {
+
+TEST(TscClock, Monotonic) {
+  const ::std::uint64_t a = TscClock::now();
+  const ::std::uint64_t b = TscClock::now();
+  EXPECT_LE(a, b);
+}
+
+TEST(TscClock, Calibrated) {
+  EXPECT_GT(TscClock::calibration().ns_per_tick, 0);
+  const auto steady = ::std::chrono::steady_clock::now();
+  const auto tsc = TscClock::to_steady(TscClock::now());
+  EXPECT_LT(::std::chrono::abs(tsc - steady), ::std::chrono::milliseconds(1));
+}
+
+TEST(TscClock, Duration) {
+  const ::std::uint64_t begin = TscClock::now();
+  const auto steady_begin = ::std::chrono::steady_clock::now();
+  ::std::this_thread::sleep_for(::std::chrono::milliseconds(20));
+  const ::std::chrono::nanoseconds steady =
+      ::std::chrono::steady_clock::now() - steady_begin;
+  const ::std::chrono::nanoseconds tsc =
+      TscClock::duration(static_cast<::std::int64_t>(TscClock::now() - begin));
+  EXPECT_LT(::std::chrono::abs(tsc - steady), steady / 100);
+}
+
+TEST(TscClock, ToSystem) {
+  const auto system = ::std::chrono::system_clock::now();
+  const auto tsc = TscClock::to_system(TscClock::now());
+  EXPECT_LT(::std::chrono::abs(tsc - system), ::std::chrono::milliseconds(1));
+}
+
+TEST(TscClock, Recalibrate) {
+  const TscClock::Calibration first = TscClock::calibration();
+  ::std::this_thread::sleep_for(::std::chrono::milliseconds(10));
+  const TscClock::Calibration second = TscClock::recalibrate();
+  EXPECT_GT(second.ticks, first.ticks);
+  EXPECT_GT(second.system, first.system);
+  EXPECT_NEAR(first.ns_per_tick, second.ns_per_tick, first.ns_per_tick / 100);
+  EXPECT_EQ(second.ticks, TscClock::calibration().ticks);
+  // Timestamps taken before convert with the new calibration.
+  const ::std::uint64_t ticks = first.ticks;
+  EXPECT_LT(::std::chrono::abs(TscClock::to_system(ticks) - first.system),
+            ::std::chrono::milliseconds(1));
+}
+
+TEST(TscCalibrations, Refines) {
+  internal_dump::TscCalibrations calibrations;
+  const TscClock::Calibration first = calibrations.load();
+  // The first rate, measured over a few milliseconds, is refined early.
+  EXPECT_NEAR(static_cast<double>(calibrations.period()) * first.ns_per_tick,
+              1e8, 1e6);
+  ::std::this_thread::sleep_for(::std::chrono::milliseconds(10));
+  const TscClock::Calibration second = calibrations.recalibrate();
+  EXPECT_NEAR(first.ns_per_tick, second.ns_per_tick, first.ns_per_tick / 100);
+  EXPECT_NEAR(static_cast<double>(calibrations.period()) * second.ns_per_tick,
+              1e9, 1e7);
+}
+
+TEST(TscClock, Threads) {
+  ::std::vector<::std::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([] {
+      for (int i = 0; i < 1000; ++i) {
+        const TscClock::Calibration c =
+            i % 2 == 0 ? TscClock::recalibrate() : TscClock::calibration();
+        EXPECT_GT(c.ns_per_tick, 0);
+      }
+    });
+  }
+  for (::std::thread& thread : threads) thread.join();
+}
+
+TEST(WriteUtcTime, Writes) {
+  ::std::ostringstream oss;
+  internal_dump::write_utc_time(
+      oss, ::std::chrono::sys_days(::std::chrono::year(2024) /
+                                   ::std::chrono::May / 1) +
+               ::std::chrono::hours(12) + ::std::chrono::minutes(34) +
+               ::std::chrono::seconds(56) +
+               ::std::chrono::nanoseconds(123456789));
+  EXPECT_EQ("2024-05-01T12:34:56.123456789Z", oss.str());
+}
+
+}  // namespace
+}  // namespace dump
@@ -0,0 +1,159 @@
+// Copyright 2010-2022 Google LLC
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "dump/compress.hpp"
+
+#include <cstddef>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "dump/dump.hpp"
+#include "gtest/gtest.h"
+
+namespace dump {
+namespace {
+
+::std::string Log(int lines) {
+  ::std::string log;
+  for (int i = 0; i < lines; ++i) {
+    int id = i * 7919 % 1000;
+    ::std::string path = "/api/items/" + ::std::to_string(i % 13);
+    log += DUMP(id, path).str() + "\n";
+  }
+  return log;
+}
+
+::std::string Random(::std::size_t size) {
+  ::std::mt19937 rng(42);
+  ::std::string s(size, '\0');
+  for (char& c : s) c = static_cast<char>(rng());
+  return s;
+}
+
+::std::string RoundTrip(const ::std::string& in) {
+  ::std::string compressed;
+  lz_compress(in, compressed);
+  ::std::string out = "prefix";
+  EXPECT_TRUE(lz_decompress(compressed, in.size(), out));
+  return out.substr(6);
+}
+
+TEST(Lz, RoundTrip) {
+  for (const ::std::string& s :
+       {::std::string(), ::std::string("a"), ::std::string("abcdabcdabcd"),
+        ::std::string(100000, 'x'), Log(1000), Random(70000)}) {
+    EXPECT_EQ(s, RoundTrip(s));
+  }
+}
+
+TEST(Lz, Compresses) {
+  const ::std::string log = Log(1000);
+  ::std::string compressed;
+  lz_compress(log, compressed);
+  EXPECT_LT(compressed.size() * 3, log.size());
+}
+
+TEST(Lz, LZ4BlockFormat) {
+  // 4 literals and a match of offset 4 and length 12, then the last 5
+  // literals.
+  ::std::string compressed;
+  lz_compress("abcdabcdabcdabcdabcde", compressed);
+  EXPECT_EQ(::std::string("\x48" "abcd" "\x04\x00" "\x50" "abcde", 13),
+            compressed);
+}
+
+TEST(Lz, Malformed) {
+  const ::std::string log = Log(100);
+  ::std::string compressed;
+  lz_compress(log, compressed);
+  ::std::string out;
+  EXPECT_FALSE(lz_decompress(compressed.substr(0, compressed.size() / 2),
+                             log.size(), out));
+  EXPECT_FALSE(lz_decompress(compressed, log.size() - 1, out));
+  EXPECT_FALSE(lz_decompress(compressed, log.size() + 1, out));
+  EXPECT_FALSE(lz_decompress("", 0, out));
+  // Match before the beginning of the block.
+  EXPECT_FALSE(lz_decompress(::std::string("\x10" "a" "\x02\x00", 4), 5, out));
+}
+
+TEST(CompressedSink, Blocks) {
+  ::std::stringstream file;
+  ::std::vector<::std::string> records;
+  {
+    CompressedSink sink(file, 4096);
+    for (int i = 0; i < 1000; ++i) {
+      records.push_back(Log(1 + i % 3));
+      sink.write(records.back());
+    }
+  }
+  const ::std::size_t size = file.str().size();
+
+  CompressedReader reader(file);
+  ::std::string all;
+  int blocks = 0;
+  for (::std::string block; reader.read(block); ++blocks) {
+    EXPECT_LE(block.size(), 4096u);
+    // Blocks start with a whole record.
+    EXPECT_EQ("id = ", block.substr(0, 5));
+    all += block;
+  }
+  EXPECT_FALSE(reader.error());
+  EXPECT_GT(blocks, 1);
+  ::std::string expected;
+  for (const ::std::string& record : records) expected += record;
+  EXPECT_EQ(expected, all);
+  EXPECT_LT(size * 3, all.size());
+}
+
+TEST(CompressedSink, Skip) {
+  ::std::stringstream file;
+  {
+    CompressedSink sink(file, 16);
+    sink.write("first block....");
+    sink.write(Random(100));
+    sink.write("third block....");
+  }
+  CompressedReader reader(file);
+  ::std::string block;
+  EXPECT_TRUE(reader.skip());
+  ASSERT_TRUE(reader.read(block));
+  // Stored as is, since it does not compress.
+  EXPECT_EQ(Random(100), block);
+  ASSERT_TRUE(reader.read(block));
+  EXPECT_EQ("third block....", block);
+  EXPECT_FALSE(reader.read(block));
+  EXPECT_FALSE(reader.error());
+}
+
+TEST(CompressedReader, Malformed) {
+  ::std::stringstream bad_magic("DLZ2");
+  ::std::string block;
+  CompressedReader reader(bad_magic);
+  EXPECT_FALSE(reader.read(block));
+  EXPECT_TRUE(reader.error());
+
+  ::std::stringstream file;
+  {
+    CompressedSink sink(file);
+    sink.write(Log(100));
+  }
+  ::std::stringstream truncated(file.str().substr(0, file.str().size() - 1));
+  CompressedReader truncated_reader(truncated);
+  EXPECT_FALSE(truncated_reader.read(block));
+  EXPECT_TRUE(truncated_reader.error());
+}
+
+}  // namespace
+}  // namespace dump
@@ -0,0 +1,202 @@
+// Copyright 2010-2022 Google LLC
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "dump/coro.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <coroutine>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "dump/async.hpp"
+#include "dump/dump.hpp"
+#include "dump/sink.hpp"
+#include "gtest/gtest.h"
+#include "test_sinks.hpp"
+
+namespace dump {
+namespace {
+
+// A coroutine which runs until its first suspension when called.
+struct Task {
+  struct promise_type {
+    Task get_return_object() { return {}; }
+    ::std::suspend_never initial_suspend() { return {}; }
+    ::std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { ::std::terminate(); }
+  };
+};
+
+// Resumes coroutines when run() is called, like an event loop.
+class ManualExecutor {
+ public:
+  // Resumes the scheduled coroutines until `done`, for at most 10 seconds.
+  void run(const ::std::atomic<bool>& done) {
+    const auto deadline =
+        ::std::chrono::steady_clock::now() + ::std::chrono::seconds(10);
+    while (!done.load() && ::std::chrono::steady_clock::now() < deadline) {
+      ::std::vector<::std::coroutine_handle<>> scheduled;
+      {
+        ::std::lock_guard<::std::mutex> lock(mutex_);
+        scheduled.swap(scheduled_);
+      }
+      for (::std::coroutine_handle<> coroutine : scheduled) {
+        coroutine.resume();
+      }
+      ::std::this_thread::yield();
+    }
+  }
+
+  auto executor() {
+    return [this](::std::coroutine_handle<> coroutine) {
+      ::std::lock_guard<::std::mutex> lock(mutex_);
+      scheduled_.push_back(coroutine);
+    };
+  }
+
+ private:
+  ::std::mutex mutex_;
+  ::std::vector<::std::coroutine_handle<>> scheduled_;
+};
+
+using ::dump::tests::GatedSink;
+using ::dump::tests::RecordingSink;
+
+template <class S>
+void ExpectFlush() {
+  RecordingSink sink;
+  S async(sink);
+  ManualExecutor executor;
+  ::std::atomic<bool> done = false;
+  // Coroutine lambdas must not capture: they outlive the lambda.
+  [](S& async, ManualExecutor& executor, ::std::atomic<bool>& done) -> Task {
+    int foo = 42;
+    co_await write(async, DUMP(foo), executor.executor());
+    co_await write(async, DUMP(foo), Severity::kWarning, executor.executor());
+    co_await flush(async, executor.executor());
+    done.store(true);
+  }(async, executor, done);
+  EXPECT_FALSE(done.load());
+  executor.run(done);
+  ASSERT_TRUE(done.load());
+  EXPECT_EQ("foo = 42\nfoo = 42\n", sink.out);
+  EXPECT_EQ(1, sink.flushes);
+}
+
+// The coroutine suspends on a full queue, without blocking its thread, and
+// its records are written in order once the sink makes room.
+template <class S>
+void ExpectBackpressure() {
+  GatedSink sink;
+  {
+    S async(sink, {.capacity=2, .batch_size=1});
+    ManualExecutor executor;
+    ::std::atomic<int> written = 0;
+    ::std::atomic<bool> done = false;
+    [](S& async, ManualExecutor& executor, ::std::atomic<int>& written,
+       ::std::atomic<bool>& done) -> Task {
+      for (int i = 0; i < 10; ++i) {
+        co_await write(async, DUMP(i), executor.executor());
+        written.store(i + 1);
+      }
+      co_await flush(async, executor.executor());
+      done.store(true);
+    }(async, executor, written, done);
+    // At most one record blocks the background thread, and two fill the
+    // queue.
+    EXPECT_LE(written.load(), 3);
+    sink.entered.wait(false);
+    sink.open.store(true);
+    sink.open.notify_all();
+    executor.run(done);
+    ASSERT_TRUE(done.load());
+  }
+  ::std::string expected;
+  for (int i = 0; i < 10; ++i) expected += DUMP(i).str() + "\n";
+  EXPECT_EQ(expected, sink.out);
+}
+
+TEST(Coro, Flush) { ExpectFlush<AsyncSink>(); }
+
+TEST(Coro, FlushPerThread) { ExpectFlush<PerThreadAsyncSink>(); }
+
+TEST(Coro, Backpressure) { ExpectBackpressure<AsyncSink>(); }
+
+TEST(Coro, BackpressurePerThread) { ExpectBackpressure<PerThreadAsyncSink>(); }
+
+TEST(Coro, Inline) {
+  RecordingSink sink;
+  AsyncSink async(sink);
+  ::std::atomic<bool> done = false;
+  [](AsyncSink& async, ::std::atomic<bool>& done) -> Task {
+    int foo = 42;
+    co_await write(async, DUMP(foo));
+    co_await flush(async);
+    done.store(true);
+    done.notify_all();
+  }(async, done);
+  // Resumed on the background thread.
+  done.wait(false);
+  EXPECT_EQ("foo = 42\n", sink.out);
+}
+
+TEST(Coro, DestroyedWhileWaiting) {
+  GatedSink sink;
+  ::std::atomic<int> written = 0;
+  {
+    AsyncSink async(sink, {.capacity=2, .batch_size=1});
+    [](AsyncSink& async, ::std::atomic<int>& written) -> Task {
+      for (int i = 0; i < 10; ++i) {
+        co_await write(async, DUMP(i));
+        written.store(i + 1);
+      }
+    }(async, written);
+    EXPECT_LE(written.load(), 3);
+    sink.entered.wait(false);
+    sink.open.store(true);
+    sink.open.notify_all();
+    // Destroyed while the coroutine waits for room.
+  }
+  EXPECT_EQ(10, written.load());
+  ::std::string expected;
+  for (int i = 0; i < 10; ++i) expected += DUMP(i).str() + "\n";
+  EXPECT_EQ(expected, sink.out);
+}
+
+TEST(Coro, Dropped) {
+  GatedSink sink;
+  {
+    AsyncSink async(sink, {.capacity=2, .batch_size=1,
+                           .overflow=AsyncOverflow::kDropNewest});
+    ::std::atomic<bool> done = false;
+    [](AsyncSink& async, ::std::atomic<bool>& done) -> Task {
+      for (int i = 0; i < 10; ++i) co_await write(async, DUMP(i));
+      done.store(true);
+    }(async, done);
+    // Never suspended.
+    EXPECT_TRUE(done.load());
+    sink.entered.wait(false);
+    sink.open.store(true);
+    sink.open.notify_all();
+  }
+  EXPECT_NE(::std::string::npos, sink.out.find("i = 0\n"));
+  EXPECT_EQ(::std::string::npos, sink.out.find("i = 9\n"));
+}
+
+}  // namespace
+}  // namespace dump
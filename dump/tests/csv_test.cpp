@@ -0,0 +1,126 @@
+// Copyright 2010-2022 Google LLC
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "dump/csv.hpp"
+
+#include <cstddef>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "dump/dump.hpp"
+#include "gtest/gtest.h"
+
+namespace dump {
+namespace {
+
+class CsvWriterTest : public ::testing::Test {
+ protected:
+  // Opens streams to buffers that outlive the writer.
+  CsvWriter::Open Open() {
+    return [this](const internal_dump::DumpSite&, internal_dump::DumpNames) {
+      files_.push_back(::std::make_unique<::std::stringbuf>());
+      return ::std::make_unique<::std::ostream>(files_.back().get());
+    };
+  }
+
+  // Contents of the `i`-th opened file.
+  ::std::string File(::std::size_t i) const { return files_.at(i)->str(); }
+
+  ::std::size_t Files() const { return files_.size(); }
+
+ private:
+  ::std::vector<::std::unique_ptr<::std::stringbuf>> files_;
+};
+
+TEST_F(CsvWriterTest, HeaderOncePerSite) {
+  CsvWriter csv(Open());
+  for (int i = 0; i < 3; ++i) {
+    double x = i * 0.5;
+    csv << DUMP(i, x);
+  }
+  ASSERT_EQ(1u, Files());
+  EXPECT_EQ("i,x\n0,0\n1,0.5\n2,1\n", File(0));
+}
+
+TEST_F(CsvWriterTest, SeveralSites) {
+  CsvWriter csv(Open());
+  int a = 1;
+  int b = 2;
+  for (int i = 0; i < 2; ++i) {
+    csv << DUMP(a);
+    csv << DUMP(a, b);
+  }
+  // One table per call site.
+  ASSERT_EQ(2u, Files());
+  EXPECT_EQ("a\n1\n1\n", File(0));
+  EXPECT_EQ("a,b\n1,2\n1,2\n", File(1));
+}
+
+TEST_F(CsvWriterTest, Renamed) {
+  CsvWriter csv(Open());
+  int a = 1;
+  for (const char* name : {"x", "x", "y"}) {
+    auto vars = DUMP(a);
+    csv << vars.as(name) << vars.as(name);
+  }
+  // One table per set of names.
+  ASSERT_EQ(2u, Files());
+  EXPECT_EQ("x\n1\n1\n1\n1\n", File(0));
+  EXPECT_EQ("y\n1\n1\n", File(1));
+}
+
+TEST_F(CsvWriterTest, Dropped) {
+  ::std::ostringstream oss;
+  int opened = 0;
+  CsvWriter csv([&](const internal_dump::DumpSite&,
+                    internal_dump::DumpNames names)
+                    -> ::std::unique_ptr<::std::ostream> {
+    ++opened;
+    if (names[0] == "a") return nullptr;
+    return ::std::make_unique<::std::ostream>(oss.rdbuf());
+  });
+  int a = 1;
+  int b = 2;
+  for (int i = 0; i < 2; ++i) {
+    csv << DUMP(a);
+    csv << DUMP(b);
+  }
+  csv.flush();
+  // Tables without a stream are only opened once.
+  EXPECT_EQ(2, opened);
+  EXPECT_EQ("b\n2\n2\n", oss.str());
+}
+
+TEST_F(CsvWriterTest, Quoting) {
+  CsvWriter csv(Open());
+  ::std::string s = "a,\"b\"\nc";
+  bool ok = true;
+  char c = ',';
+  csv << DUMP(s, ok, c, ::std::string("x,y").size());
+  EXPECT_EQ("s,ok,c,\"::std::string(\"\"x,y\"\").size()\"\n"
+            "\"a,\"\"b\"\"\nc\",true,\",\",3\n",
+            File(0));
+}
+
+TEST_F(CsvWriterTest, Tsv) {
+  CsvWriter tsv(Open(), '\t');
+  ::std::string s = "a,b";
+  ::std::string t = "a\tb";
+  tsv << DUMP(s, t);
+  EXPECT_EQ("s\tt\na,b\t\"a\tb\"\n", File(0));
+}
+
+}  // namespace
+}  // namespace dump
@@ -13,9 +13,12 @@
 
 #include "dump/dump.hpp"
 
+#include <limits>
+#include <map>
 #include <ostream>
 #include <sstream>
 #include <string>
+#include <string_view>
 #include <utility>
 #include <vector>
 
@@ -95,6 +98,39 @@ TEST(DumpVars, NamesOverride) {
   EXPECT_EQ("z = 5", ToString(DUMP(5).as().as("x", "y").as("z")));
 }
 
+TEST(DumpVars, NamesView) {
+  int foo = 42;
+  auto vars = DUMP(foo);
+  const auto view = vars.as("bar");
+  // The view borrows the dump, so it sees later changes.
+  vars.sep(", ", ": ");
+  EXPECT_EQ("bar: 42", view.str());
+  EXPECT_EQ("foo: 42", vars.str());
+  EXPECT_EQ(sizeof(&vars) + sizeof(::std::string_view), sizeof(view));
+  // Renaming a view renames the dump, it does not stack views.
+  EXPECT_EQ(sizeof(view), sizeof(view.as("baz")));
+  EXPECT_EQ("baz: 42", view.as("baz").str());
+  EXPECT_EQ("x | 42", DUMP(foo).as("x").sep(", ", " | ").str());
+}
+
+template <class D, class N>
+concept Renamable = requires(D dump, N name) { dump.as(name); };
+
+TEST(DumpVars, NamesNotStrings) {
+  int foo = 42;
+  auto vars = DUMP(foo);
+  using Vars = decltype(vars);
+  static_assert(Renamable<const Vars&, const char*>);
+  static_assert(Renamable<const Vars&, ::std::string_view>);
+  // The view would dangle once a temporary string is gone.
+  static_assert(!Renamable<const Vars&, ::std::string>);
+  static_assert(!Renamable<Vars&&, const ::std::string&>);
+  using View = decltype(vars.as("bar"));
+  static_assert(!Renamable<const View&, ::std::string>);
+  const ::std::string name = "bar";
+  EXPECT_EQ("bar = 42", vars.as(::std::string_view(name)).str());
+}
+
 TEST(DumpVars, TwoValues) {
   int foo = 42;
   int bar = 24;
@@ -158,5 +194,52 @@ TEST(DumpVars, TemporaryLifetime) {
   EXPECT_EQ("temp = hello", ToString(v.as("temp")));
 }
 
+TEST(DumpJson, Empty) {
+  EXPECT_EQ("{}", DUMP().json().str());
+  EXPECT_EQ("{}", ToString(as_json(DUMP())));
+}
+
+TEST(DumpJson, Types) {
+  int i = -42;
+  double d = 1.5;
+  bool b = true;
+  char c = 'c';
+  ::std::string s = "hello";
+  const char* p = nullptr;
+  EXPECT_EQ(R"({"i":-42,"d":1.5,"b":true,"c":"c","s":"hello","p":null})",
+            DUMP(i, d, b, c, s, p).json().str());
+  EXPECT_EQ(R"({"2 + 2":4})", ToString(as_json(DUMP(2 + 2))));
+  EXPECT_EQ(R"({"x":null})",
+            DUMP(::std::numeric_limits<double>::infinity()).as("x").json()
+                .str());
+}
+
+TEST(DumpJson, Containers) {
+  ::std::vector<int> v = {1, 2, 3};
+  ::std::vector<::std::vector<::std::string>> vv = {{"a"}, {}, {"b", "c"}};
+  ::std::map<::std::string, int> m = {{"x", 1}, {"y", 2}};
+  EXPECT_EQ(R"({"v":[1,2,3],"vv":[["a"],[],["b","c"]],"m":[["x",1],["y",2]]})",
+            DUMP(v, vv, m).json().str());
+}
+
+TEST(DumpJson, Escaping) {
+  ::std::string s = "a \"quoted\"\tstring\\ with a long tail\n\x01";
+  EXPECT_EQ(R"({"s":"a \"quoted\"\tstring\\ with a long tail\n\u0001"})",
+            DUMP(s).json().str());
+  // Names are escaped as well, at compile time for DUMP() names.
+  EXPECT_EQ(R"json({"::std::string(\"x\")":"x"})json",
+            DUMP(::std::string("x")).json().str());
+  EXPECT_EQ(R"({"\"y\"":"x"})",
+            DUMP(::std::string("x")).as("\"y\"").json().str());
+}
+
+TEST(DumpJson, Names) {
+  int foo = 42;
+  auto vars = DUMP(foo);
+  EXPECT_EQ(R"({"bar":42})", vars.as("bar").json().str());
+  EXPECT_EQ(R"({"bar":42})", ToString(as_json(vars.as("bar"))));
+  EXPECT_EQ(R"({"foo":42})", ToString(as_json(vars)));
+}
+
 }  // namespace
 }  // namespace dump
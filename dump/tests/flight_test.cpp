@@ -0,0 +1,189 @@
+// Copyright 2010-2022 Google LLC
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "dump/flight.hpp"
+
+#include <atomic>
+#include <csignal>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include "dump/binlog.hpp"
+#include "dump/dump.hpp"
+#include "gtest/gtest.h"
+
+namespace dump {
+namespace {
+
+struct Point {
+  int x;
+  int y;
+};
+
+::std::ostream& operator<<(::std::ostream& os, const Point& p) {
+  return os << '(' << p.x << ", " << p.y << ')';
+}
+
+// Decodes what was written to `file`.
+::std::string Decode(::std::FILE* file) {
+  ::std::vector<::std::uint8_t> log;
+  ::std::uint8_t buffer[4096];
+  for (::ssize_t n; (n = ::pread(fileno(file), buffer, sizeof(buffer),
+                                 static_cast<::off_t>(log.size()))) > 0;) {
+    log.insert(log.end(), buffer, buffer + n);
+  }
+  ::std::ostringstream oss;
+  BinlogReader reader;
+  EXPECT_TRUE(reader.decode(log, oss));
+  return oss.str();
+}
+
+::std::string Decode(const FlightRecorder& recorder) {
+  ::std::FILE* file = ::std::tmpfile();
+  EXPECT_TRUE(recorder.write_to(fileno(file)));
+  const ::std::string decoded = Decode(file);
+  ::std::fclose(file);
+  return decoded;
+}
+
+::std::string Thread() {
+  return "thread = " + ::std::to_string(internal_dump::flight_thread_id()) +
+         "\n";
+}
+
+TEST(FlightRecorder, Empty) {
+  FlightRecorder recorder;
+  EXPECT_EQ("", Decode(recorder));
+}
+
+TEST(FlightRecorder, KeepsLast) {
+  FlightRecorder recorder({.records=4});
+  ::std::string expected = Thread();
+  for (int i = 0; i < 10; ++i) {
+    ::std::string name = "record" + ::std::to_string(i);
+    recorder << DUMP(i, name);
+    if (i >= 6) expected += DUMP(i, name).str() + "\n";
+  }
+  EXPECT_EQ(expected, Decode(recorder));
+}
+
+TEST(FlightRecorder, SameAsText) {
+  FlightRecorder recorder;
+  bool b = true;
+  char c = 'x';
+  ::std::int8_t i8 = -8;
+  ::std::uint64_t u64 = ~::std::uint64_t{0};
+  double d = 3.25;
+  const char* s = "hello";
+  Point p{1, 2};
+  recorder << DUMP(b, c, i8, u64, d, s, p) << DUMP();
+  EXPECT_EQ(Thread() + DUMP(b, c, i8, u64, d, s, p).str() + "\n\n",
+            Decode(recorder));
+}
+
+TEST(FlightRecorder, Truncated) {
+  FlightRecorder recorder({.record_size=8});
+  ::std::string s = "longer than 8 bytes";
+  const int line = __LINE__ + 1;
+  recorder << DUMP(s);
+  int foo = 42;
+  recorder << DUMP(foo);
+  EXPECT_EQ(Thread() + "truncated = " + __FILE__ + ":" +
+                ::std::to_string(line) + "\nfoo = 42\n",
+            Decode(recorder));
+}
+
+TEST(FlightRecorder, Threads) {
+  FlightRecorder recorder;
+  int foo = 42;
+  recorder << DUMP(foo);
+  const ::std::string main_thread = Thread() + "foo = 42\n";
+  for (int t = 0; t < 2; ++t) {
+    // An exited thread keeps its records until the next one takes over its
+    // ring. Newer rings come first.
+    ::std::string expected;
+    ::std::thread([&] {
+      recorder << DUMP(t);
+      expected = Thread() + DUMP(t).str() + "\n";
+    }).join();
+    EXPECT_EQ(expected + main_thread, Decode(recorder));
+  }
+}
+
+TEST(FlightRecorder, WriteWhileRecording) {
+  FlightRecorder recorder({.records=8});
+  ::std::atomic<bool> done = false;
+  ::std::thread thread([&] {
+    for (int i = 0; !done.load(); ++i) {
+      const ::std::string s = ::std::to_string(i);
+      recorder << DUMP(i, s);
+    }
+  });
+  // Records being overwritten are skipped, the others come whole.
+  for (int n = 0; n < 100; ++n) {
+    ::std::istringstream lines(Decode(recorder));
+    ::std::string line;
+    while (::std::getline(lines, line)) {
+      if (line.starts_with("thread = ")) continue;
+      const ::std::size_t comma = line.find(", s = ");
+      ASSERT_NE(::std::string::npos, comma) << line;
+      EXPECT_EQ(line.substr(4, comma - 4), line.substr(comma + 6));
+    }
+  }
+  done.store(true);
+  thread.join();
+}
+
+TEST(FlightRecorderDeathTest, WritesOnSignal) {
+  ::std::FILE* file = ::std::tmpfile();
+  FlightRecorder recorder;
+  EXPECT_DEATH({
+    recorder.install(fileno(file));
+    int foo = 42;
+    recorder << DUMP(foo);
+    ::std::abort();
+  }, "");
+  const ::std::string decoded = Decode(file);
+  EXPECT_EQ(0u, decoded.find("signal = " + ::std::to_string(SIGABRT) +
+                             "\nthread = "))
+      << decoded;
+  EXPECT_NE(::std::string::npos, decoded.find("\nfoo = 42\n")) << decoded;
+  ::std::fclose(file);
+}
+
+TEST(FlightRecorder, Uninstall) {
+  struct sigaction before;
+  ::sigaction(SIGSEGV, nullptr, &before);
+  {
+    FlightRecorder recorder;
+    ASSERT_TRUE(recorder.install(STDERR_FILENO));
+    struct sigaction installed;
+    ::sigaction(SIGSEGV, nullptr, &installed);
+    EXPECT_NE(before.sa_handler, installed.sa_handler);
+  }
+  struct sigaction after;
+  ::sigaction(SIGSEGV, nullptr, &after);
+  EXPECT_EQ(before.sa_handler, after.sa_handler);
+}
+
+}  // namespace
+}  // namespace dump
@@ -0,0 +1,120 @@
+// Copyright 2010-2022 Google LLC
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "dump/line.hpp"
+
+#include <cstddef>
+#include <cstdio>
+#include <iomanip>
+#include <mutex>
+#include <ostream>
+#include <sstream>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "dump/dump.hpp"
+#include "gtest/gtest.h"
+
+namespace dump {
+namespace {
+
+// Records each write to it, from any thread.
+class RecordingBuffer : public ::std::streambuf {
+ public:
+  ::std::vector<::std::string> writes() {
+    ::std::lock_guard<::std::mutex> lock(mutex_);
+    return writes_;
+  }
+
+ protected:
+  int_type overflow(int_type c) override {
+    ::std::lock_guard<::std::mutex> lock(mutex_);
+    writes_.emplace_back(1, traits_type::to_char_type(c));
+    return c;
+  }
+
+  ::std::streamsize xsputn(const char* s, ::std::streamsize n) override {
+    ::std::lock_guard<::std::mutex> lock(mutex_);
+    writes_.emplace_back(s, n);
+    return n;
+  }
+
+ private:
+  ::std::mutex mutex_;
+  ::std::vector<::std::string> writes_;
+};
+
+struct Nested {
+  friend ::std::ostream& operator<<(::std::ostream& os, const Nested&) {
+    int inner = 1;
+    ::std::ostringstream oss;
+    oss << line(DUMP(inner));
+    return os << '[' << oss.view().substr(0, oss.view().size() - 1) << ']';
+  }
+};
+
+TEST(Line, WritesOnce) {
+  RecordingBuffer buffer;
+  ::std::ostream os(&buffer);
+  int foo = 42;
+  ::std::string bar = "hello";
+  os << line(DUMP(foo, bar)) << line(DUMP(foo).json());
+  EXPECT_EQ((::std::vector<::std::string>{"foo = 42, bar = hello\n",
+                                           "{\"foo\":42}\n"}),
+            buffer.writes());
+}
+
+TEST(Line, Format) {
+  ::std::ostringstream os;
+  int foo = 255;
+  double bar = 3.14159;
+  os << ::std::hex << ::std::setprecision(3) << line(DUMP(foo, bar));
+  os << ::std::dec << line(DUMP(foo));
+  EXPECT_EQ("foo = ff, bar = 3.14\nfoo = 255\n", os.str());
+}
+
+TEST(Line, Nested) {
+  ::std::ostringstream os;
+  Nested nested;
+  os << line(DUMP(nested));
+  EXPECT_EQ("nested = [inner = 1]\n", os.str());
+}
+
+TEST(Line, Threads) {
+  constexpr int kThreads = 4;
+  constexpr int kLines = 1000;
+  RecordingBuffer buffer;
+  ::std::ostream os(&buffer);
+  {
+    ::std::vector<::std::thread> threads;
+    for (int t = 0; t < kThreads; ++t) {
+      threads.emplace_back([&os, t] {
+        for (int i = 0; i < kLines; ++i) os << line(DUMP(t, i));
+      });
+    }
+    for (::std::thread& thread : threads) thread.join();
+  }
+  const ::std::vector<::std::string> writes = buffer.writes();
+  ASSERT_EQ(static_cast<::std::size_t>(kThreads * kLines), writes.size());
+  for (const ::std::string& write : writes) {
+    int t;
+    int i;
+    EXPECT_EQ(2, ::std::sscanf(write.c_str(), "t = %d, i = %d\n", &t, &i));
+    EXPECT_EQ('\n', write.back());
+  }
+}
+
+}  // namespace
+}  // namespace dump
@@ -0,0 +1,103 @@
+// Copyright 2010-2022 Google LLC
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "dump/numa.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace dump {
+namespace {
+
+::std::vector<int> ParseCpuList(::std::string_view list) {
+  ::std::vector<int> cpus;
+  EXPECT_TRUE(parse_cpu_list(list, cpus)) << list;
+  return cpus;
+}
+
+void WriteFile(const ::std::filesystem::path& path, ::std::string_view data) {
+  ::std::filesystem::create_directories(path.parent_path());
+  ::std::ofstream(path) << data;
+}
+
+TEST(ParseCpuList, Parses) {
+  EXPECT_EQ((::std::vector<int>{0}), ParseCpuList("0\n"));
+  EXPECT_EQ((::std::vector<int>{0, 1, 2, 3, 8, 10, 11}),
+            ParseCpuList("0-3,8,10-11"));
+  EXPECT_EQ((::std::vector<int>{}), ParseCpuList(""));
+}
+
+TEST(ParseCpuList, Malformed) {
+  for (::std::string_view list : {"a", "1-", "3-1", "1,", ",1", "1;2", "-1",
+                                  "0-100000000"}) {
+    ::std::vector<int> cpus;
+    EXPECT_FALSE(parse_cpu_list(list, cpus)) << list;
+  }
+}
+
+TEST(NumaTopology, Reads) {
+  const ::std::filesystem::path root =
+      ::std::filesystem::path(::testing::TempDir()) / "numa_test_node";
+  ::std::filesystem::remove_all(root);
+  WriteFile(root / "online", "0,2\n");
+  WriteFile(root / "node0" / "cpulist", "0-1,4\n");
+  WriteFile(root / "node2" / "cpulist", "2-3\n");
+  // Offline, so ignored.
+  WriteFile(root / "node3" / "cpulist", "5\n");
+  const NumaTopology topology = NumaTopology::read(root.string());
+  ASSERT_EQ(2u, topology.nodes());
+  EXPECT_EQ(0, topology.id(0));
+  EXPECT_EQ(2, topology.id(1));
+  EXPECT_EQ((::std::vector<int>{0, 1, 4}), topology.cpus(0));
+  EXPECT_EQ((::std::vector<int>{2, 3}), topology.cpus(1));
+  EXPECT_EQ(0u, topology.node_of_cpu(4));
+  EXPECT_EQ(1u, topology.node_of_cpu(3));
+  EXPECT_EQ(0u, topology.node_of_cpu(5));
+  EXPECT_LT(topology.current_node(), 2u);
+  ::std::filesystem::remove_all(root);
+}
+
+TEST(NumaTopology, Missing) {
+  const NumaTopology topology = NumaTopology::read("/nonexistent");
+  ASSERT_EQ(1u, topology.nodes());
+  EXPECT_EQ(0, topology.id(0));
+  EXPECT_TRUE(topology.cpus(0).empty());
+  EXPECT_EQ(0u, topology.current_node());
+}
+
+TEST(NumaTopology, System) {
+  const NumaTopology& topology = NumaTopology::system();
+  ASSERT_GE(topology.nodes(), 1u);
+  EXPECT_LT(topology.current_node(), topology.nodes());
+}
+
+TEST(NumaAllocate, Allocates) {
+  const NumaTopology& topology = NumaTopology::system();
+  constexpr ::std::size_t kSize = 1 << 20;
+  void* p = numa_allocate(kSize, topology.id(topology.current_node()));
+  ASSERT_NE(nullptr, p);
+  EXPECT_EQ(0u, reinterpret_cast<::std::uintptr_t>(p) % 4096);
+  ::std::memset(p, 1, kSize);
+  numa_deallocate(p, kSize);
+}
+
+}  // namespace
+}  // namespace dump
@@ -0,0 +1,254 @@
+// Copyright 2010-2022 Google LLC
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "dump/perfetto.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "dump/dump.hpp"
+#include "gtest/gtest.h"
+
+namespace dump {
+namespace {
+
+struct Field {
+  ::std::uint32_t number;
+  // Value of varint and fixed64 fields.
+  ::std::uint64_t value;
+  // Value of length-delimited fields.
+  ::std::string_view bytes;
+};
+
+// Just enough of a protobuf reader to check what PerfettoWriter writes.
+::std::vector<Field> Parse(::std::string_view message) {
+  ::std::size_t pos = 0;
+  const auto varint = [&] {
+    ::std::uint64_t value = 0;
+    for (int shift = 0;; shift += 7) {
+      const auto byte = static_cast<::std::uint8_t>(message.at(pos++));
+      value |= static_cast<::std::uint64_t>(byte & 0x7f) << shift;
+      if ((byte & 0x80) == 0) return value;
+    }
+  };
+  ::std::vector<Field> fields;
+  while (pos < message.size()) {
+    const ::std::uint64_t tag = varint();
+    Field field{.number=static_cast<::std::uint32_t>(tag >> 3), .value=0,
+                .bytes={}};
+    switch (tag & 7) {
+      case 0:
+        field.value = varint();
+        break;
+      case 1:
+        ::std::memcpy(&field.value, message.data() + pos, 8);
+        pos += 8;
+        break;
+      case 2: {
+        const ::std::uint64_t size = varint();
+        field.bytes = message.substr(pos, size);
+        pos += size;
+        break;
+      }
+      default:
+        ADD_FAILURE() << "wire type " << (tag & 7);
+        return fields;
+    }
+    fields.push_back(field);
+  }
+  return fields;
+}
+
+::std::vector<Field> Get(const ::std::vector<Field>& fields,
+                         ::std::uint32_t number) {
+  ::std::vector<Field> found;
+  for (const Field& field : fields) {
+    if (field.number == number) found.push_back(field);
+  }
+  return found;
+}
+
+const Field& GetOne(const ::std::vector<Field>& fields,
+                    ::std::uint32_t number) {
+  static const Field kMissing{};
+  for (const Field& field : fields) {
+    if (field.number == number) return field;
+  }
+  ADD_FAILURE() << "no field " << number;
+  return kMissing;
+}
+
+// Returns the fields of each packet of `trace`.
+::std::vector<::std::vector<Field>> Packets(
+    const ::std::vector<::std::uint8_t>& trace) {
+  ::std::vector<::std::vector<Field>> packets;
+  const ::std::string_view bytes(reinterpret_cast<const char*>(trace.data()),
+                                 trace.size());
+  for (const Field& packet : Parse(bytes)) {
+    EXPECT_EQ(1u, packet.number);
+    packets.push_back(Parse(packet.bytes));
+  }
+  return packets;
+}
+
+// Returns the interned names of `packet` in `table`, by ID.
+::std::vector<::std::pair<::std::uint64_t, ::std::string_view>> Interned(
+    const ::std::vector<Field>& packet, ::std::uint32_t table) {
+  ::std::vector<::std::pair<::std::uint64_t, ::std::string_view>> names;
+  for (const Field& interned : Get(packet, 12)) {
+    for (const Field& entry : Get(Parse(interned.bytes), table)) {
+      const ::std::vector<Field> fields = Parse(entry.bytes);
+      names.emplace_back(GetOne(fields, 1).value, GetOne(fields, 2).bytes);
+    }
+  }
+  return names;
+}
+
+TEST(PerfettoWriter, Track) {
+  ::std::vector<::std::uint8_t> trace;
+  PerfettoWriter perfetto(trace, {.sequence_id=7, .track_name="worker"});
+  const auto packets = Packets(trace);
+  ASSERT_EQ(1u, packets.size());
+  EXPECT_EQ(7u, GetOne(packets[0], 10).value);
+  EXPECT_EQ(1u, GetOne(packets[0], 13).value);
+  const auto track = Parse(GetOne(packets[0], 60).bytes);
+  const ::std::uint64_t tid = internal_dump::perfetto_thread_id();
+  if (tid == 0) {
+    EXPECT_EQ("worker", GetOne(track, 2).bytes);
+    return;
+  }
+  const auto thread = Parse(GetOne(track, 4).bytes);
+  EXPECT_EQ(static_cast<::std::uint64_t>(internal_dump::trace_pid()),
+            GetOne(thread, 1).value);
+  EXPECT_EQ(tid, GetOne(thread, 2).value);
+  EXPECT_EQ("worker", GetOne(thread, 5).bytes);
+}
+
+TEST(PerfettoWriter, ThreadTracks) {
+  // Writers of different threads describe different threads.
+  ::std::vector<::std::uint8_t> main_trace;
+  PerfettoWriter main_writer(main_trace);
+  ::std::vector<::std::uint8_t> other_trace;
+  ::std::thread([&] { PerfettoWriter other_writer(other_trace); }).join();
+  const auto main_track = Parse(GetOne(Packets(main_trace)[0], 60).bytes);
+  const auto other_track = Parse(GetOne(Packets(other_trace)[0], 60).bytes);
+  EXPECT_NE(GetOne(main_track, 1).value, GetOne(other_track, 1).value);
+  if (internal_dump::perfetto_thread_id() == 0) return;
+  EXPECT_NE(GetOne(Parse(GetOne(main_track, 4).bytes), 2).value,
+            GetOne(Parse(GetOne(other_track, 4).bytes), 2).value);
+}
+
+TEST(PerfettoWriter, Records) {
+  ::std::vector<::std::uint8_t> trace;
+  PerfettoWriter perfetto(trace);
+  for (int i = -1; i < 1; ++i) {
+    ::std::string s = "hi";
+    double d = 0.5;
+    bool b = true;
+    perfetto << DUMP(i, s, d, b);
+  }
+  const int line = __LINE__ - 2;
+  const auto packets = Packets(trace);
+  ASSERT_EQ(3u, packets.size());
+  const ::std::uint64_t track = GetOne(packets[0], 10).value;
+
+  // The first record interns its names and call site.
+  const auto event_names = Interned(packets[1], 2);
+  ASSERT_EQ(1u, event_names.size());
+  EXPECT_EQ("perfetto_test.cpp:" + ::std::to_string(line),
+            event_names[0].second);
+  const auto field_names = Interned(packets[1], 3);
+  ASSERT_EQ(4u, field_names.size());
+  EXPECT_EQ("i", field_names[0].second);
+  EXPECT_EQ("b", field_names[3].second);
+  const auto locations = Get(Parse(GetOne(packets[1], 12).bytes), 4);
+  ASSERT_EQ(1u, locations.size());
+  EXPECT_EQ(static_cast<::std::uint64_t>(line),
+            GetOne(Parse(locations[0].bytes), 4).value);
+  EXPECT_TRUE(Get(packets[2], 12).empty());
+
+  for (int n = 1; n < 3; ++n) {
+    EXPECT_EQ(track, GetOne(packets[n], 10).value);
+    EXPECT_EQ(2u, GetOne(packets[n], 13).value);
+    const auto event = Parse(GetOne(packets[n], 11).bytes);
+    EXPECT_EQ(3u, GetOne(event, 9).value);
+    EXPECT_EQ(event_names[0].first, GetOne(event, 10).value);
+    const auto annotations = Get(event, 4);
+    ASSERT_EQ(4u, annotations.size());
+    const auto i = Parse(annotations[0].bytes);
+    EXPECT_EQ(field_names[0].first, GetOne(i, 1).value);
+    EXPECT_EQ(static_cast<::std::uint64_t>(n - 2), GetOne(i, 4).value);
+    EXPECT_EQ("hi", GetOne(Parse(annotations[1].bytes), 6).bytes);
+    double d;
+    const ::std::uint64_t bits = GetOne(Parse(annotations[2].bytes), 5).value;
+    ::std::memcpy(&d, &bits, sizeof(d));
+    EXPECT_EQ(0.5, d);
+    EXPECT_EQ(1u, GetOne(Parse(annotations[3].bytes), 2).value);
+  }
+}
+
+TEST(PerfettoWriter, Renamed) {
+  ::std::vector<::std::uint8_t> trace;
+  PerfettoWriter perfetto(trace);
+  int x = 1;
+  perfetto << DUMP(x).as("y");
+  const auto packets = Packets(trace);
+  ASSERT_EQ(2u, packets.size());
+  const auto field_names = Interned(packets[1], 3);
+  ASSERT_EQ(2u, field_names.size());
+  EXPECT_EQ("x", field_names[0].second);
+  EXPECT_EQ("y", field_names[1].second);
+  const auto event = Parse(GetOne(packets[1], 11).bytes);
+  EXPECT_EQ(field_names[1].first,
+            GetOne(Parse(GetOne(event, 4).bytes), 1).value);
+}
+
+TEST(PerfettoWriter, Spans) {
+  ::std::vector<::std::uint8_t> trace;
+  PerfettoWriter perfetto(trace);
+  {
+    int x = 1;
+    DUMP_PERFETTO_SPAN(perfetto, "Handle", x);
+  }
+  const auto packets = Packets(trace);
+  ASSERT_EQ(3u, packets.size());
+  const auto begin = Parse(GetOne(packets[1], 11).bytes);
+  const auto end = Parse(GetOne(packets[2], 11).bytes);
+  EXPECT_EQ(1u, GetOne(begin, 9).value);
+  EXPECT_EQ(2u, GetOne(end, 9).value);
+  EXPECT_EQ(GetOne(begin, 11).value, GetOne(end, 11).value);
+  const auto event_names = Interned(packets[1], 2);
+  ASSERT_EQ(1u, event_names.size());
+  EXPECT_EQ("Handle", event_names[0].second);
+  EXPECT_EQ(event_names[0].first, GetOne(begin, 10).value);
+  EXPECT_EQ(1u, Get(begin, 4).size());
+  EXPECT_LE(GetOne(packets[1], 8).value, GetOne(packets[2], 8).value);
+}
+
+TEST(PerfettoWriter, Sequences) {
+  ::std::vector<::std::uint8_t> trace;
+  PerfettoWriter a(trace);
+  PerfettoWriter b(trace);
+  EXPECT_NE(a.sequence_id(), b.sequence_id());
+  const auto packets = Packets(trace);
+  ASSERT_EQ(2u, packets.size());
+  EXPECT_NE(GetOne(Parse(GetOne(packets[0], 60).bytes), 1).value,
+            GetOne(Parse(GetOne(packets[1], 60).bytes), 1).value);
+}
+
+}  // namespace
+}  // namespace dump
@@ -0,0 +1,50 @@
+// Copyright 2010-2022 Google LLC
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "dump/sink.hpp"
+
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "dump/dump.hpp"
+#include "gtest/gtest.h"
+#include "test_sinks.hpp"
+
+namespace dump {
+namespace {
+
+using ::dump::tests::RecordingSink;
+
+TEST(Sink, WritesLines) {
+  RecordingSink sink;
+  int foo = 42;
+  ::std::string bar = "hello";
+  sink << DUMP(foo, bar) << DUMP(foo).as("baz");
+  EXPECT_EQ((::std::vector<::std::string>{"foo = 42, bar = hello\n",
+                                           "baz = 42\n"}),
+            sink.writes);
+}
+
+TEST(OstreamSink, Writes) {
+  ::std::ostringstream os;
+  OstreamSink sink(os);
+  int foo = 42;
+  sink << DUMP(foo);
+  sink.write("raw");
+  sink.flush();
+  EXPECT_EQ("foo = 42\nraw", os.str());
+}
+
+}  // namespace
+}  // namespace dump
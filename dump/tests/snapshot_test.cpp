@@ -0,0 +1,107 @@
+// Copyright 2010-2022 Google LLC
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "dump/snapshot.hpp"
+
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include "dump/any_dump.hpp"
+#include "dump/dump.hpp"
+#include "gtest/gtest.h"
+
+namespace dump {
+namespace {
+
+template <class D>
+AnyDump Snapshot(const D& dump) {
+  AnyDump record;
+  visit_snapshot(dump, [&](auto&& snapshot) { record = ::std::move(snapshot); });
+  return record;
+}
+
+TEST(DumpSnapshot, CopiesValues) {
+  int foo = 42;
+  ::std::string bar = "hello";
+  auto dump = DUMP(foo, bar);
+  AnyDump record = Snapshot(dump);
+  foo = 24;
+  bar.clear();
+  EXPECT_EQ("foo = 24, bar = ", dump.str());
+  EXPECT_EQ("foo = 42, bar = hello", record.str());
+}
+
+TEST(DumpSnapshot, CopiesStrings) {
+  AnyDump record;
+  {
+    ::std::string s = "hello";
+    const char* c = s.c_str();
+    ::std::string_view v = s;
+    const char* null = nullptr;
+    record = Snapshot(DUMP(c, v, null));
+    s = "world";
+  }
+  EXPECT_EQ("c = hello, v = hello, null = ", record.str());
+}
+
+TEST(DumpSnapshot, DumpLike) {
+  int foo = 42;
+  ::std::string bar = "a\"b";
+  auto dump = DUMP(foo, bar);
+  visit_snapshot(dump, [&](auto&& snapshot) {
+    EXPECT_EQ(&dump.site(), &snapshot.site());
+    EXPECT_EQ(dump.names().data(), snapshot.names().data());
+    EXPECT_EQ(dump.json_keys().data(), snapshot.json_keys().data());
+    EXPECT_EQ("foo = 42, bar = a\"b", snapshot.str());
+    EXPECT_EQ(R"({"foo":42,"bar":"a\"b"})", snapshot.json().str());
+  });
+}
+
+TEST(DumpSnapshot, Renamed) {
+  AnyDump record;
+  {
+    int x = 1;
+    int y = 2;
+    visit_snapshot(DUMP(x, y).as("a", "b"), [&](auto&& snapshot) {
+      EXPECT_TRUE(snapshot.json_keys().empty());
+      EXPECT_EQ(R"({"a":1,"b":2})", snapshot.json().str());
+      record = ::std::move(snapshot);
+    });
+  }
+  EXPECT_EQ("a = 1, b = 2", record.str());
+}
+
+TEST(DumpSnapshot, CopiesNames) {
+  AnyDump record;
+  int x = 1;
+  ::std::string name = "a";
+  visit_snapshot(DUMP(x).as(::std::string_view(name)), [&](auto&& snapshot) {
+    auto copy = snapshot;
+    record = ::std::move(copy);
+  });
+  name = "b";
+  EXPECT_EQ("a = 1", record.str());
+}
+
+TEST(DumpSnapshot, EvaluatesOnce) {
+  int n = 0;
+  auto F = [&]() { return ++n; };
+  AnyDump record = Snapshot(DUMP(F()));
+  EXPECT_EQ(1, n);
+  EXPECT_EQ("F() = 1", record.str());
+  EXPECT_EQ("F() = 1", record.str());
+}
+
+}  // namespace
+}  // namespace dump
@@ -0,0 +1,64 @@
+// Copyright 2010-2022 Google LLC
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Sinks shared by the tests of the sinks and of the asynchronous writers.
+
+#ifndef DUMP_TESTS_TEST_SINKS_HPP_
+#define DUMP_TESTS_TEST_SINKS_HPP_
+
+#include <atomic>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "dump/sink.hpp"
+
+namespace dump {
+namespace tests {
+
+// Records writes and counts flushes.
+class RecordingSink : public Sink {
+ public:
+  void write(::std::string_view bytes) override {
+    writes.emplace_back(bytes);
+    out.append(bytes);
+  }
+  void flush() override { ++flushes; }
+
+  // Each write, and all of them concatenated.
+  ::std::vector<::std::string> writes;
+  ::std::string out;
+  int flushes = 0;
+};
+
+// Blocks writes until opened.
+class GatedSink : public Sink {
+ public:
+  void write(::std::string_view bytes) override {
+    entered.store(true);
+    entered.notify_all();
+    open.wait(false);
+    out.append(bytes);
+  }
+  void flush() override { ++flushes; }
+
+  ::std::atomic<bool> entered = false;
+  ::std::atomic<bool> open = false;
+  ::std::string out;
+  int flushes = 0;
+};
+
+}  // namespace tests
+}  // namespace dump
+
+#endif // DUMP_TESTS_TEST_SINKS_HPP_
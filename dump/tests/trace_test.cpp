@@ -0,0 +1,156 @@
+// Copyright 2010-2022 Google LLC
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "dump/trace.hpp"
+
+#include <cstddef>
+#include <set>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "dump/dump.hpp"
+#include "gtest/gtest.h"
+
+namespace dump {
+namespace {
+
+// Returns the events of `trace`, checking that it is a JSON array of them.
+::std::vector<::std::string> Events(const ::std::string& trace) {
+  const ::std::string_view begin = "[\n";
+  const ::std::string_view end = "\n]\n";
+  EXPECT_EQ(begin, trace.substr(0, begin.size()));
+  EXPECT_EQ(end, trace.substr(trace.size() - end.size()));
+  ::std::vector<::std::string> events;
+  ::std::istringstream lines(
+      trace.substr(begin.size(), trace.size() - begin.size() - end.size()));
+  for (::std::string line; ::std::getline(lines, line);) {
+    if (line.back() == ',') line.pop_back();
+    EXPECT_EQ('{', line.front());
+    EXPECT_EQ('}', line.back());
+    events.push_back(line);
+  }
+  return events;
+}
+
+// Returns the number after `"key":` in `event`.
+double Number(const ::std::string& event, ::std::string_view key) {
+  ::std::string prefix = "\"";
+  prefix.append(key).append("\":");
+  return ::std::stod(event.substr(event.find(prefix) + prefix.size()));
+}
+
+TEST(ChromeTrace, Spans) {
+  ::std::ostringstream os;
+  {
+    ChromeTrace trace(os);
+    int x = 1;
+    ::std::string s = "a\"b";
+    DUMP_SPAN("outer", x, s);
+    {
+      DUMP_SPAN("inner");
+    }
+    // Arguments are evaluated when the span ends.
+    x = 2;
+  }
+  const ::std::vector<::std::string> events = Events(os.str());
+  ASSERT_EQ(2u, events.size());
+  const ::std::string& inner = events[0];
+  const ::std::string& outer = events[1];
+  EXPECT_NE(::std::string::npos,
+            inner.find(R"({"name":"inner","cat":"dump","ph":"X","ts":)"));
+  EXPECT_NE(::std::string::npos, inner.find(R"(,"args":{}})"));
+  EXPECT_NE(::std::string::npos, outer.find(R"({"name":"outer",)"));
+  EXPECT_NE(::std::string::npos,
+            outer.find(R"(,"args":{"x":2,"s":"a\"b"}})"));
+  EXPECT_EQ(Number(inner, "tid"), Number(outer, "tid"));
+  EXPECT_LE(Number(outer, "ts"), Number(inner, "ts"));
+  EXPECT_LE(Number(inner, "ts") + Number(inner, "dur"),
+            Number(outer, "ts") + Number(outer, "dur") + 0.002);
+}
+
+// Spans keep the values of their arguments when they end, not when they are
+// written.
+TEST(ChromeTrace, Deferred) {
+  ::std::ostringstream os;
+  {
+    ChromeTrace trace(os);
+    ::std::string s = "ended";
+    {
+      const ::std::string name = "span";
+      DUMP_SPAN(name, s);
+    }
+    s = "written";
+    trace.flush();
+  }
+  const ::std::vector<::std::string> events = Events(os.str());
+  ASSERT_EQ(1u, events.size());
+  EXPECT_NE(::std::string::npos, events[0].find(R"({"name":"span",)"));
+  EXPECT_NE(::std::string::npos, events[0].find(R"(,"args":{"s":"ended"}})"));
+}
+
+TEST(ChromeTrace, SameLine) {
+  ::std::ostringstream os;
+  {
+    ChromeTrace trace(os);
+    DUMP_SPAN("first"); DUMP_SPAN("second");  // NOLINT(whitespace/newline)
+  }
+  const ::std::vector<::std::string> events = Events(os.str());
+  ASSERT_EQ(2u, events.size());
+  EXPECT_NE(::std::string::npos, events[0].find(R"({"name":"second",)"));
+  EXPECT_NE(::std::string::npos, events[1].find(R"({"name":"first",)"));
+}
+
+TEST(ChromeTrace, NoTrace) {
+  int x = 1;
+  {
+    DUMP_SPAN("dropped", x);
+  }
+  ::std::ostringstream os;
+  {
+    ChromeTrace trace(os);
+  }
+  EXPECT_EQ("[\n\n]\n", os.str());
+}
+
+TEST(ChromeTrace, Threads) {
+  ::std::ostringstream os;
+  constexpr int kThreads = 4;
+  constexpr int kSpans = 1000;
+  {
+    ChromeTrace trace(os, 256);
+    ::std::vector<::std::thread> threads;
+    for (int t = 0; t < kThreads; ++t) {
+      threads.emplace_back([t] {
+        for (int i = 0; i < kSpans; ++i) {
+          DUMP_SPAN("work", t, i);
+        }
+      });
+    }
+    for (::std::thread& thread : threads) thread.join();
+    {
+      DUMP_SPAN("main");
+    }
+    trace.flush();
+  }
+  const ::std::vector<::std::string> events = Events(os.str());
+  EXPECT_EQ(static_cast<::std::size_t>(kThreads * kSpans + 1), events.size());
+  ::std::set<double> tids;
+  for (const ::std::string& event : events) tids.insert(Number(event, "tid"));
+  EXPECT_EQ(static_cast<::std::size_t>(kThreads + 1), tids.size());
+}
+
+}  // namespace
+}  // namespace dump